@@ -4,8 +4,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
 #include "wl.h"
 
+#define MAX_IOV 64
+
 typedef struct FileData FileData;
 
 struct FileData {
@@ -43,36 +50,154 @@ FileData *load_file(WL_String path)
     return data;
 }
 
+bool write_segments(FILE *stream, WL_String *segs, int count)
+{
+#ifdef _WIN32
+    for (int i = 0; i < count; i++)
+        if (fwrite(segs[i].ptr, 1, segs[i].len, stream) != (size_t) segs[i].len)
+            return false;
+    return true;
+#else
+    struct iovec iov[MAX_IOV];
+    assert(count <= MAX_IOV);
+    for (int i = 0; i < count; i++)
+        iov[i] = (struct iovec) { segs[i].ptr, segs[i].len };
+
+    int fd = fileno(stream);
+    struct iovec *cur = iov;
+    while (count > 0) {
+        ssize_t n = writev(fd, cur, count);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        while (count > 0 && (size_t) n >= cur->iov_len) {
+            n -= cur->iov_len;
+            cur++;
+            count--;
+        }
+        if (count > 0) {
+            cur->iov_base = (char*) cur->iov_base + n;
+            cur->iov_len -= n;
+        }
+    }
+    return true;
+#endif
+}
+
+void *block(void *data, void *ptr, int len)
+{
+    (void) data;
+    (void) len;
+    if (ptr) {
+        free(ptr);
+        return NULL;
+    }
+    return malloc(len);
+}
+
+void native_var(WL_Runtime *rt, void *data)
+{
+    wl_push_s64(rt, *(int64_t*) data);
+}
+
+void native_testfn(WL_Runtime *rt, void *data)
+{
+    (void) data;
+    for (int i = 0; i < wl_arg_count(rt); i++)
+        wl_push_arg(rt, i);
+}
+
+// JSON document available to the program as $data. It's
+// parsed the first time it's accessed and kept by the
+// runtime for the following ones. If it isn't valid, the
+// error is printed and the run fails.
+typedef struct {
+    FileData *file;
+    int       kept;
+    bool      invalid;
+} DataSource;
+
+void native_data(WL_Runtime *rt, void *data)
+{
+    DataSource *src = data;
+    if (src->kept >= 0) {
+        wl_push_kept(rt, src->kept);
+        return;
+    }
+    if (!wl_push_json(rt, src->file->data, src->file->size)) {
+        fprintf(stderr, "Error: Invalid data file: %s\n", wl_json_error(rt).ptr);
+        src->invalid = true;
+        wl_push_none(rt);
+        return;
+    }
+    src->kept = wl_keep(rt);
+}
+
 int main(int argc, char **argv)
 {
     char *entry_file = NULL;
+    char *data_file = NULL;
 
     bool bc = false;
     bool ast = false;
+    bool syms = false;
     bool run = true;
     for (int i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "--bc"))
             bc = true;
         else if (!strcmp(argv[i], "--ast"))
             ast = true;
+        else if (!strcmp(argv[i], "--syms"))
+            syms = true;
         else if (!strcmp(argv[i], "--no-run"))
             run = false;
+        else if (!strcmp(argv[i], "--data") && i+1 < argc)
+            data_file = argv[++i];
         else
             entry_file = argv[i];
     }
 
     if (entry_file == NULL) {
-        fprintf(stderr, "Usage: %s file.wl\n", argv[0]);
+        fprintf(stderr, "Usage: %s [--data file.json] file.wl\n", argv[0]);
         return -1;
     }
 
-    int cap = 1<<20;
+    // The JSON data is available to the program as $data
+    FileData *data = NULL;
+    DataSource source = { NULL, -1, false };
+    if (data_file) {
+        data = load_file((WL_String) { data_file, strlen(data_file) });
+        if (data == NULL) {
+            fprintf(stderr, "Couldn't open '%s'\n", data_file);
+            return -1;
+        }
+        source.file = data;
+    }
+
+    int cap = 1<<16;
     char *mem = malloc(cap);
     if (mem == NULL) {
         fprintf(stderr, "Error: Allocation failure\n");
         return -1;
     }
-    WL_Arena arena = { mem, cap, 0 };
+    WL_Arena arena = { .ptr=mem, .len=cap, .block=block };
+
+    // Host functions available to the program as $name
+    static int64_t varA = 1;
+    static int64_t varB = 7;
+    static int64_t varC = 13;
+    WL_Native natives[] = {
+        { WL_STR("varA"),   native_var,    &varA },
+        { WL_STR("varB"),   native_var,    &varB },
+        { WL_STR("varC"),   native_var,    &varC },
+        { WL_STR("testfn"), native_testfn, NULL  },
+        { WL_STR("data"),   native_data,   &source },
+    };
+    int num_natives = sizeof(natives) / sizeof(natives[0]);
+    if (data == NULL)
+        num_natives--;
 
     WL_Program program;
     {
@@ -82,6 +207,9 @@ int main(int argc, char **argv)
             return -1;
         }
 
+        for (int i = 0; i < num_natives; i++)
+            wl_compiler_bind_native(c, natives[i].name);
+
         FileData *file_head;
         FileData **file_tail = &file_head;
 
@@ -131,6 +259,17 @@ int main(int argc, char **argv)
         if (bc)
             wl_dump_program(program);
 
+        if (syms) {
+            WL_Symbol list[64];
+            int num = wl_program_symbols(program, list, 64);
+            for (int i = 0; i < num && i < 64; i++) {
+                if (list[i].type == WL_SYMBOL_CALL)
+                    printf("call %.*s (%d args)\n", list[i].name.len, list[i].name.ptr, list[i].args);
+                else
+                    printf("var %.*s\n", list[i].name.len, list[i].name.ptr);
+            }
+        }
+
         FileData *file = file_head;
         while (file) {
             FileData *next = file->next;
@@ -140,15 +279,23 @@ int main(int argc, char **argv)
     }
 
     if (run) {
-        WL_Runtime *rt = wl_runtime_init(&arena, program);
+        WL_Runtime *rt = NULL;
+        WL_PreparedProgram *p = wl_program_prepare_natives(&arena, program, natives, num_natives);
+        if (p)
+            rt = wl_runtime_init_prepared(&arena, p);
         if (rt == NULL) {
             fprintf(stderr, "Error: Invalid program or out of memory\n");
             return -1;
         }
 
         FILE *output = stdout;
+        fflush(output);
+
+        WL_String segs[MAX_IOV];
         for (bool done = false; !done; ) {
-            WL_EvalResult res = wl_runtime_eval(rt);
+            WL_EvalResult res = wl_runtime_eval_iov(rt, segs, MAX_IOV);
+            if (source.invalid)
+                return -1;
 
             //wl_runtime_dump(rt);
 
@@ -166,24 +313,23 @@ int main(int argc, char **argv)
                 return -1;
 
                 case WL_EVAL_OUTPUT:
-                fwrite(res.str.ptr, 1, res.str.len, output);
+                if (!write_segments(output, segs, res.count)) {
+                    fprintf(stderr, "Error: Couldn't write output\n");
+                    return -1;
+                }
                 break;
 
                 case WL_EVAL_SYSVAR:
-                if (wl_streq(res.str, "varA", -1)) wl_push_s64(rt, 1);
-                if (wl_streq(res.str, "varB", -1)) wl_push_s64(rt, 7);
-                if (wl_streq(res.str, "varC", -1)) wl_push_s64(rt, 13);
                 break;
 
                 case WL_EVAL_SYSCALL:
-                if (wl_streq(res.str, "testfn", -1)) {
-                    for (int i = 0; i < wl_arg_count(rt); i++)
-                        wl_push_arg(rt, i);
-                }
                 break;
             }
         }
     }
 
+    wl_arena_free(&arena);
+    free(mem);
+    free(data);
     return 0;
 }
\ No newline at end of file
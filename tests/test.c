@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
@@ -69,6 +70,9 @@ struct {
     {__LINE__, "len {a:1,b:2,c:3}", "3"},
     {__LINE__, "-12", "-12"},
     {__LINE__, "-12.34", "-12.34"},
+    {__LINE__, "140737488355327 + 1", "140737488355328"},
+    {__LINE__, "-140737488355328 - 1", "-140737488355329"},
+    {__LINE__, "9223372036854775807", "9223372036854775807"},
     {__LINE__, "1<2", "true"},
     {__LINE__, "2<1", "false"},
     {__LINE__, "1>2", "false"},
@@ -79,6 +83,7 @@ struct {
     {__LINE__, "1!=2", "true"},
     {__LINE__, "let a = 1\na", "1"},
     {__LINE__, "let a = 1\na = 2\na", "2"},
+    {__LINE__, "let a = 1\nlet b = 2\na + b", "3"},
     {__LINE__, "[5, 6, 7][0]", "5"},
     {__LINE__, "[5, 6, 7][1]", "6"},
     {__LINE__, "[5, 6, 7][2]", "7"},
@@ -88,6 +93,9 @@ struct {
     {__LINE__, "+{a:5,b:6,c:7}['a']", "5"},
     {__LINE__, "+{a:5,b:6,c:7}['b']", "6"},
     {__LINE__, "+{a:5,b:6,c:7}['c']", "7"},
+    {__LINE__, "let x = {a:5,b:6,c:7}\nx.b", "6"},
+    {__LINE__, "let x = {a:1,b:2,c:3,d:4,e:5,f:6,g:7,h:8,i:9,j:10}\nx.j = 0\nx.a\nx['i']\nx.j\nlen x", "19010"},
+    {__LINE__, "let x = {}\nlet i = 0\nwhile i < 20: {\nx[i] = i\ni = i + 1\n}\nx[17]\nfor k in x: k", "17012345678910111213141516171819"},
     {__LINE__, "let x = 1\n{\nlet x = 2\nx\n}", "2"},
     {__LINE__, "let x = {a:5,b:6,c:7}\nx.a = true\nx", "{a: true, b: 6, c: 7}"},
     {__LINE__, "let x = {a:5,b:6,c:7}\nx.b = true\nx", "{a: 5, b: true, c: 7}"},
@@ -102,8 +110,14 @@ struct {
     {__LINE__, "if 1 < 2: 1 else 2\n3", "13"},
     {__LINE__, "if 1 > 2: 1 else 2\n3", "23"},
     {__LINE__, "let i = 0\nwhile i < 3: {\ntrue\ni = i + 1\n}\n", "truetruetrue"},
+    {__LINE__, "let i = 0\n<p>hello</p>\nwhile i < 3: i = i + 1", "<p>hello</p>"},
+    {__LINE__, "let i = 0\n\"str\"\n1 + 2\nwhile i < 3: i = i + 1", "str3"},
     {__LINE__, "for a in ['A', 'B', 'C']: a", "ABC"},
+    {__LINE__, "let a = []\nlet i = 0\nwhile i < 50: {\na << i\ni = i + 1\n}\nlen a\na[0]\na[9]\na[49]", "500949"},
     {__LINE__, "for a, b in ['A', 'B', 'C']: { a\n b }", "A0B1C2"},
+    {__LINE__, "let i = 0\nwhile i < 100000: {\nlet t = [i, i, i]\ni = i + 1\n}\ni", "100000"},
+    {__LINE__, "let a = []\nfor x in ['A', 'B', 'C']: {\nlet s = [x, x]\na << s\n}\nfor y in a: y", "AABBCC"},
+    {__LINE__, "let last\nfor x in [1, 2, 3]: {\nlast = [x, x]\n}\nlast", "33"},
     {__LINE__, "for a in {x:1,y:2,z:3}: a", "xyz"},
     {__LINE__, "for a, b in {x:1,y:2,z:3}: { a\n b }", "x0y1z2"},
     {__LINE__, "procedure P() 0", ""},
@@ -116,28 +130,166 @@ struct {
     {__LINE__, "procedure P(a, b, c) { a\nb\nc }\nP(1, 2, 3)", "123"},
     {__LINE__, "procedure N(n) n\nN(1) + N(2)", "3"},
     {__LINE__, "P()\nprocedure P() 1", "1"},
+    {__LINE__, "procedure R(n) if n > 0: {\nR(n - 1)\nn\n}\nR(100)", "123456789101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899100"},
     {__LINE__, "P()\nprocedure P() 1\n{\nprocedure P() 2\n}", "1"},
     {__LINE__, "procedure P() 1\nP()\n{\nprocedure P() 2\n}", "1"},
     {__LINE__, "procedure P() 1\n{\nP()\nprocedure P() 2\n}", "2"},
     {__LINE__, "procedure P() 1\n{\nprocedure P() 2\nP()\n}", "2"},
     {__LINE__, "procedure P() 1\n{\nprocedure P() 2\n}\nP()", "1"},
+    {__LINE__, "$answer", "42"},
+    {__LINE__, "$answer + $answer", "84"},
+    {__LINE__, "$sum(1, 2, 3)", "106"},
+    {__LINE__, "$unbound", ""},
+    {__LINE__, "let d = $json\nd.a[0]\nd.a[1]\nd.a[2]\nd.a[3]\nlen d.a", "12.50true4"},
+    {__LINE__, "let d = $json\nd.s\nd.m.k", "x\ty\xC3\xA9v"},
+    {__LINE__, "$badjson", "Invalid JSON at offset 5"},
+    {__LINE__, "let d = $longjson\nd[0] > 9223372036854775807\nd[1]\nd[2] * 4\nd[3]\nd[4] > d[0]", "true1.00100.00-2.50true"},
     {__LINE__, "<a>Hello, world!</a>", "<a>Hello, world!</a>"},
+    {__LINE__, "escape 'a<b'", "a&lt;b"},
+    {__LINE__, "escape 'plain text without special characters'", "plain text without special characters"},
+    {__LINE__, "escape \"The <b>quick</b> brown & 'lazy' \\\"fox\\\" jumps over the dog <>&\"", "The &lt;b&gt;quick&lt;/b&gt; brown &amp; &#x27;lazy&#x27; &quot;fox&quot; jumps over the dog &lt;&gt;&amp;"},
+    {__LINE__, "escape '<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<'", "&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;&lt;"},
+    {__LINE__, "escape ['<', 1, 'a&b']", "&lt;1a&amp;b"},
+    {__LINE__, "escape ''", ""},
+    {__LINE__, "escape escape 'a<b'", "a&lt;b"},
+    {__LINE__, "escape <b>x</b>", "<b>x</b>"},
+    {__LINE__, "let s = 'a&b'\n<p>\\escape s</p>", "<p>a&amp;b</p>"},
+    {__LINE__, "let a = escape ['a', '&']\na[1]", "&amp;"},
+    {__LINE__, "for x in escape ['<', '>']: x", "&lt;&gt;"},
+    {__LINE__, "$strlen(escape 'a<b')\n$strlen('a<b')", "63"},
+    {__LINE__, "escape '<' == '&lt;'\nlet s = '<'\nescape s == '&lt;'", "falsefalse"},
+    {__LINE__, "escape '<' == '<'\nlet s = '<'\nescape s == '<'", "truetrue"},
+    {__LINE__, "let s = 'a<b'\n$strlen(escape 'a<b')\n$strlen(escape s)", "66"},
+    {__LINE__, "len [1, 2, 3] * 2 + 1", "7"},
+    {__LINE__, "len {a:1, b:2, a:3}", "2"},
+    {__LINE__, "'a' == 'a'\n'a' != 'b'\n1 == 1.0\n2.5 > 2", "truetruefalsetrue"},
+    {__LINE__, "-(2 - 5) * 1.5", "4.50"},
+    {__LINE__, "escape '<b>literal</b>'", "&lt;b&gt;literal&lt;/b&gt;"},
+    {__LINE__, "escape <p>\\'a<b'</p>", "<p>a&lt;b</p>"},
+    {__LINE__, "let x = escape '&'\n<p>\\x \\(1 + 1)</p>", "<p>&amp; 2</p>"},
+    {__LINE__, "procedure P() 1 + 2\nP() + 1", "4"},
+    {__LINE__, "let m = {a:1,b:\"x\"}\nm.b", "x"},
+    {__LINE__, "for i in [1, 2]: { let a = [0]\na << i\nlen a }", "22"},
+    {__LINE__, "procedure P() { let a = [1]\na << 2\na }\nP()\nP()", "1212"},
+    {__LINE__, "let m = {a:1,b:2,c:3,d:4,e:5,f:6,g:7,h:8,i:9,j:10}\nm.k = 11\nm.a = 0\nm.a + m.j + m.k", "21"},
+    {__LINE__, "procedure B(x) <b>\\x</b>\nlet x = 1\n<p>\\B(x + 1)</p>\nx", "<p><b>2</b></p>1"},
+    {__LINE__, "procedure T(a, b) { let c = a - b\nc * 2 }\nT(5, 2) + T(1, 1)", "6"},
+    {__LINE__, "procedure S(n) { let s = 0\nfor i in n: s = s + i\ns }\nfor k in [[1, 2], [3]]: S(k)", "33"},
+    {__LINE__, "procedure P(a) a\nlet a = 7\n{ let P = 1 }\nP(a)", "7"},
+    {__LINE__, "let a = [<b>x</b>, <i/>]\nlen a\na", "2<b>x</b><i/>"},
+    {__LINE__, "procedure P(a, b) { b\na }\nP(<b/>, <i>1</i>)", "<i>1</i><b/>"},
+    {__LINE__, "let h = <p>\\'a<b'</p>\nlen h", "3"},
+    {__LINE__, "procedure C(n, acc) { if n == 0: acc else C(n - 1, acc + n) }\nC(5000, 0)", "12502500"},
+    {__LINE__, "procedure R(n) if n > 0: {\nn\nR(n - 1)\n}\nlet s = R(3)\nlen s\ns", "3321"},
+    {__LINE__, "procedure P() {}\nlet x = P()\nlen x", "0"},
+    {__LINE__, "procedure P(n) for i in n: i\nlet x = P([])\nlen x\nP([4, 5])", "045"},
+    {__LINE__, "procedure P(a) for x in a: for y in a: x\nlet s = P([0, 1, 2, 3, 4, 5, 6, 7, 8, 9])\nlen s", "100"},
     {__LINE__, "<ul><li>A</li><li>B</li><li>C</li></ul>", "<ul><li>A</li><li>B</li><li>C</li></ul>"},
     {__LINE__, "let a = <ul><li>A</li><li>B</li><li>C</li></ul>", ""},
     {__LINE__, "let a = <ul><li>A</li><li>B</li><li>C</li></ul>\na", "<ul><li>A</li><li>B</li><li>C</li></ul>"},
 };
 
-int run_test(char *in, char *out, void *mem, int cap, int test_line)
+void native_answer(WL_Runtime *rt, void *data)
 {
-    WL_Arena arena = { mem, cap, 0 };
-    WL_Program program;
+    (void) data;
+    wl_push_s64(rt, 42);
+}
+
+void native_sum(WL_Runtime *rt, void *data)
+{
+    int64_t sum = *(int64_t*) data;
+    for (int i = 0; i < wl_arg_count(rt); i++) {
+        int64_t x;
+        if (wl_arg_s64(rt, i, &x))
+            sum += x;
+    }
+    wl_push_s64(rt, sum);
+}
+
+void native_strlen(WL_Runtime *rt, void *data)
+{
+    (void) data;
+    WL_String s;
+    if (wl_arg_str(rt, 0, &s))
+        wl_push_s64(rt, s.len);
+}
+
+// Invalid documents are rendered as their error, without
+// the location in wl.c where it was reported
+void native_json(WL_Runtime *rt, void *data)
+{
+    char *json = data;
+    if (!wl_push_json(rt, json, strlen(json))) {
+        WL_String e = wl_json_error(rt);
+        for (int i = 0; i < e.len; i++)
+            if (e.ptr[i] == '(') {
+                e.len = i - 1;
+                break;
+            }
+        wl_push_str(rt, e);
+    }
+}
+
+static int64_t sum_base = 100;
+
+// Numbers with more digits than fit in the conversion
+// buffer, built by init_natives
+static char long_json[1<<10];
+static WL_Native natives[6];
+
+void init_natives(void)
+{
+    char *z = "0000000000000000000000000000000000000000000000000000000000000000";
+    snprintf(long_json, sizeof(long_json), "[1%s%s%s, 1%s%s%se-192, 0.%s%s%s25e194, -25%s%s%s%se-257, 1e99999999999999999999]",
+        z, z, z, z, z, z, z, z, z, z, z, z, z);
+    natives[0] = (WL_Native) { WL_STR("answer"),  native_answer, NULL };
+    natives[1] = (WL_Native) { WL_STR("sum"),     native_sum,    &sum_base };
+    natives[2] = (WL_Native) { WL_STR("strlen"),  native_strlen, NULL };
+    natives[3] = (WL_Native) { WL_STR("json"),    native_json,
+        "{\"a\": [1, 2.5, true, null], \"s\": \"x\\ty\\u00e9\", \"m\": {\"k\": \"v\"}}" };
+    natives[4] = (WL_Native) { WL_STR("badjson"), native_json,   "[1, 2" };
+    natives[5] = (WL_Native) { WL_STR("longjson"), native_json, long_json };
+}
+
+void *block(void *data, void *ptr, int len)
+{
+    (void) data;
+    (void) len;
+    if (ptr) {
+        free(ptr);
+        return NULL;
+    }
+    return malloc(len);
+}
+
+// Number of failed tests, which sets the exit status
+static int failures = 0;
 
-    WL_Compiler *c = wl_compiler_init(&arena);
+// Reports a failed check of the API tests
+void fail(char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "Error: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    failures++;
+}
+
+// Compiles a single source file with the test natives
+// bound. Returns -1 on error.
+int compile_source(char *in, WL_Arena *arena, WL_Program *program)
+{
+    WL_Compiler *c = wl_compiler_init(arena);
     if (c == NULL) {
         fprintf(stderr, "Error: Out of memory");
         return -1;
     }
 
+    for (int i = 0; i < COUNT(natives); i++)
+        wl_compiler_bind_native(c, natives[i].name);
+
     WL_AddResult res = wl_compiler_add(c, (WL_String) { NULL, 0 }, (WL_String) { in, strlen(in) });
     if (res.type == WL_ADD_ERROR) {
         fprintf(stderr, "Error: %s\n", wl_compiler_error(c).ptr);
@@ -148,14 +300,29 @@ int run_test(char *in, char *out, void *mem, int cap, int test_line)
         return -1;
     }
 
-    int ret = wl_compiler_link(c, &program);
+    int ret = wl_compiler_link(c, program);
     if (ret < 0) {
         WL_String err = wl_compiler_error(c);
         fprintf(stderr, "Error: %s\n", err.ptr);
         return -1;
     }
 
-    WL_Runtime *rt = wl_runtime_init(&arena, program);
+    return 0;
+}
+
+int run_test_in(char *in, char *out, WL_Arena *arena, int test_line)
+{
+    WL_Program program;
+    if (compile_source(in, arena, &program) < 0)
+        return -1;
+
+    WL_PreparedProgram *p = wl_program_prepare_natives(arena, program, natives, COUNT(natives));
+    if (p == NULL) {
+        fprintf(stderr, "Error: Invalid program or out of memory\n");
+        return -1;
+    }
+
+    WL_Runtime *rt = wl_runtime_init_prepared(arena, p);
     if (rt == NULL) {
         fprintf(stderr, "Error: Invalid program or out of memory\n");
         return -1;
@@ -213,16 +380,533 @@ int run_test(char *in, char *out, void *mem, int cap, int test_line)
     return 1;
 }
 
+// The arena starts small so that most tests also go
+// through the chaining of blocks
+int run_test(char *in, char *out, void *mem, int cap, int test_line)
+{
+    WL_Arena arena = { .ptr=mem, .len=cap, .block=block };
+    int ret = run_test_in(in, out, &arena, test_line);
+    wl_arena_free(&arena);
+    return ret;
+}
+
+typedef struct {
+
+    // If not 0, the output is written into buffers of this
+    // many bytes using wl_runtime_set_output, which are
+    // checked to only be reported partially full at the end
+    int chunk;
+
+    // If not 0, the runtime goes back to returning values
+    // one by one after this many output events
+    int switch_at;
+
+    // If not 0, the program is evaluated with
+    // wl_runtime_eval_iov using up to this many segments
+    // per event
+    int max_iov;
+
+    // If set, the program must fail with an error that
+    // starts with this text
+    char *error;
+
+    // Called to push the value of external variables that
+    // aren't bound to native functions
+    void (*sysvar)(WL_Runtime *rt, WL_String name, void *data);
+    void *data;
+
+    // Set to the number of output events
+    int events;
+
+} EvalOpts;
+
+// Evaluates a program until it completes, appending the
+// output to "dst". This is the loop shared by the API tests,
+// which only differ in how the runtime is driven. Returns
+// the length of the output, or -1 after reporting a failure.
+int eval_program(WL_Runtime *rt, EvalOpts *opts, char *dst, int cap)
+{
+    // Two buffers are used alternately to check that the
+    // buffer can be replaced after each event
+    char bufs[2][64];
+    int  cur = 0;
+    int  chunk = opts->chunk;
+    if (chunk > 0)
+        wl_runtime_set_output(rt, bufs[cur], chunk);
+
+    WL_String iov[64];
+    if (opts->max_iov > COUNT(iov)) {
+        fail("Too many segments per event (%d)", opts->max_iov);
+        return -1;
+    }
+
+    int len = 0;
+    bool partial = false;
+    opts->events = 0;
+    for (;;) {
+        WL_EvalResult res;
+        if (opts->max_iov > 0)
+            res = wl_runtime_eval_iov(rt, iov, opts->max_iov);
+        else {
+            res = wl_runtime_eval(rt);
+            iov[0] = res.str;
+            res.count = 1;
+        }
+        if (res.type == WL_EVAL_DONE)
+            break;
+        if (res.type == WL_EVAL_ERROR) {
+            WL_String msg = wl_runtime_error(rt);
+            char *err = opts->error;
+            if (err == NULL || msg.len < (int) strlen(err) || memcmp(msg.ptr, err, strlen(err)))
+                fail("%s", msg.ptr);
+            return -1;
+        }
+        if (res.type == WL_EVAL_SYSVAR && opts->sysvar)
+            opts->sysvar(rt, res.str, opts->data);
+        if (res.type != WL_EVAL_OUTPUT)
+            continue;
+
+        if (res.count < 1 || (opts->max_iov > 0 && res.count > opts->max_iov)) {
+            fail("Invalid segment count %d (max %d)", res.count, opts->max_iov);
+            return -1;
+        }
+
+        if (chunk > 0) {
+            if (res.count > 1 || iov[0].ptr != bufs[cur] || iov[0].len > chunk) {
+                fail("Output not written to the buffer (chunk %d)", chunk);
+                return -1;
+            }
+            if (partial) {
+                fail("Buffer reported before it was full (chunk %d)", chunk);
+                return -1;
+            }
+            partial = (iov[0].len < chunk);
+        }
+
+        for (int i = 0; i < res.count; i++) {
+            if (cap - len < iov[i].len) {
+                fail("Output is too long");
+                return -1;
+            }
+            memcpy(dst + len, iov[i].ptr, iov[i].len);
+            len += iov[i].len;
+        }
+
+        opts->events++;
+        if (chunk > 0) {
+            if (opts->events == opts->switch_at) {
+                chunk = 0;
+                wl_runtime_set_output(rt, NULL, 0);
+            } else {
+                cur = 1 - cur;
+                wl_runtime_set_output(rt, bufs[cur], chunk);
+            }
+        }
+    }
+
+    if (opts->error) {
+        fail("Expected error [%s]", opts->error);
+        return -1;
+    }
+    return len;
+}
+
+// Programs only refer to native functions by name, so
+// they can't be prepared unless the host provides them
+void test_native_registry(void *mem, int cap)
+{
+    WL_Arena arena = { .ptr=mem, .len=cap, .block=block };
+
+    WL_Program program;
+    if (compile_source("$answer + $sum(1)", &arena, &program) < 0)
+        fail("Couldn't compile the native registry test");
+    else {
+
+        int mark = wl_arena_mark(&arena);
+
+        if (wl_program_prepare(&arena, program) != NULL)
+            fail("Program with unresolved natives was prepared");
+
+        if (wl_program_prepare_natives(&arena, program, natives + 1, COUNT(natives) - 1) != NULL)
+            fail("Program with a missing native was prepared");
+
+        if (wl_arena_mark(&arena) != mark)
+            fail("Failed preparations didn't free their memory");
+
+        if (wl_program_prepare_natives(&arena, program, natives, COUNT(natives)) == NULL)
+            fail("Couldn't prepare program with natives");
+    }
+
+    wl_arena_free(&arena);
+}
+
+WL_PreparedProgram *prepare_source(char *src, WL_Arena *arena)
+{
+    WL_Program program;
+    if (compile_source(src, arena, &program) < 0) {
+        fail("Couldn't compile [%s]", src);
+        return NULL;
+    }
+
+    WL_PreparedProgram *p = wl_program_prepare_natives(arena, program, natives, COUNT(natives));
+    if (p == NULL)
+        fail("Couldn't prepare [%s]", src);
+    return p;
+}
+
+static char *output_test_src =
+    "let a = [1, 2.5, \"xyz\", true]\n"
+    "<ul>\\for x in a: <li>\\x</li></ul>\n"
+    "for x in a: { x\n$answer }\n"
+    "\"a string that is longer than the smaller buffers\"\n"
+    "1234567890123\n"
+    "$answer";
+
+// Output written into a buffer must be the same as the
+// output returned value by value, whatever the size of
+// the buffer and even if the runtime switches back to
+// returning values
+void test_output_buffer(void *mem, int cap)
+{
+    WL_Arena arena = { .ptr=mem, .len=cap, .block=block };
+
+    WL_PreparedProgram *p = prepare_source(output_test_src, &arena);
+    if (p == NULL) {
+        wl_arena_free(&arena);
+        return;
+    }
+
+    char expected[1<<10];
+    int  expected_len = -1;
+    EvalOpts opts = { 0 };
+    WL_Runtime *rt = wl_runtime_init_prepared(&arena, p);
+    if (rt)
+        expected_len = eval_program(rt, &opts, expected, sizeof(expected));
+
+    int chunks[] = { 1, 2, 5, 16, 64 };
+    for (int i = 0; i < COUNT(chunks) && expected_len >= 0; i++) {
+        for (int switch_at = 0; switch_at < 4; switch_at++) {
+
+            char output[1<<10];
+            int  len = -1;
+            EvalOpts opts = { .chunk=chunks[i], .switch_at=switch_at };
+            WL_Runtime *rt = wl_runtime_init_prepared(&arena, p);
+            if (rt)
+                len = eval_program(rt, &opts, output, sizeof(output));
+
+            if (len != expected_len || memcmp(output, expected, len)) {
+                fail("Buffered output mismatch (chunk %d, switch at %d)", chunks[i], switch_at);
+                fprintf(stderr, "  Output  : [%.*s]\n", len, output);
+                fprintf(stderr, "  Expected: [%.*s]\n", expected_len, expected);
+            }
+        }
+    }
+
+    wl_arena_free(&arena);
+}
+
+// Output segments returned in batches must add up to the
+// output returned value by value. Batches are limited by
+// the number of segments and by the room for formatting
+// numbers, so a long list of numbers takes more than one.
+void test_output_iov(void *mem, int cap)
+{
+    WL_Arena arena = { .ptr=mem, .len=cap, .block=block };
+
+    static char *srcs[] = {
+        NULL,
+        "let a = [0, 1, 2, 3, 4, 5, 6, 7, 8, 9]\n"
+        "<p>\\for x in a: for y in a: <b>\\x * 100000 + y</b></p>",
+    };
+    srcs[0] = output_test_src;
+
+    for (int i = 0; i < COUNT(srcs); i++) {
+
+        WL_PreparedProgram *p = prepare_source(srcs[i], &arena);
+        if (p == NULL)
+            continue;
+
+        char expected[1<<12];
+        int  expected_len = -1;
+        EvalOpts expected_opts = { .max_iov=1 };
+        WL_Runtime *rt = wl_runtime_init_prepared(&arena, p);
+        if (rt)
+            expected_len = eval_program(rt, &expected_opts, expected, sizeof(expected));
+
+        int maxes[] = { 2, 3, 64 };
+        for (int j = 0; j < COUNT(maxes) && expected_len >= 0; j++) {
+
+            char output[1<<12];
+            int  len = -1;
+            EvalOpts opts = { .max_iov=maxes[j] };
+            WL_Runtime *rt = wl_runtime_init_prepared(&arena, p);
+            if (rt)
+                len = eval_program(rt, &opts, output, sizeof(output));
+
+            if (len != expected_len || memcmp(output, expected, len))
+                fail("Output mismatch with %d segments per event (test %d)", maxes[j], i);
+            else if (opts.events >= expected_opts.events)
+                fail("Segments weren't batched (%d events with %d segments, %d with 1, test %d)",
+                    opts.events, maxes[j], expected_opts.events, i);
+        }
+
+        // Single values must match wl_runtime_eval
+        char single[1<<12];
+        int  single_len = -1;
+        EvalOpts opts = { 0 };
+        rt = wl_runtime_init_prepared(&arena, p);
+        if (rt)
+            single_len = eval_program(rt, &opts, single, sizeof(single));
+        if (single_len != expected_len || memcmp(single, expected, single_len))
+            fail("Single segment output differs from wl_runtime_eval (test %d)", i);
+    }
+
+    wl_arena_free(&arena);
+}
+
+// A runtime that is reset must produce the same output
+// again and give back all the memory the previous run
+// allocated from the arena
+void test_runtime_reset(void *mem, int cap)
+{
+    WL_Arena arena = { .ptr=mem, .len=cap, .block=block };
+
+    WL_PreparedProgram *p = prepare_source(
+        "let a = []\n"
+        "let i = 0\n"
+        "while i < 200: { a << [i, [i * 1000000, 2.5]]\ni = i + 1 }\n"
+        "len a\n"
+        "$json", &arena);
+    if (p == NULL) {
+        wl_arena_free(&arena);
+        return;
+    }
+
+    int before = wl_arena_mark(&arena);
+    WL_Runtime *rt = wl_runtime_init_prepared(&arena, p);
+    if (rt == NULL) {
+        fail("Couldn't create runtime");
+        wl_arena_free(&arena);
+        return;
+    }
+    int after_init = wl_arena_mark(&arena);
+
+    EvalOpts opts = { 0 };
+    char first[1<<10];
+    int  first_len = eval_program(rt, &opts, first, sizeof(first));
+    int  after_run = wl_arena_mark(&arena);
+    if (after_run <= after_init)
+        fail("Program didn't allocate from the arena");
+
+    for (int i = 0; i < 3; i++) {
+
+        wl_runtime_reset(rt);
+        if (wl_arena_mark(&arena) != after_init)
+            fail("Reset didn't free the memory of the previous run");
+
+        char output[1<<10];
+        int  len = eval_program(rt, &opts, output, sizeof(output));
+        if (len < 0 || len != first_len || memcmp(output, first, len))
+            fail("Output after reset differs from the first run");
+        if (wl_arena_mark(&arena) != after_run)
+            fail("Run after reset used a different amount of memory");
+    }
+
+    // Rewinding the arena frees the runtime itself
+    wl_arena_reset_to(&arena, before);
+    if (wl_arena_mark(&arena) != before)
+        fail("Arena wasn't rewound to the mark");
+
+    wl_arena_free(&arena);
+}
+
+// Runs the program with the given limits and checks that it
+// outputs "out" or, if "err" is set, fails with that error
+void check_limits(WL_PreparedProgram *p, WL_Arena *arena, int max_stack, int max_frames, char *out, char *err)
+{
+    WL_Runtime *rt = wl_runtime_init_limits(arena, p, max_stack, max_frames);
+    if (rt == NULL) {
+        fail("Couldn't create runtime (limits %d, %d)", max_stack, max_frames);
+        return;
+    }
+
+    char output[1<<10];
+    EvalOpts opts = { .error=err };
+    int len = eval_program(rt, &opts, output, sizeof(output));
+    if (len < 0) {
+        fprintf(stderr, "  (limits %d, %d)\n", max_stack, max_frames);
+        return;
+    }
+
+    if (len != (int) strlen(out) || memcmp(output, out, len))
+        fail("Output [%.*s] instead of [%s] (limits %d, %d)", len, output, out, max_stack, max_frames);
+}
+
+// The value stack and call stack grow on demand up to the
+// limits given to wl_runtime_init_limits
+void test_runtime_limits(void *mem, int cap)
+{
+    WL_Arena arena = { .ptr=mem, .len=cap, .block=block };
+
+    // The recursive call isn't in tail position, so each
+    // level takes a frame and a slot of the value stack for
+    // its argument. The values output by the levels then
+    // stay on the stack until the end.
+    WL_PreparedProgram *p = prepare_source(
+        "procedure R(n) if n > 0: {\nR(n - 1)\nn % 10\n}\n"
+        "R(1000)", &arena);
+    if (p == NULL) {
+        wl_arena_free(&arena);
+        return;
+    }
+
+    char expected[1001];
+    for (int i = 0; i < 1000; i++)
+        expected[i] = '0' + (i + 1) % 10;
+    expected[1000] = '\0';
+
+    // The global frame and one for each level from 1000 to 0
+    check_limits(p, &arena, 1<<12, 1<<11, expected, NULL);
+    check_limits(p, &arena, 1<<12, 1002,  expected, NULL);
+    check_limits(p, &arena, 1<<12, 1001,  NULL, "Call stack limit reached");
+    check_limits(p, &arena, 1<<9,  1<<11, NULL, "Out of stack");
+
+    if (wl_runtime_init_limits(&arena, p, -1, 0) != NULL)
+        fail("Runtime created with negative limits");
+
+    wl_arena_free(&arena);
+}
+
+// The symbol table lists each external variable once and
+// each external function once per number of arguments,
+// leaving out names bound to native functions
+void test_program_symbols(void *mem, int cap)
+{
+    WL_Arena arena = { .ptr=mem, .len=cap, .block=block };
+
+    WL_Program program;
+    if (compile_source("$title\n$fmt(1)\n$fmt(1, 2)\n$title\n$fmt(3)\n$answer\n$sum(1)", &arena, &program) < 0) {
+        fail("Couldn't compile the symbols test");
+        wl_arena_free(&arena);
+        return;
+    }
+
+    struct {
+        WL_SymbolType type;
+        char *name;
+        int   args;
+    } expected[] = {
+        { WL_SYMBOL_VAR,  "title", 0 },
+        { WL_SYMBOL_CALL, "fmt",   1 },
+        { WL_SYMBOL_CALL, "fmt",   2 },
+    };
+
+    WL_Symbol list[8];
+    int num = wl_program_symbols(program, list, COUNT(list));
+    if (num != COUNT(expected))
+        fail("Program has %d symbols instead of %d", num, COUNT(expected));
+    else {
+        for (int i = 0; i < num; i++) {
+            if (list[i].type != expected[i].type
+                || !wl_streq(list[i].name, expected[i].name, -1)
+                || (list[i].type == WL_SYMBOL_CALL && list[i].args != expected[i].args))
+                fail("Symbol %d is [%.*s] instead of [%s]", i, list[i].name.len, list[i].name.ptr, expected[i].name);
+        }
+    }
+
+    // The total is returned even if the list is too short
+    WL_Symbol first;
+    if (wl_program_symbols(program, &first, 1) != COUNT(expected) || !wl_streq(first.name, "title", -1))
+        fail("Symbols not truncated correctly");
+
+    WL_Program truncated = { program.ptr, program.len / 2 };
+    if (wl_program_symbols(truncated, list, COUNT(list)) != -1)
+        fail("Symbols listed for an invalid program");
+
+    wl_arena_free(&arena);
+}
+
+// Pushes the document of the kept values test, which is
+// only parsed the first time it's accessed
+typedef struct {
+    char *json;
+    int   parses;
+    int   kept;
+} KeptDocument;
+
+void sysvar_kept(WL_Runtime *rt, WL_String name, void *data)
+{
+    (void) name;
+    KeptDocument *doc = data;
+    if (doc->kept < 0) {
+        doc->parses++;
+        wl_push_json(rt, doc->json, strlen(doc->json));
+        doc->kept = wl_keep(rt);
+    } else
+        wl_push_kept(rt, doc->kept);
+}
+
+// A value kept with wl_keep can be pushed again by later
+// events without being rebuilt, even when it was built
+// during a loop iteration whose memory is reclaimed
+void test_kept_values(void *mem, int cap)
+{
+    WL_Arena arena = { .ptr=mem, .len=cap, .block=block };
+
+    WL_PreparedProgram *p = prepare_source(
+        "let i = 0\n"
+        "while i < 3: {\n"
+        "$doc.a[i]\n"
+        "let t = [i, i, i, i]\n"
+        "i = i + 1\n"
+        "}\n"
+        "$doc.s", &arena);
+    WL_Runtime *rt = p ? wl_runtime_init_prepared(&arena, p) : NULL;
+    if (rt == NULL) {
+        wl_arena_free(&arena);
+        return;
+    }
+
+    KeptDocument doc = { "{\"a\": [\"x\", \"y\", \"z\"], \"s\": \"w\"}", 0, -1 };
+    EvalOpts opts = { .sysvar=sysvar_kept, .data=&doc };
+
+    char output[64];
+    int  len = eval_program(rt, &opts, output, sizeof(output));
+
+    if (doc.kept < 0 || doc.parses != 1)
+        fail("Document was parsed %d times", doc.parses);
+    if (len >= 0 && (len != 4 || memcmp(output, "xyzw", 4)))
+        fail("Output [%.*s] instead of [xyzw] with kept value", len, output);
+
+    wl_arena_free(&arena);
+}
+
 int main(void)
 {
-    int cap = 1<<20;
+    int cap = 1<<12;
     char *mem = malloc(cap);
     if (mem == NULL)
         return -1;
 
+    init_natives();
+
     for (int i = 0; i < COUNT(tests); i++)
-        run_test(tests[i].in, tests[i].out, mem, cap, tests[i].line);
+        if (run_test(tests[i].in, tests[i].out, mem, cap, tests[i].line) != 1)
+            failures++;
+
+    test_native_registry(mem, cap);
+    test_output_buffer(mem, cap);
+    test_output_iov(mem, cap);
+    test_runtime_reset(mem, cap);
+    test_runtime_limits(mem, cap);
+    test_program_symbols(mem, cap);
+    test_kept_values(mem, cap);
 
     free(mem);
+
+    if (failures > 0) {
+        fprintf(stderr, "%d tests failed\n", failures);
+        return -1;
+    }
     return 0;
 }
@@ -2,8 +2,21 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <stdbool.h>
 
+// The HTML escape routine uses SSE2 or AVX2 when the
+// compiler targets them, unless WL_NO_SIMD is defined
+#if defined(__GNUC__) && !defined(WL_NO_SIMD)
+#if defined(__AVX2__)
+#define ESCAPE_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#define ESCAPE_SSE2
+#include <emmintrin.h>
+#endif
+#endif
+
 #ifndef WL_NOINCLUDE
 #include "wl.h"
 #endif
@@ -146,23 +159,175 @@ static void report(Error *err, char *file, int line, char *fmt, ...)
 // ARENA
 /////////////////////////////////////////////////////////////////////////
 
+// Arenas with a block function are a chain of blocks. Each
+// block obtained from the host starts with a header that
+// holds the state of the arena from before the block was
+// added. Positions (marks) are relative to the start of
+// the chain: each block begins where the previous one ends
+// so that they keep growing as more blocks are added.
+#define ARENA_MIN_BLOCK (1<<12)
+
+typedef struct ArenaBlock ArenaBlock;
+struct ArenaBlock {
+    int   size; // Number of bytes obtained from the host
+    char *ptr;
+    int   len;
+    int   cur;
+    int   base;
+    void *chain;
+};
+
+static void arena_free_block(WL_Arena *a, ArenaBlock *b)
+{
+    a->block(a->block_data, b, b->size);
+}
+
+// Continues the arena in a new block with at least "len"
+// free bytes. Fails if positions in the new block wouldn't
+// fit in an int.
+static bool arena_grow(WL_Arena *a, int len)
+{
+    if (a->block == NULL)
+        return false;
+
+    if (a->base > INT_MAX - a->len)
+        return false;
+
+    // Number of bytes the chain can still grow by
+    int room = INT_MAX - (a->base + a->len);
+
+    int hdr = (SIZEOF(ArenaBlock) + 15) & ~15;
+    if (len > room - hdr)
+        return false;
+
+    ArenaBlock *b = a->spare;
+    if (b && b->size - hdr >= len && b->size - hdr <= room)
+        a->spare = NULL;
+    else {
+        int size = MAX(hdr + len, ARENA_MIN_BLOCK);
+        if (a->len < INT_MAX / 2 && size < 2 * a->len)
+            size = 2 * a->len;
+        if (size - hdr > room)
+            size = room + hdr;
+
+        b = a->block(a->block_data, NULL, size);
+        if (b == NULL)
+            return false;
+        b->size = size;
+    }
+
+    b->ptr   = a->ptr;
+    b->len   = a->len;
+    b->cur   = a->cur;
+    b->base  = a->base;
+    b->chain = a->chain;
+
+    a->base += a->len;
+    a->ptr   = (char*) b + hdr;
+    a->len   = b->size - hdr;
+    a->cur   = 0;
+    a->chain = b;
+    return true;
+}
+
 static void *alloc(WL_Arena *a, int len, int align)
 {
     int pad = -(intptr_t) (a->ptr + a->cur) & (align-1);
-    if (a->len - a->cur < len + pad)
-        return NULL;
+    if (a->len - a->cur < len + pad) {
+        if (len > INT_MAX - align || !arena_grow(a, len + align))
+            return NULL;
+        pad = -(intptr_t) (a->ptr + a->cur) & (align-1);
+    }
     void *ret = a->ptr + a->cur + pad;
     a->cur += pad + len;
     return ret;
 }
 
-static bool grow_alloc(WL_Arena *a, char *p, int new_len)
+// Resizes the last allocation "p" from the arena to
+// "new_len" bytes. If it can't be extended in place,
+// the first "old_len" bytes are moved to a new block.
+// Returns the new location or NULL if out of memory.
+static void *grow_alloc(WL_Arena *a, void *p, int old_len, int new_len)
 {
-    int new_cur = (p - a->ptr) + new_len;
-    if (new_cur > a->len)
-        return false;
-    a->cur = new_cur;
-    return true;
+    int new_cur = ((char*) p - a->ptr) + new_len;
+    if (new_cur <= a->len) {
+        a->cur = new_cur;
+        return p;
+    }
+
+    void *q = alloc(a, new_len, 8);
+    if (q == NULL)
+        return NULL;
+    memcpy(q, p, old_len);
+    return q;
+}
+
+// Returns true if "p" points to memory that was
+// allocated from the arena after position "mark".
+static bool arena_allocated_after(WL_Arena *a, void *p, int mark)
+{
+    char *ptr   = a->ptr;
+    int   cur   = a->cur;
+    int   base  = a->base;
+    ArenaBlock *b = a->chain;
+
+    for (;;) {
+        if (base + cur <= mark)
+            return false;
+        int lo = MAX(mark - base, 0);
+        if ((char*) p >= ptr + lo && (char*) p < ptr + cur)
+            return true;
+        if (b == NULL || mark >= base)
+            return false;
+        ptr  = b->ptr;
+        cur  = b->cur;
+        base = b->base;
+        b    = b->chain;
+    }
+}
+
+int wl_arena_mark(WL_Arena *a)
+{
+    return a->base + a->cur;
+}
+
+void wl_arena_reset_to(WL_Arena *a, int mark)
+{
+    ASSERT(mark >= 0 && mark <= a->base + a->cur);
+
+    while (mark < a->base) {
+
+        ArenaBlock *b = a->chain;
+        ASSERT(b);
+
+        a->ptr   = b->ptr;
+        a->len   = b->len;
+        a->cur   = b->cur;
+        a->base  = b->base;
+        a->chain = b->chain;
+
+        // Keep the largest block around so that loops
+        // crossing a block boundary don't go back to
+        // the host on every iteration.
+        ArenaBlock *spare = a->spare;
+        if (spare == NULL || spare->size < b->size) {
+            a->spare = b;
+            b = spare;
+        }
+        if (b)
+            arena_free_block(a, b);
+    }
+
+    a->cur = mark - a->base;
+}
+
+void wl_arena_free(WL_Arena *a)
+{
+    wl_arena_reset_to(a, 0);
+    if (a->spare) {
+        arena_free_block(a, a->spare);
+        a->spare = NULL;
+    }
 }
 
 #if 0
@@ -354,6 +519,7 @@ struct Node {
     uint64_t ival;
     double   fval;
     String   sval;
+    bool     trusted; // The string is HTML and is never escaped
 
     String html_tag;
     Node*  html_attr;
@@ -620,8 +786,7 @@ static Token next_token(Parser *p)
             if (buf == NULL)
                 buf = alloc(p->arena, substr_len+1, 1);
             else
-                if (!grow_alloc(p->arena, buf, len + substr_len+1))
-                    buf = NULL;
+                buf = grow_alloc(p->arena, buf, len, len + substr_len+1);
 
             if (buf == NULL) {
                 parser_report(p, "Out of memory");
@@ -778,6 +943,7 @@ static Node *parse_html(Parser *p)
 
             child->type = NODE_VALUE_STR;
             child->sval = (String) { p->s.src + off, p->s.cur - off };
+            child->trusted = true;
 
             *attr_tail = child;
             attr_tail = &child->next;
@@ -835,6 +1001,7 @@ static Node *parse_html(Parser *p)
 
                 child->type = NODE_VALUE_STR;
                 child->sval = (String) { p->s.src + off, p->s.cur - off };
+                child->trusted = true;
 
                 *child_tail = child;
                 child_tail = &child->next;
@@ -988,6 +1155,7 @@ static Node *parse_map(Parser *p)
 
                 key->type = NODE_VALUE_STR;
                 key->sval = t.sval;
+                key->trusted = false;
 
             } else {
 
@@ -1209,6 +1377,7 @@ static Node *parse_atom(Parser *p)
 
             node->type = NODE_VALUE_STR;
             node->sval = t.sval;
+            node->trusted = false;
 
             ret = node;
         }
@@ -1348,6 +1517,7 @@ static Node *parse_atom(Parser *p)
 
             child->type = NODE_VALUE_STR;
             child->sval = t.sval;
+            child->trusted = false;
 
             Node *parent = alloc_node(p);
             if (parent == NULL)
@@ -2227,736 +2397,781 @@ static ParseResult parse(String src, WL_Arena *arena, char *errbuf, int errmax)
 }
 
 /////////////////////////////////////////////////////////////////////////
-// CODEGEN
+// CONSTANT FOLDING
 /////////////////////////////////////////////////////////////////////////
 
-enum {
-    OPCODE_NOPE,
-    OPCODE_JUMP,
-    OPCODE_JIFP,
-    OPCODE_OUTPUT,
-    OPCODE_SYSVAR,
-    OPCODE_SYSCALL,
-    OPCODE_CALL,
-    OPCODE_RET,
-    OPCODE_GROUP,
-    OPCODE_ESCAPE,
-    OPCODE_PACK,
-    OPCODE_GPOP,
-    OPCODE_FOR,
-    OPCODE_EXIT,
-    OPCODE_VARS,
-    OPCODE_POP,
-    OPCODE_SETV,
-    OPCODE_PUSHV,
-    OPCODE_PUSHI,
-    OPCODE_PUSHF,
-    OPCODE_PUSHS,
-    OPCODE_PUSHA,
-    OPCODE_PUSHM,
-    OPCODE_PUSHN,
-    OPCODE_PUSHT,
-    OPCODE_PUSHFL,
-    OPCODE_LEN,
-    OPCODE_NEG,
-    OPCODE_EQL,
-    OPCODE_NQL,
-    OPCODE_LSS,
-    OPCODE_GRT,
-    OPCODE_ADD,
-    OPCODE_SUB,
-    OPCODE_MUL,
-    OPCODE_DIV,
-    OPCODE_MOD,
-    OPCODE_APPEND,
-    OPCODE_INSERT1,
-    OPCODE_INSERT2,
-    OPCODE_SELECT,
-};
+// Before code generation, expressions that only involve
+// literals are replaced by their result. Operations are
+// evaluated with the same rules as the runtime and are
+// left to it when they would fail or overflow.
 
-typedef struct UnpatchedCall UnpatchedCall;
-struct UnpatchedCall {
-    UnpatchedCall *next;
-    String         name;
-    int            off;
-};
+static void write_text_escaped(Writer *w, String str);
 
-typedef enum {
-    SYMBOL_VARIABLE,
-    SYMBOL_PROCEDURE,
-} SymbolType;
+static bool fold_is_const(Node *node)
+{
+    switch (node->type) {
+        case NODE_VALUE_INT:
+        case NODE_VALUE_FLOAT:
+        case NODE_VALUE_STR:
+        case NODE_VALUE_NONE:
+        case NODE_VALUE_TRUE:
+        case NODE_VALUE_FALSE:
+        return true;
 
-typedef struct {
-    SymbolType type;
-    String     name;
-    bool       cnst;
-    int        off;
-} Symbol;
+        default:
+        break;
+    }
+    return false;
+}
 
-typedef enum {
-    SCOPE_IF,
-    SCOPE_ELSE,
-    SCOPE_FOR,
-    SCOPE_WHILE,
-    SCOPE_PROC,
-    SCOPE_COMPOUND,
-    SCOPE_GLOBAL,
-    SCOPE_ASSIGNMENT,
-} ScopeType;
+static bool fold_is_number(Node *node)
+{
+    return node->type == NODE_VALUE_INT
+        || node->type == NODE_VALUE_FLOAT;
+}
 
-typedef struct {
-    ScopeType type;
-    int idx_syms;
-    int max_vars;
-    UnpatchedCall *calls;
-} Scope;
+// Returns true if the node is a constant or an HTML
+// element whose attributes and children are all static
+static bool fold_is_text(Node *node)
+{
+    if (fold_is_const(node))
+        return true;
 
-#define MAX_SYMBOLS 1024
-#define MAX_SCOPES 128
-#define MAX_UNPATCHED_CALLS 32
+    if (node->type != NODE_VALUE_HTML)
+        return false;
 
-typedef struct {
+    for (Node *child = node->html_attr; child; child = child->next)
+        if (!fold_is_text(child))
+            return false;
 
-    Writer code;
-    Writer data;
+    for (Node *child = node->html_child; child; child = child->next)
+        if (!fold_is_text(child))
+            return false;
 
-    int num_scopes;
-    Scope scopes[MAX_SCOPES];
+    return true;
+}
 
-    int num_syms;
-    Symbol syms[MAX_SYMBOLS];
+static double fold_to_f64(Node *node)
+{
+    if (node->type == NODE_VALUE_INT)
+        return (double) (int64_t) node->ival;
+    return node->fval;
+}
 
-    UnpatchedCall *free_list_calls;
-    UnpatchedCall calls[MAX_UNPATCHED_CALLS];
+// Same as value_eql
+static bool fold_eql(Node *a, Node *b)
+{
+    if (a->type != b->type)
+        return false;
 
-    bool  err;
-    char *errmsg;
-    int   errcap;
+    switch (a->type) {
+        case NODE_VALUE_INT  : return a->ival == b->ival;
+        case NODE_VALUE_FLOAT: return a->fval == b->fval;
+        case NODE_VALUE_STR  : return streq(a->sval, b->sval);
+        default: break;
+    }
+    return true;
+}
 
-    int data_off;
+static void fold_bool(Node *node, bool x)
+{
+    node->type = x ? NODE_VALUE_TRUE : NODE_VALUE_FALSE;
+}
 
-} Codegen;
+// Replaces "node" with "src" while keeping its position
+// in the list it belongs to
+static void fold_replace(Node *node, Node *src)
+{
+    Node *next = node->next;
+    *node = *src;
+    node->next = next;
+}
 
-static void cg_report(Codegen *cg, char *fmt, ...)
+static void fold_arith(Node *node)
 {
-    if (cg->err) return;
+    Node *l = node->left;
+    Node *r = node->right;
+    if (!fold_is_number(l) || !fold_is_number(r))
+        return;
 
-    va_list args;
-    va_start(args, fmt);
-    int len = vsnprintf(cg->errmsg, cg->errcap, fmt, args);
-    va_end(args);
+    if (l->type == NODE_VALUE_INT && r->type == NODE_VALUE_INT) {
 
-    if (len > cg->errcap)
-        len = cg->errcap-1;
+        int64_t u = l->ival;
+        int64_t v = r->ival;
+        int64_t x;
+        switch (node->type) {
 
-    cg->errmsg[len] = '\0';
-    cg->err = true;
-}
+            case NODE_OPER_ADD:
+            if (__builtin_add_overflow(u, v, &x))
+                return;
+            break;
 
-static int cg_write_u8(Codegen *cg, uint8_t x)
-{
-    if (cg->err) return -1;
+            case NODE_OPER_SUB:
+            if (__builtin_sub_overflow(u, v, &x))
+                return;
+            break;
 
-    int off = cg->code.len;
-    write_raw_u8(&cg->code, x);
-    return off;
-}
+            case NODE_OPER_MUL:
+            if (__builtin_mul_overflow(u, v, &x))
+                return;
+            break;
 
-static int cg_write_u32(Codegen *cg, uint32_t x)
-{
-    if (cg->err) return -1;
+            case NODE_OPER_DIV:
+            case NODE_OPER_MOD:
+            if (v == 0 || (u == INT64_MIN && v == -1))
+                return;
+            x = (node->type == NODE_OPER_DIV) ? u / v : u % v;
+            break;
 
-    int off = cg->code.len;
-    write_raw_u32(&cg->code, x);
-    return off;
-}
+            default:
+            UNREACHABLE;
+        }
 
-static int cg_write_s64(Codegen *cg, int64_t x)
-{
-    if (cg->err) return -1;
+        node->type = NODE_VALUE_INT;
+        node->ival = x;
+        return;
+    }
 
-    int off = cg->code.len;
-    write_raw_s64(&cg->code, x);
-    return off;
+    double u = fold_to_f64(l);
+    double v = fold_to_f64(r);
+    double x;
+    switch (node->type) {
+        case NODE_OPER_ADD: x = u + v; break;
+        case NODE_OPER_SUB: x = u - v; break;
+        case NODE_OPER_MUL: x = u * v; break;
+        case NODE_OPER_DIV: x = u / v; break;
+        case NODE_OPER_MOD: return; // Integers only
+        default: UNREACHABLE;
+    }
+
+    node->type = NODE_VALUE_FLOAT;
+    node->fval = x;
 }
 
-static int cg_write_f64(Codegen *cg, double x)
+static void fold_compare(Node *node)
 {
-    if (cg->err) return -1;
+    Node *l = node->left;
+    Node *r = node->right;
 
-    int off = cg->code.len;
-    write_raw_f64(&cg->code, x);
-    return off;
-}
+    if (node->type == NODE_OPER_EQL || node->type == NODE_OPER_NQL) {
+        if (fold_is_const(l) && fold_is_const(r))
+            fold_bool(node, fold_eql(l, r) == (node->type == NODE_OPER_EQL));
+        return;
+    }
 
-static void cg_write_str(Codegen *cg, String x)
-{
-    if (cg->err) return;
+    if (!fold_is_number(l) || !fold_is_number(r))
+        return;
 
-    int off = cg->data.len;
-    write_text(&cg->data, x);
-    write_raw_u32(&cg->code, off);
-    write_raw_u32(&cg->code, x.len);
+    bool lss;
+    bool grt;
+    if (l->type == NODE_VALUE_INT && r->type == NODE_VALUE_INT) {
+        lss = (int64_t) l->ival < (int64_t) r->ival;
+        grt = (int64_t) l->ival > (int64_t) r->ival;
+    } else {
+        lss = fold_to_f64(l) < fold_to_f64(r);
+        grt = fold_to_f64(l) > fold_to_f64(r);
+    }
+    fold_bool(node, node->type == NODE_OPER_LSS ? lss : grt);
 }
 
-static void cg_patch_u8(Codegen *cg, int off, uint8_t x)
+// Folds the length of an array or map literal whose
+// elements are all constant. Duplicate map keys are
+// only counted once since later ones overwrite the
+// earlier ones.
+static void fold_len(Node *node)
 {
-    if (cg->err) return;
+    Node *set = node->left;
+    if (set->type != NODE_VALUE_ARRAY && set->type != NODE_VALUE_MAP)
+        return;
 
-    patch_mem(&cg->code, &x, off, SIZEOF(x));
-}
-
-static void cg_patch_u32(Codegen *cg, int off, uint32_t x)
-{
-    if (cg->err) return;
-
-    patch_mem(&cg->code, &x, off, SIZEOF(x));
-}
-
-static uint32_t cg_current_offset(Codegen *cg)
-{
-    return cg->code.len;
-}
-
-int count_nodes(Node *head)
-{
-    int n = 0;
-    Node *node = head;
-    while (node) {
-        n++;
-        node = node->next;
-    }
-    return n;
-}
-
-static Scope *parent_scope(Codegen *cg)
-{
-    ASSERT(cg->num_scopes > 0);
-
-    int parent = cg->num_scopes-1;
-    while (cg->scopes[parent].type != SCOPE_PROC && cg->scopes[parent].type != SCOPE_GLOBAL)
-        parent--;
+    int64_t len = 0;
+    for (Node *child = set->child; child; child = child->next) {
 
-    return &cg->scopes[parent];
-}
-
-static bool inside_assignment(Codegen *cg)
-{
-    ASSERT(cg->num_scopes > 0);
-
-    int parent = cg->num_scopes-1;
-    while (cg->scopes[parent].type != SCOPE_PROC
-        && cg->scopes[parent].type != SCOPE_GLOBAL
-        && cg->scopes[parent].type != SCOPE_ASSIGNMENT)
-        parent--;
-
-    return cg->scopes[parent].type == SCOPE_ASSIGNMENT;
-}
-
-static int count_function_vars(Codegen *cg)
-{
-    int n = 0;
-    Scope *scope = parent_scope(cg);
-    for (int i = scope->idx_syms; i < cg->num_syms; i++)
-        if (cg->syms[i].type == SYMBOL_VARIABLE)
-            n++;
-    return n;
-}
-
-static Symbol *cg_find_symbol(Codegen *cg, String name, bool local)
-{
-    if (cg->err) return NULL;
+        if (!fold_is_const(child))
+            return;
 
-    if (name.len == 0) return NULL;
-    ASSERT(cg->num_scopes > 0);
-    Scope *scope = local ? &cg->scopes[cg->num_scopes-1] : parent_scope(cg);
-    for (int i = cg->num_syms-1; i >= scope->idx_syms; i--)
-        if (streq(cg->syms[i].name, name))
-            return &cg->syms[i];
-    return NULL;
-}
+        if (set->type == NODE_VALUE_MAP) {
 
-static int cg_declare_variable(Codegen *cg, String name, bool cnst)
-{
-    if (cg->err) return -1;
+            if (!fold_is_const(child->key))
+                return;
 
-    Symbol *sym = cg_find_symbol(cg, name, true);
-    if (sym) {
-        cg_report(cg, "Variable declared twice");
-        return -1;
-    }
+            bool dup = false;
+            for (Node *prev = set->child; prev != child; prev = prev->next)
+                if (fold_eql(prev->key, child->key)) {
+                    dup = true;
+                    break;
+                }
+            if (dup)
+                continue;
+        }
 
-    if (cg->num_syms == MAX_SYMBOLS) {
-        cg_report(cg, "Symbol count limit reached");
-        return -1;
+        len++;
     }
 
-    int off = count_function_vars(cg);
-
-    Scope *parent = parent_scope(cg);
-    parent->max_vars = MAX(parent->max_vars, off+1);
-
-    cg->syms[cg->num_syms++] = (Symbol) {
-        .type = SYMBOL_VARIABLE,
-        .name = name,
-        .cnst = cnst,
-        .off  = off,
-    };
-    return off;
+    node->type = NODE_VALUE_INT;
+    node->ival = len;
 }
 
-static void cg_declare_procedure(Codegen *cg, String name, int off)
+// Escaping only marks strings and arrays, so comparisons and
+// native functions still see their raw text. The operator is
+// folded only where marking makes no difference: on strings
+// without special characters, on static elements that only
+// insert such strings and on constants of other types.
+static bool fold_escape_noop(Node *node)
 {
-    if (cg->err) return;
-
-    Symbol *sym = cg_find_symbol(cg, name, true);
-    if (sym) {
-        cg_report(cg, "Procedure declared twice");
-        return;
+    if (node->type == NODE_VALUE_STR) {
+        if (node->trusted)
+            return true;
+        Writer w = { NULL, 0, 0 };
+        write_text_escaped(&w, node->sval);
+        return w.len == node->sval.len;
     }
 
-    if (cg->num_syms == MAX_SYMBOLS) {
-        cg_report(cg, "Symbol count limit reached");
-        return;
+    if (node->type == NODE_VALUE_HTML) {
+        Node *lists[] = { node->html_attr, node->html_child };
+        for (int i = 0; i < 2; i++)
+            for (Node *child = lists[i]; child; child = child->next)
+                if (!fold_escape_noop(child))
+                    return false;
+        return true;
     }
 
-    cg->syms[cg->num_syms++] = (Symbol) {
-        .type = SYMBOL_PROCEDURE,
-        .name = name,
-        .cnst = true,
-        .off  = off,
-    };
+    return fold_is_const(node);
 }
 
-static void cg_push_scope(Codegen *cg, ScopeType type)
+static void fold_escape(Node *node)
 {
-    if (cg->err) return;
-
-    if (cg->num_scopes == MAX_SCOPES) {
-        cg_report(cg, "Scope limit reached");
-        return;
-    }
-
-    Scope *scope = &cg->scopes[cg->num_scopes++];
-    scope->type     = type;
-    scope->idx_syms = cg->num_syms;
-    scope->max_vars = 0;
-    scope->calls    = NULL;
+    if (fold_escape_noop(node->left))
+        fold_replace(node, node->left);
 }
 
-static void cg_pop_scope(Codegen *cg)
+static void fold_list(Node *head, WL_Arena *arena);
+
+static void fold_node(Node *node, WL_Arena *arena)
 {
-    if (cg->err) return;
+    if (node == NULL)
+        return;
 
-    ASSERT(cg->num_scopes > 0);
-    Scope *scope = &cg->scopes[cg->num_scopes-1];
+    switch (node->type) {
 
-    Scope *parent_scope = NULL;
-    if (cg->num_scopes > 1)
-        parent_scope = &cg->scopes[cg->num_scopes-2];
+        case NODE_GLOBAL:
+        case NODE_COMPOUND:
+        fold_list(node->left, arena);
+        break;
 
-    while (scope->calls) {
+        case NODE_PROCEDURE_DECL:
+        fold_node(node->proc_body, arena);
+        break;
 
-        UnpatchedCall *call = scope->calls;
-        scope->calls = call->next;
+        case NODE_PROCEDURE_CALL:
+        fold_list(node->right, arena);
+        break;
 
-        ASSERT(call - cg->calls >= 0 && call - cg->calls < MAX_UNPATCHED_CALLS);
+        case NODE_VAR_DECL:
+        fold_node(node->var_value, arena);
+        break;
 
-        Symbol *sym = cg_find_symbol(cg, call->name, true);
+        case NODE_IFELSE:
+        fold_node(node->if_cond, arena);
+        fold_node(node->if_branch1, arena);
+        fold_node(node->if_branch2, arena);
+        break;
 
-        if (sym == NULL) {
-            if (parent_scope == NULL) {
-                cg_report(cg, "Undefined function '%.*s'",
-                    scope->calls->name.len,
-                    scope->calls->name.ptr);
-                    return;
-                }
-            call->next = parent_scope->calls;
-            parent_scope->calls = call;
-            continue;
-        }
+        case NODE_FOR:
+        fold_node(node->for_set, arena);
+        fold_node(node->left, arena);
+        break;
 
-        if (sym->type != SYMBOL_PROCEDURE) {
-            cg_report(cg, "Symbol '%.*s' is not a procedure", call->name.len, call->name.ptr);
-            return;
-        }
+        case NODE_WHILE:
+        fold_node(node->while_cond, arena);
+        fold_node(node->left, arena);
+        break;
 
-        cg_patch_u32(cg, call->off, sym->off);
+        case NODE_INCLUDE:
+        fold_node(node->include_root, arena);
+        break;
 
-        call->next = cg->free_list_calls;
-        cg->free_list_calls = call;
-    }
+        case NODE_SELECT:
+        case NODE_OPER_ASS:
+        case NODE_OPER_SHOVEL:
+        fold_node(node->left, arena);
+        fold_node(node->right, arena);
+        break;
 
-    cg->num_syms = scope->idx_syms;
-    cg->num_scopes--;
-}
+        case NODE_NESTED:
+        case NODE_OPER_POS:
+        fold_node(node->left, arena);
+        if (fold_is_const(node->left))
+            fold_replace(node, node->left);
+        break;
 
-static void cg_append_unpatched_call(Codegen *cg, String name, int p)
-{
-    if (cg->err) return;
+        case NODE_OPER_NEG:
+        fold_node(node->left, arena);
+        if (node->left->type == NODE_VALUE_INT && (int64_t) node->left->ival != INT64_MIN) {
+            node->type = NODE_VALUE_INT;
+            node->ival = -(int64_t) node->left->ival;
+        } else if (node->left->type == NODE_VALUE_FLOAT) {
+            node->type = NODE_VALUE_FLOAT;
+            node->fval = -node->left->fval;
+        }
+        break;
 
-    if (cg->free_list_calls == NULL) {
-        cg_report(cg, "Out of memory");
-        return;
-    }
-    UnpatchedCall *call = cg->free_list_calls;
-    cg->free_list_calls = call->next;
+        case NODE_OPER_LEN:
+        fold_node(node->left, arena);
+        fold_len(node);
+        break;
 
-    ASSERT(call - cg->calls >= 0 && call - cg->calls < MAX_UNPATCHED_CALLS);
+        case NODE_OPER_ESCAPE:
+        fold_node(node->left, arena);
+        fold_escape(node);
+        break;
 
-    call->name = name;
-    call->off  = p;
-    call->next = NULL;
+        case NODE_OPER_EQL:
+        case NODE_OPER_NQL:
+        case NODE_OPER_LSS:
+        case NODE_OPER_GRT:
+        fold_node(node->left, arena);
+        fold_node(node->right, arena);
+        fold_compare(node);
+        break;
 
-    ASSERT(cg->num_scopes > 0);
-    Scope *scope = &cg->scopes[cg->num_scopes-1];
+        case NODE_OPER_ADD:
+        case NODE_OPER_SUB:
+        case NODE_OPER_MUL:
+        case NODE_OPER_DIV:
+        case NODE_OPER_MOD:
+        fold_node(node->left, arena);
+        fold_node(node->right, arena);
+        fold_arith(node);
+        break;
 
-    call->next = scope->calls;
-    scope->calls = call;
-}
+        case NODE_VALUE_HTML:
+        fold_list(node->html_attr, arena);
+        fold_list(node->html_child, arena);
+        break;
 
-static bool cg_global_scope(Codegen *cg)
-{
-    Scope *scope = parent_scope(cg);
-    return scope->type == SCOPE_GLOBAL;
-}
+        case NODE_VALUE_ARRAY:
+        fold_list(node->child, arena);
+        break;
 
-static void cg_flush_pushs(Codegen *cg)
-{
-    if (cg->data_off != -1) {
-        if (cg->data_off < cg->data.len) {
-            cg_write_u8(cg, OPCODE_PUSHS);
-            cg_write_u32(cg, cg->data_off);
-            cg_write_u32(cg, cg->data.len - cg->data_off);
+        case NODE_VALUE_MAP:
+        for (Node *child = node->child; child; child = child->next) {
+            fold_node(child, arena);
+            fold_node(child->key, arena);
         }
-        cg->data_off = -1;
+        break;
+
+        default:
+        break;
     }
 }
 
-static int cg_write_opcode(Codegen *cg, uint8_t opcode)
+static void fold_list(Node *head, WL_Arena *arena)
 {
-    ASSERT(opcode != OPCODE_PUSHS);
-    cg_flush_pushs(cg);
-    return cg_write_u8(cg, opcode);
+    for (Node *node = head; node; node = node->next)
+        fold_node(node, arena);
 }
 
-static void cg_write_pushs(Codegen *cg, String str, bool dont_group)
-{
-    if (dont_group) {
-        cg_flush_pushs(cg);
-        cg_write_u8(cg, OPCODE_PUSHS);
-        cg_write_str(cg, str);
-    } else {
-        if (cg->data_off == -1)
-            cg->data_off = cg->data.len;
-        write_raw_mem(&cg->data, str.ptr, str.len);
-    }
-}
+/////////////////////////////////////////////////////////////////////////
+// CODEGEN
+/////////////////////////////////////////////////////////////////////////
 
-static void walk_node(Codegen *cg, Node *node, bool inside_html);
+enum {
+    OPCODE_NOPE,
+    OPCODE_JUMP,
+    OPCODE_JIFP,
+    OPCODE_OUTPUT,
+    OPCODE_SYSVAR,
+    OPCODE_SYSCALL,
+    OPCODE_CALL,
+    OPCODE_RET,
+    OPCODE_GROUP,
+    OPCODE_ESCAPE,
+    OPCODE_PACK,
+    OPCODE_GPOP,
+    OPCODE_FOR,
+    OPCODE_EXIT,
+    OPCODE_VARS,
+    OPCODE_POP,
+    OPCODE_SETV,
+    OPCODE_PUSHV,
+    OPCODE_PUSHI,
+    OPCODE_PUSHF,
+    OPCODE_PUSHS,
+    OPCODE_PUSHA,
+    OPCODE_PUSHM,
+    OPCODE_PUSHN,
+    OPCODE_PUSHT,
+    OPCODE_PUSHFL,
+    OPCODE_LEN,
+    OPCODE_NEG,
+    OPCODE_EQL,
+    OPCODE_NQL,
+    OPCODE_LSS,
+    OPCODE_GRT,
+    OPCODE_ADD,
+    OPCODE_SUB,
+    OPCODE_MUL,
+    OPCODE_DIV,
+    OPCODE_MOD,
+    OPCODE_APPEND,
+    OPCODE_INSERT1,
+    OPCODE_INSERT2,
+    OPCODE_SELECT,
+    OPCODE_MARK,
+    OPCODE_RESET,
+    OPCODE_NVAR,
+    OPCODE_NCALL,
+    OPCODE_PUSHH,
+    OPCODE_PUSHK,
+    OPCODE_TAIL,
+
+    // Superinstructions produced by cg_fuse
+    OPCODE_SETVP,   // SETV x; POP
+    OPCODE_SETVI,   // PUSHI k; SETV x; POP
+    OPCODE_ADDVV,   // PUSHV x; PUSHV y; ADD
+    OPCODE_SELS,    // PUSHS k; SELECT
+};
 
-static void walk_expr_node(Codegen *cg, Node *node, bool one)
-{
-    switch (node->type) {
+// Array and map literals whose elements are all constant
+// are pushed by PUSHK, which refers to an entry of the data
+// section made of a u8 kind (0 for arrays and 1 for maps),
+// the u32 number of values (keys and values for maps) and
+// the values, each a u8 tag followed by its payload:
+//
+//   CONST_INT    s64
+//   CONST_FLOAT  f64
+//   CONST_STR    u32 length and the bytes
+//   CONST_HTML   same as CONST_STR, for trusted strings
+typedef enum {
+    CONST_NONE,
+    CONST_TRUE,
+    CONST_FALSE,
+    CONST_INT,
+    CONST_FLOAT,
+    CONST_STR,
+    CONST_HTML,
+} ConstTag;
 
-        case NODE_NESTED:
-        walk_expr_node(cg, node->left, one);
-        break;
+typedef struct UnpatchedCall UnpatchedCall;
+struct UnpatchedCall {
+    UnpatchedCall *next;
+    String         name;
+    int            off;
+};
 
-        case NODE_OPER_LEN:
-        walk_expr_node(cg, node->left, true);
-        cg_write_opcode(cg, OPCODE_LEN);
-        break;
+typedef enum {
+    SYMBOL_VARIABLE,
+    SYMBOL_PROCEDURE,
+} SymbolType;
 
-        case NODE_OPER_ESCAPE:
-        cg_write_opcode(cg, OPCODE_GROUP);
-        walk_expr_node(cg, node->left, false);
-        cg_write_opcode(cg, OPCODE_ESCAPE);
-        break;
+typedef struct {
+    SymbolType type;
+    String     name;
+    bool       cnst;
+    int        off;
+} Symbol;
 
-        case NODE_OPER_POS:
-        walk_expr_node(cg, node->left, one);
-        break;
+typedef enum {
+    SCOPE_IF,
+    SCOPE_ELSE,
+    SCOPE_FOR,
+    SCOPE_WHILE,
+    SCOPE_PROC,
+    SCOPE_COMPOUND,
+    SCOPE_GLOBAL,
+    SCOPE_ASSIGNMENT,
+    SCOPE_INLINE,
+} ScopeType;
 
-        case NODE_OPER_NEG:
-        walk_expr_node(cg, node->left, true);
-        cg_write_opcode(cg, OPCODE_NEG);
-        break;
+// The "body" of a scope is the statement (or compound
+// statement) compiled in it, if any, which is used to
+// find the procedures it declares before they are compiled.
+typedef struct {
+    ScopeType type;
+    int idx_syms;
+    int max_vars;
+    UnpatchedCall *calls;
+    Node *body;
+} Scope;
 
-        case NODE_OPER_ASS:
-        {
-            Node *dst = node->left;
-            Node *src = node->right;
+#define MAX_SYMBOLS 1024
+#define MAX_SCOPES 128
+#define MAX_UNPATCHED_CALLS 32
+#define MAX_NATIVES 128
+#define MAX_INLINE_ARGS 16
+
+// Procedures with bodies of up to this number of nodes
+// are inlined unless a different budget is set with
+// wl_compiler_set_inline_budget
+#define DEFAULT_INLINE_BUDGET 32
+
+// Name bound to a host function with wl_compiler_bind_native.
+// The first time it's referenced, codegen writes the name to
+// the data section and stores its offset in "off". Only the
+// name is part of the program. The function itself is looked
+// up when the program is prepared.
+typedef struct {
+    String name;
+    int    off;
+} Native;
+
+// External symbols that produce SYSVAR or SYSCALL events
+// are collected in the symbol table of the program. The
+// table is the last section of the program and contains
+// one SYMBOL_ENTRY_SIZE entry per symbol:
+//
+//   u8  type (0 for variables, 1 for calls)
+//   u8  number of arguments
+//   u32 offset of the name in the data section
+//   u32 length of the name
+#define MAX_EXTERNALS 256
+#define SYMBOL_ENTRY_SIZE 10
 
-            if (dst->type == NODE_VALUE_VAR) {
+typedef struct {
+    String  name;
+    bool    call;
+    uint8_t args;
+    int     off;
+} External;
 
-                String name = dst->sval;
-                Symbol *sym = cg_find_symbol(cg, name, false);
-                if (sym == NULL) {
-                    cg_report(cg, "Write to undeclared variable");
-                    return;
-                }
-                if (sym->type == SYMBOL_PROCEDURE) {
-                    cg_report(cg, "Symbol is not a variable");
-                    return;
-                }
-                if (sym->cnst) {
-                    cg_report(cg, "Variable is constant");
-                    return;
-                }
+typedef struct {
 
-                cg_push_scope(cg, SCOPE_ASSIGNMENT);
-                walk_expr_node(cg, src, true);
-                cg_pop_scope(cg);
+    Writer code;
+    Writer data;
 
-                cg_write_opcode(cg, OPCODE_SETV);
-                cg_write_u8(cg, sym->off);
+    int num_scopes;
+    Scope scopes[MAX_SCOPES];
 
-                if (!one)
-                    cg_write_opcode(cg, OPCODE_POP);
+    int num_syms;
+    Symbol syms[MAX_SYMBOLS];
 
-            } else if (dst->type == NODE_SELECT) {
+    UnpatchedCall *free_list_calls;
+    UnpatchedCall calls[MAX_UNPATCHED_CALLS];
 
-                cg_push_scope(cg, SCOPE_ASSIGNMENT);
-                walk_expr_node(cg, src, true);
-                cg_pop_scope(cg);
+    bool  err;
+    char *errmsg;
+    int   errcap;
 
-                walk_expr_node(cg, dst->left,  true);
-                walk_expr_node(cg, dst->right, true);
-                cg_write_opcode(cg, OPCODE_INSERT2);
+    // Start of the static text that wasn't pushed yet,
+    // or -1, whether it's HTML and whether it's the output
+    // of the statements that produced it
+    int  data_off;
+    bool data_trusted;
+    bool data_output;
 
-                if (!one)
-                    cg_write_opcode(cg, OPCODE_POP);
+    // Offsets of the last two instructions that may
+    // be fused with the next one, or -1
+    int prev[2];
 
-            } else {
+    Native *natives;
+    int     num_natives;
 
-                cg_report(cg, "Assignment left side can't be assigned to");
-                return;
-            }
-        }
-        break;
+    External externs[MAX_EXTERNALS];
+    int      num_externs;
 
-        case NODE_OPER_SHOVEL:
-        {
-            walk_expr_node(cg, node->left, true);
+    int inline_budget;
 
-            cg_push_scope(cg, SCOPE_ASSIGNMENT);
-            walk_expr_node(cg, node->right, true);
-            cg_pop_scope(cg);
+    // Procedure whose body is being compiled and the
+    // offset of its first instruction
+    Node *proc;
+    int   proc_off;
 
-            cg_write_opcode(cg, OPCODE_APPEND);
-            if (!one)
-                cg_write_opcode(cg, OPCODE_POP);
-        }
-        break;
+} Codegen;
 
-        case NODE_OPER_EQL:
-        walk_expr_node(cg, node->left, true);
-        walk_expr_node(cg, node->right, true);
-        cg_write_opcode(cg, OPCODE_EQL);
-        break;
+static void cg_report(Codegen *cg, char *fmt, ...)
+{
+    if (cg->err) return;
 
-        case NODE_OPER_NQL:
-        walk_expr_node(cg, node->left, true);
-        walk_expr_node(cg, node->right, true);
-        cg_write_opcode(cg, OPCODE_NQL);
-        break;
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(cg->errmsg, cg->errcap, fmt, args);
+    va_end(args);
 
-        case NODE_OPER_LSS:
-        walk_expr_node(cg, node->left, true);
-        walk_expr_node(cg, node->right, true);
-        cg_write_opcode(cg, OPCODE_LSS);
-        break;
+    if (len > cg->errcap)
+        len = cg->errcap-1;
 
-        case NODE_OPER_GRT:
-        walk_expr_node(cg, node->left, true);
-        walk_expr_node(cg, node->right, true);
-        cg_write_opcode(cg, OPCODE_GRT);
-        break;
+    cg->errmsg[len] = '\0';
+    cg->err = true;
+}
 
-        case NODE_OPER_ADD:
-        walk_expr_node(cg, node->left, true);
-        walk_expr_node(cg, node->right, true);
-        cg_write_opcode(cg, OPCODE_ADD);
-        break;
+static int cg_write_u8(Codegen *cg, uint8_t x)
+{
+    if (cg->err) return -1;
 
-        case NODE_OPER_SUB:
-        walk_expr_node(cg, node->left, true);
-        walk_expr_node(cg, node->right, true);
-        cg_write_opcode(cg, OPCODE_SUB);
-        break;
+    int off = cg->code.len;
+    write_raw_u8(&cg->code, x);
+    return off;
+}
 
-        case NODE_OPER_MUL:
-        walk_expr_node(cg, node->left, true);
-        walk_expr_node(cg, node->right, true);
-        cg_write_opcode(cg, OPCODE_MUL);
-        break;
+static int cg_write_u32(Codegen *cg, uint32_t x)
+{
+    if (cg->err) return -1;
 
-        case NODE_OPER_DIV:
-        walk_expr_node(cg, node->left, true);
-        walk_expr_node(cg, node->right, true);
-        cg_write_opcode(cg, OPCODE_DIV);
-        break;
+    int off = cg->code.len;
+    write_raw_u32(&cg->code, x);
+    return off;
+}
 
-        case NODE_OPER_MOD:
-        walk_expr_node(cg, node->left, true);
-        walk_expr_node(cg, node->right, true);
-        cg_write_opcode(cg, OPCODE_MOD);
-        break;
+static int cg_write_s64(Codegen *cg, int64_t x)
+{
+    if (cg->err) return -1;
 
-        case NODE_VALUE_INT:
-        cg_write_opcode(cg, OPCODE_PUSHI);
-        cg_write_s64(cg, node->ival);
-        break;
+    int off = cg->code.len;
+    write_raw_s64(&cg->code, x);
+    return off;
+}
 
-        case NODE_VALUE_FLOAT:
-        cg_write_opcode(cg, OPCODE_PUSHF);
-        cg_write_f64(cg, node->fval);
-        break;
+static int cg_write_f64(Codegen *cg, double x)
+{
+    if (cg->err) return -1;
 
-        case NODE_VALUE_STR:
-        cg_write_pushs(cg, node->sval, one);
-        break;
+    int off = cg->code.len;
+    write_raw_f64(&cg->code, x);
+    return off;
+}
 
-        case NODE_VALUE_NONE:
-        cg_write_opcode(cg, OPCODE_PUSHN);
-        break;
+static void cg_write_str(Codegen *cg, String x)
+{
+    if (cg->err) return;
 
-        case NODE_VALUE_TRUE:
-        cg_write_opcode(cg, OPCODE_PUSHT);
-        break;
+    int off = cg->data.len;
+    write_text(&cg->data, x);
+    write_raw_u32(&cg->code, off);
+    write_raw_u32(&cg->code, x.len);
+}
 
-        case NODE_VALUE_FALSE:
-        cg_write_opcode(cg, OPCODE_PUSHFL);
-        break;
+// Writes the operands of NVAR and NCALL for a reference
+// to the native function "n"
+static void cg_write_native(Codegen *cg, Native *n)
+{
+    if (cg->err) return;
 
-        case NODE_VALUE_VAR:
-        {
-            String name = node->sval;
-            Symbol *sym = cg_find_symbol(cg, name, false);
-            if (sym == NULL) {
-                cg_report(cg, "Access to undeclared variable '%.*s'", name.len, name.ptr);
-                return;
-            }
-            if (sym->type == SYMBOL_PROCEDURE) {
-                cg_report(cg, "Symbol is not a variable");
-                return;
-            }
+    if (n->off == -1) {
+        n->off = cg->data.len;
+        write_text(&cg->data, n->name);
+    }
+    write_raw_u32(&cg->code, n->off);
+    write_raw_u32(&cg->code, n->name.len);
+}
 
-            cg_write_opcode(cg, OPCODE_PUSHV);
-            cg_write_u8(cg, sym->off);
-        }
-        break;
+// Writes the operands of SYSVAR and SYSCALL and adds the
+// symbol to the program's symbol table
+static void cg_write_external(Codegen *cg, String name, bool call, uint8_t args)
+{
+    if (cg->err) return;
 
-        case NODE_VALUE_SYSVAR:
-        cg_write_opcode(cg, OPCODE_SYSVAR);
-        cg_write_str(cg, node->sval);
-        break;
+    int off = cg->data.len;
+    cg_write_str(cg, name);
 
-        case NODE_VALUE_HTML:
-        {
-            if (one)
-                cg_write_opcode(cg, OPCODE_GROUP);
+    for (int i = 0; i < cg->num_externs; i++) {
+        External *e = &cg->externs[i];
+        if (e->call == call && e->args == args && streq(e->name, name))
+            return;
+    }
 
-            cg_write_pushs(cg, S("<"), false);
-            cg_write_pushs(cg, node->html_tag, false);
+    if (cg->num_externs == MAX_EXTERNALS) {
+        cg_report(cg, "Too many external symbols");
+        return;
+    }
+    cg->externs[cg->num_externs++] = (External) { name, call, args, off };
+}
 
-            Node *child = node->html_attr;
-            while (child) {
-                walk_node(cg, child, true);
-                child = child->next;
-            }
 
-            if (!node->html_body) {
-                cg_write_pushs(cg, S("/>"), false);
-            } else {
-                cg_write_pushs(cg, S(">"), false);
-                Node *child = node->html_child;
-                while (child) {
-                    walk_node(cg, child, true);
-                    child = child->next;
-                }
-                cg_write_pushs(cg, S("</"), false);
-                cg_write_pushs(cg, node->html_tag, false);
-                cg_write_pushs(cg, S(">"), false);
-            }
+static Native *cg_find_native(Codegen *cg, String name)
+{
+    for (int i = 0; i < cg->num_natives; i++)
+        if (streq(cg->natives[i].name, name))
+            return &cg->natives[i];
+    return NULL;
+}
 
-            if (one)
-                cg_write_opcode(cg, OPCODE_PACK);
-        }
-        break;
+static void cg_patch_u8(Codegen *cg, int off, uint8_t x)
+{
+    if (cg->err) return;
 
-        case NODE_VALUE_ARRAY:
-        {
-            cg_write_opcode(cg, OPCODE_PUSHA);
-            cg_write_u32(cg, count_nodes(node->child));
+    patch_mem(&cg->code, &x, off, SIZEOF(x));
+}
 
-            Node *child = node->child;
-            while (child) {
-                walk_expr_node(cg, child, true);
-                cg_write_opcode(cg, OPCODE_APPEND);
-                child = child->next;
-            }
-        }
-        break;
+static void cg_patch_u32(Codegen *cg, int off, uint32_t x)
+{
+    if (cg->err) return;
 
-        case NODE_VALUE_MAP:
-        {
-            cg_write_opcode(cg, OPCODE_PUSHM);
-            cg_write_u32(cg, count_nodes(node->child));
+    patch_mem(&cg->code, &x, off, SIZEOF(x));
+}
 
-            Node *child = node->child;
-            while (child) {
-                walk_expr_node(cg, child, true);
-                walk_expr_node(cg, child->key, true);
-                cg_write_opcode(cg, OPCODE_INSERT1);
-                child = child->next;
-            }
-        }
-        break;
+static void cg_flush_pushs(Codegen *cg);
 
-        case NODE_SELECT:
-        {
-            Node *set = node->left;
-            Node *key = node->right;
-            walk_expr_node(cg, set, true);
-            walk_expr_node(cg, key, true);
-            cg_write_opcode(cg, OPCODE_SELECT);
-        }
-        break;
+static uint32_t cg_current_offset(Codegen *cg)
+{
+    // Pending static text belongs to the code before
+    // the offset, so it must be written before the
+    // offset is taken.
+    cg_flush_pushs(cg);
 
-        case NODE_PROCEDURE_CALL:
-        {
-            if (one)
-                cg_write_opcode(cg, OPCODE_GROUP);
+    // The offset may be used as a jump target, so
+    // what comes next can't be fused with what came
+    // before.
+    cg->prev[0] = -1;
+    cg->prev[1] = -1;
+    return cg->code.len;
+}
 
-            int count = 0;
-            Node *arg = node->right;
-            while (arg) {
-                walk_expr_node(cg, arg, true);
-                count++;
-                arg = arg->next;
-            }
+int count_nodes(Node *head)
+{
+    int n = 0;
+    Node *node = head;
+    while (node) {
+        n++;
+        node = node->next;
+    }
+    return n;
+}
 
-            Node *proc = node->left;
-            if (proc->type == NODE_VALUE_VAR) {
+static bool cg_const_aggregate(Node *node)
+{
+    if (node->child == NULL)
+        return false;
 
-                cg_write_opcode(cg, OPCODE_CALL);
-                cg_write_u8(cg, count);
-                int p = cg_write_u32(cg, 0);
-                cg_append_unpatched_call(cg, proc->sval, p);
+    for (Node *child = node->child; child; child = child->next) {
+        if (!fold_is_const(child))
+            return false;
+        if (node->type == NODE_VALUE_MAP && !fold_is_const(child->key))
+            return false;
+    }
+    return true;
+}
 
-            } else {
+static void cg_write_const(Codegen *cg, Node *node)
+{
+    switch (node->type) {
 
-                ASSERT(proc->type == NODE_VALUE_SYSVAR);
-                cg_write_opcode(cg, OPCODE_SYSCALL);
-                cg_write_u8(cg, count);
-                cg_write_str(cg, proc->sval);
-            }
+        case NODE_VALUE_NONE:
+        write_raw_u8(&cg->data, CONST_NONE);
+        break;
 
-            if (one)
-                cg_write_opcode(cg, OPCODE_PACK);
-        }
+        case NODE_VALUE_TRUE:
+        write_raw_u8(&cg->data, CONST_TRUE);
+        break;
+
+        case NODE_VALUE_FALSE:
+        write_raw_u8(&cg->data, CONST_FALSE);
+        break;
+
+        case NODE_VALUE_INT:
+        write_raw_u8 (&cg->data, CONST_INT);
+        write_raw_s64(&cg->data, node->ival);
+        break;
+
+        case NODE_VALUE_FLOAT:
+        write_raw_u8 (&cg->data, CONST_FLOAT);
+        write_raw_f64(&cg->data, node->fval);
+        break;
+
+        case NODE_VALUE_STR:
+        write_raw_u8 (&cg->data, node->trusted ? CONST_HTML : CONST_STR);
+        write_raw_u32(&cg->data, node->sval.len);
+        write_text   (&cg->data, node->sval);
         break;
 
         default:
@@ -2964,1774 +3179,4953 @@ static void walk_expr_node(Codegen *cg, Node *node, bool one)
     }
 }
 
-static void walk_node(Codegen *cg, Node *node, bool inside_html)
+// Writes the operands of PUSHK for an array or map literal
+// whose elements are all constant
+static void cg_write_const_aggregate(Codegen *cg, Node *node)
 {
-    switch (node->type) {
-
-        case NODE_GLOBAL:
-        for (Node *child = node->left;
-            child; child = child->next) {
-            walk_node(cg, child, false);
-        }
-        break;
+    if (cg->err) return;
 
-        case NODE_COMPOUND:
-        cg_push_scope(cg, SCOPE_COMPOUND);
-        for (Node *child = node->left;
-            child; child = child->next)
-            walk_node(cg, child, inside_html);
-        cg_pop_scope(cg);
-        break;
+    bool map = (node->type == NODE_VALUE_MAP);
 
-        case NODE_PROCEDURE_DECL:
-        {
-            cg_push_scope(cg, SCOPE_PROC);
+    int off = cg->data.len;
+    write_raw_u8 (&cg->data, map);
+    write_raw_u32(&cg->data, (map ? 2 : 1) * count_nodes(node->child));
+    for (Node *child = node->child; child; child = child->next) {
+        if (map)
+            cg_write_const(cg, child->key);
+        cg_write_const(cg, child);
+    }
 
-            cg_write_opcode(cg, OPCODE_JUMP);
-            int off0 = cg_write_u32(cg, 0);
+    write_raw_u32(&cg->code, off);
+    write_raw_u32(&cg->code, cg->data.len - off);
+}
 
-            #define MAX_ARGS 128
+static Scope *parent_scope(Codegen *cg)
+{
+    ASSERT(cg->num_scopes > 0);
 
-            int num_args = 0;
-            Node *args[MAX_ARGS];
+    int parent = cg->num_scopes-1;
+    while (cg->scopes[parent].type != SCOPE_PROC && cg->scopes[parent].type != SCOPE_GLOBAL)
+        parent--;
 
-            Node *arg = node->proc_args;
-            while (arg) {
-                if (num_args == MAX_ARGS) {
-                    cg_report(cg, "Procedure argument limit reached");
-                    return;
-                }
-                args[num_args++] = arg;
-                arg = arg->next;
-            }
+    return &cg->scopes[parent];
+}
 
-            for (int i = num_args-1; i >= 0; i--)
-                cg_declare_variable(cg, args[i]->sval, false);
+// Variables are allocated in the frame of the parent
+// scope, but the body of an inlined procedure can only
+// see its own.
+static Scope *visible_scope(Codegen *cg)
+{
+    ASSERT(cg->num_scopes > 0);
 
-            int off1 = cg_write_opcode(cg, OPCODE_VARS);
-            int off2 = cg_write_u8(cg, 0);
+    int parent = cg->num_scopes-1;
+    while (cg->scopes[parent].type != SCOPE_PROC
+        && cg->scopes[parent].type != SCOPE_GLOBAL
+        && cg->scopes[parent].type != SCOPE_INLINE)
+        parent--;
 
-            walk_node(cg, node->proc_body, false);
-            cg_write_opcode(cg, OPCODE_RET);
+    return &cg->scopes[parent];
+}
 
-            cg_patch_u8 (cg, off2, cg->scopes[cg->num_scopes-1].max_vars);
-            cg_patch_u32(cg, off0, cg_current_offset(cg));
+static bool inside_assignment(Codegen *cg)
+{
+    ASSERT(cg->num_scopes > 0);
 
-            cg_pop_scope(cg);
+    int parent = cg->num_scopes-1;
+    while (cg->scopes[parent].type != SCOPE_PROC
+        && cg->scopes[parent].type != SCOPE_GLOBAL
+        && cg->scopes[parent].type != SCOPE_INLINE
+        && cg->scopes[parent].type != SCOPE_ASSIGNMENT)
+        parent--;
 
-            cg_declare_procedure(cg, node->proc_name, off1);
-        }
-        break;
+    return cg->scopes[parent].type == SCOPE_ASSIGNMENT;
+}
 
-        case NODE_VAR_DECL:
-        {
-            int off = cg_declare_variable(cg, node->var_name, false);
-            if (node->var_value) {
-                cg_push_scope(cg, SCOPE_ASSIGNMENT);
-                walk_expr_node(cg, node->var_value, true);
-                cg_pop_scope(cg);
-            } else
-                cg_write_opcode(cg, OPCODE_PUSHN);
-            cg_write_opcode(cg, OPCODE_SETV);
-            cg_write_u8(cg, off);
-            cg_write_opcode(cg, OPCODE_POP);
-        }
-        break;
+static int count_function_vars(Codegen *cg)
+{
+    int n = 0;
+    Scope *scope = parent_scope(cg);
+    for (int i = scope->idx_syms; i < cg->num_syms; i++)
+        if (cg->syms[i].type == SYMBOL_VARIABLE)
+            n++;
+    return n;
+}
 
-        case NODE_IFELSE:
-        {
-            // If there is no else branch:
-            //
-            //   <cond>
-            //   JIFP end
-            //   <left>
-            // end:
-            //   ...
-            //
-            // If there is:
-            //
-            //   <cond>
-            //   JIFP else
-            //   <left>
-            //   JUMP end
-            // else:
-            //   <right>
-            // end:
-            //   ...
+static Symbol *cg_find_symbol(Codegen *cg, String name, bool local)
+{
+    if (cg->err) return NULL;
 
-            if (node->if_branch2) {
+    if (name.len == 0) return NULL;
+    ASSERT(cg->num_scopes > 0);
+    Scope *scope = local ? &cg->scopes[cg->num_scopes-1] : visible_scope(cg);
+    for (int i = cg->num_syms-1; i >= scope->idx_syms; i--)
+        if (streq(cg->syms[i].name, name))
+            return &cg->syms[i];
+    return NULL;
+}
 
-                walk_expr_node(cg, node->if_cond, true);
+static int cg_declare_variable(Codegen *cg, String name, bool cnst)
+{
+    if (cg->err) return -1;
 
-                cg_write_opcode(cg, OPCODE_JIFP);
-                int p1 = cg_write_u32(cg, 0);
+    Symbol *sym = cg_find_symbol(cg, name, true);
+    if (sym) {
+        cg_report(cg, "Variable declared twice");
+        return -1;
+    }
 
-                cg_push_scope(cg, SCOPE_IF);
-                walk_node(cg, node->if_branch1, inside_html);
-                cg_pop_scope(cg);
+    if (cg->num_syms == MAX_SYMBOLS) {
+        cg_report(cg, "Symbol count limit reached");
+        return -1;
+    }
 
-                cg_write_opcode(cg, OPCODE_JUMP);
-                int p2 = cg_write_u32(cg, 0);
+    int off = count_function_vars(cg);
 
-                cg_flush_pushs(cg);
-                cg_patch_u32(cg, p1, cg_current_offset(cg));
+    Scope *parent = parent_scope(cg);
+    parent->max_vars = MAX(parent->max_vars, off+1);
 
-                cg_push_scope(cg, SCOPE_ELSE);
-                walk_node(cg, node->if_branch2, inside_html);
-                cg_pop_scope(cg);
+    cg->syms[cg->num_syms++] = (Symbol) {
+        .type = SYMBOL_VARIABLE,
+        .name = name,
+        .cnst = cnst,
+        .off  = off,
+    };
+    return off;
+}
 
-                cg_flush_pushs(cg);
-                cg_patch_u32(cg, p2, cg_current_offset(cg));
+static void cg_declare_procedure(Codegen *cg, String name, int off)
+{
+    if (cg->err) return;
 
-            } else {
+    Symbol *sym = cg_find_symbol(cg, name, true);
+    if (sym) {
+        cg_report(cg, "Procedure declared twice");
+        return;
+    }
 
-                walk_expr_node(cg, node->if_cond, true);
+    if (cg->num_syms == MAX_SYMBOLS) {
+        cg_report(cg, "Symbol count limit reached");
+        return;
+    }
 
-                cg_write_opcode(cg, OPCODE_JIFP);
-                int p1 = cg_write_u32(cg, 0);
+    cg->syms[cg->num_syms++] = (Symbol) {
+        .type = SYMBOL_PROCEDURE,
+        .name = name,
+        .cnst = true,
+        .off  = off,
+    };
+}
 
-                cg_push_scope(cg, SCOPE_IF);
-                walk_node(cg, node->if_branch1, inside_html);
-                cg_pop_scope(cg);
+static void cg_push_scope(Codegen *cg, ScopeType type, Node *body)
+{
+    if (cg->err) return;
 
-                cg_flush_pushs(cg);
-                cg_patch_u32(cg, p1, cg_current_offset(cg));
-            }
-        }
-        break;
+    if (cg->num_scopes == MAX_SCOPES) {
+        cg_report(cg, "Scope limit reached");
+        return;
+    }
 
-        case NODE_FOR:
-        {
-            cg_push_scope(cg, SCOPE_FOR);
+    Scope *scope = &cg->scopes[cg->num_scopes++];
+    scope->type     = type;
+    scope->idx_syms = cg->num_syms;
+    scope->max_vars = 0;
+    scope->calls    = NULL;
+    scope->body     = body;
+}
 
-            int var_1 = cg_declare_variable(cg, node->for_var1, false);
-            int var_2 = cg_declare_variable(cg, node->for_var2, true);
-            int var_3 = cg_declare_variable(cg, (String) { NULL, 0 }, true);
+static void cg_pop_scope(Codegen *cg)
+{
+    if (cg->err) return;
 
-            walk_expr_node(cg, node->for_set, true);
-            cg_write_opcode(cg, OPCODE_SETV);
-            cg_write_u8(cg, var_3);
-            cg_write_opcode(cg, OPCODE_POP);
+    ASSERT(cg->num_scopes > 0);
+    Scope *scope = &cg->scopes[cg->num_scopes-1];
 
-            cg_write_opcode(cg, OPCODE_PUSHI);
-            cg_write_s64(cg, -1);
-            cg_write_opcode(cg, OPCODE_SETV);
-            cg_write_u8(cg, var_2);
-            cg_write_opcode(cg, OPCODE_POP);
+    Scope *parent_scope = NULL;
+    if (cg->num_scopes > 1)
+        parent_scope = &cg->scopes[cg->num_scopes-2];
 
-            int start = cg_write_opcode(cg, OPCODE_FOR);
-            cg_write_u8(cg, var_3);
-            cg_write_u8(cg, var_1);
-            cg_write_u8(cg, var_2);
-            int p = cg_write_u32(cg, 0);
+    while (scope->calls) {
 
-            walk_node(cg, node->left, inside_html);
+        UnpatchedCall *call = scope->calls;
+        scope->calls = call->next;
 
-            cg_write_opcode(cg, OPCODE_JUMP);
-            cg_write_u32(cg, start);
+        ASSERT(call - cg->calls >= 0 && call - cg->calls < MAX_UNPATCHED_CALLS);
 
-            cg_patch_u32(cg, p, cg_current_offset(cg));
+        Symbol *sym = cg_find_symbol(cg, call->name, true);
 
-            cg_pop_scope(cg);
+        if (sym == NULL) {
+            if (parent_scope == NULL) {
+                cg_report(cg, "Undefined function '%.*s'",
+                    scope->calls->name.len,
+                    scope->calls->name.ptr);
+                    return;
+                }
+            call->next = parent_scope->calls;
+            parent_scope->calls = call;
+            continue;
         }
-        break;
 
-        case NODE_WHILE:
-        {
-            // start:
-            //   <cond>
-            //   JIFP end
-            //   <body>
-            //   JUMP start
-            // end:
-            //   ...
+        if (sym->type != SYMBOL_PROCEDURE) {
+            cg_report(cg, "Symbol '%.*s' is not a procedure", call->name.len, call->name.ptr);
+            return;
+        }
 
-            int start = cg_current_offset(cg);
+        cg_patch_u32(cg, call->off, sym->off);
 
-            walk_expr_node(cg, node->while_cond, true);
+        call->next = cg->free_list_calls;
+        cg->free_list_calls = call;
+    }
 
-            cg_write_opcode(cg, OPCODE_JIFP);
-            int p = cg_write_u32(cg, 0);
+    cg->num_syms = scope->idx_syms;
+    cg->num_scopes--;
+}
 
-            cg_push_scope(cg, SCOPE_WHILE);
-            walk_node(cg, node->left, inside_html);
-            cg_pop_scope(cg);
+static void cg_append_unpatched_call(Codegen *cg, String name, int p)
+{
+    if (cg->err) return;
 
-            cg_write_opcode(cg, OPCODE_JUMP);
-            cg_write_u32(cg, start);
+    if (cg->free_list_calls == NULL) {
+        cg_report(cg, "Out of memory");
+        return;
+    }
+    UnpatchedCall *call = cg->free_list_calls;
+    cg->free_list_calls = call->next;
 
-            cg_patch_u32(cg, p, cg_current_offset(cg));
-        }
-        break;
+    ASSERT(call - cg->calls >= 0 && call - cg->calls < MAX_UNPATCHED_CALLS);
 
-        case NODE_INCLUDE:
-        walk_node(cg, node->include_root, false);
-        break;
+    call->name = name;
+    call->off  = p;
+    call->next = NULL;
 
-        default:
-        walk_expr_node(cg, node, false);
-        if (cg_global_scope(cg) && !inside_assignment(cg) && !inside_html)
-            cg_write_opcode(cg, OPCODE_OUTPUT);
-        break;
-    }
+    ASSERT(cg->num_scopes > 0);
+    Scope *scope = &cg->scopes[cg->num_scopes-1];
+
+    call->next = scope->calls;
+    scope->calls = call;
 }
 
-#define WL_MAGIC 0xFEEDBEEF
+static bool cg_global_scope(Codegen *cg)
+{
+    Scope *scope = visible_scope(cg);
+    return scope->type == SCOPE_GLOBAL;
+}
 
-static int codegen(Node *node, char *dst, int cap, char *errmsg, int errcap)
+static int cg_write_instr_start(Codegen *cg, uint8_t opcode)
 {
-    char *hdr;
-    if (cap < SIZEOF(uint32_t) * 3)
-        hdr = NULL;
-    else {
-        hdr = dst;
-        dst += SIZEOF(uint32_t) * 3;
-        cap -= SIZEOF(uint32_t) * 3;
-    }
+    cg->prev[1] = cg->prev[0];
+    cg->prev[0] = cg->code.len;
+    return cg_write_u8(cg, opcode);
+}
 
-    Codegen cg = {
-        .code = { dst,         cap/2, 0 },
-        .data = { dst + cap/2, cap/2, 0 },
-        .num_scopes = 0,
-        .err = false,
-        .errmsg = errmsg,
-        .errcap = errcap,
-        .data_off = -1,
-    };
+static uint8_t cg_opcode_at(Codegen *cg, int off)
+{
+    if (off < 0)
+        return OPCODE_NOPE;
+    return (uint8_t) cg->code.dst[off];
+}
 
-    cg.free_list_calls = cg.calls;
-    for (int i = 0; i < MAX_UNPATCHED_CALLS-1; i++)
-        cg.calls[i].next = &cg.calls[i+1];
-    cg.calls[MAX_UNPATCHED_CALLS-1].next = NULL;
+// Peephole optimization. Before an instruction is
+// written, this function checks whether it completes
+// one of the common sequences that have a fused
+// equivalent. If it does, the sequence is rewritten
+// in place, true is returned, and the instruction
+// must not be written.
+//
+// Only instructions which don't hold patchable operands
+// are fused, and a sequence is never fused across a
+// jump target (see cg_current_offset).
+static bool cg_fuse(Codegen *cg, uint8_t opcode)
+{
+    if (cg->err)
+        return false;
 
-    cg_push_scope(&cg, SCOPE_GLOBAL);
-    cg_write_opcode(&cg, OPCODE_VARS);
-    int off = cg_write_u8(&cg, 0);
-    walk_node(&cg, node, false);
-    cg_write_opcode(&cg, OPCODE_EXIT);
-    cg_patch_u8(&cg, off, cg.scopes[0].max_vars);
-    cg_pop_scope(&cg);
+    // All instructions must be in the buffer
+    // to be inspected
+    if (cg->code.len > cg->code.cap)
+        return false;
 
-    if (cg.err)
-        return -1;
+    int p0 = cg->prev[0];
+    int p1 = cg->prev[1];
+    char *code = cg->code.dst;
 
-    if (hdr) {
+    switch (opcode) {
 
-        uint32_t magic = WL_MAGIC;
-        uint32_t code_len = cg.code.len;
-        uint32_t data_len = cg.data.len;
-        memcpy(hdr + 0, &magic   , sizeof(uint32_t));
-        memcpy(hdr + 4, &code_len, sizeof(uint32_t));
-        memcpy(hdr + 8, &data_len, sizeof(uint32_t));
+        case OPCODE_POP:
+        if (cg_opcode_at(cg, p0) == OPCODE_SETV) {
+
+            if (cg_opcode_at(cg, p1) == OPCODE_PUSHI) {
+                // PUSHI k; SETV x; POP -> SETVI x k
+                ASSERT(p0 == p1 + 9);
+                int64_t k;
+                memcpy(&k, code + p1 + 1, sizeof(k));
+                code[p1+0] = OPCODE_SETVI;
+                code[p1+1] = code[p0+1];
+                memcpy(code + p1 + 2, &k, sizeof(k));
+                cg->code.len = p1 + 10;
+                cg->prev[0] = p1;
+                cg->prev[1] = -1;
+                return true;
+            }
 
-        if (cg.code.len + cg.data.len <= cap)
-            memmove(dst + cg.code.len, dst + cap/2, cg.data.len);
+            // SETV x; POP -> SETVP x
+            code[p0] = OPCODE_SETVP;
+            cg->prev[1] = -1;
+            return true;
+        }
+        break;
+
+        case OPCODE_ADD:
+        if (cg_opcode_at(cg, p0) == OPCODE_PUSHV
+            && cg_opcode_at(cg, p1) == OPCODE_PUSHV) {
+            // PUSHV x; PUSHV y; ADD -> ADDVV x y
+            ASSERT(p0 == p1 + 2);
+            code[p1+0] = OPCODE_ADDVV;
+            code[p1+2] = code[p0+1];
+            cg->code.len = p1 + 3;
+            cg->prev[0] = p1;
+            cg->prev[1] = -1;
+            return true;
+        }
+        break;
+
+        case OPCODE_SELECT:
+        if (cg_opcode_at(cg, p0) == OPCODE_PUSHS) {
+            // PUSHS k; SELECT -> SELS k
+            code[p0] = OPCODE_SELS;
+            cg->prev[1] = -1;
+            return true;
+        }
+        break;
     }
 
-    return cg.code.len + cg.data.len + SIZEOF(uint32_t) * 3;
+    return false;
 }
 
-static int write_instr(Writer *w, char *src, int len, String data)
+static void cg_flush_pushs(Codegen *cg)
 {
-    if (len == 0)
-        return -1;
+    if (cg->data_off != -1) {
+        if (cg->data_off < cg->data.len) {
+            cg_write_instr_start(cg, cg->data_trusted ? OPCODE_PUSHH : OPCODE_PUSHS);
+            cg_write_u32(cg, cg->data_off);
+            cg_write_u32(cg, cg->data.len - cg->data_off);
+            if (cg->data_output)
+                cg_write_instr_start(cg, OPCODE_OUTPUT);
+        }
+        cg->data_off = -1;
+        cg->data_output = false;
+    }
+}
 
-    switch (src[0]) {
+static int cg_write_opcode(Codegen *cg, uint8_t opcode)
+{
+    ASSERT(opcode != OPCODE_PUSHS && opcode != OPCODE_PUSHH);
+    cg_flush_pushs(cg);
+    if (cg_fuse(cg, opcode))
+        return cg->prev[0];
+    return cg_write_instr_start(cg, opcode);
+}
 
-        uint8_t b0;
-        uint8_t b1;
-        uint8_t b2;
-        uint32_t w0;
-        uint32_t w1;
-        int64_t i;
-        double  d;
+// Static text is pushed with PUSHH when it's HTML, which
+// the escape operator leaves as it is, or PUSHS otherwise.
+// Consecutive pushes of the same kind are merged unless
+// "dont_group" is set.
+static void cg_write_pushs(Codegen *cg, String str, bool trusted, bool dont_group)
+{
+    if (dont_group) {
+        cg_flush_pushs(cg);
+        cg_write_instr_start(cg, trusted ? OPCODE_PUSHH : OPCODE_PUSHS);
+        cg_write_str(cg, str);
+    } else {
+        if (cg->data_off != -1 && cg->data_trusted != trusted)
+            cg_flush_pushs(cg);
+        if (cg->data_off == -1) {
+            cg->data_off = cg->data.len;
+            cg->data_trusted = trusted;
+        }
+        write_raw_mem(&cg->data, str.ptr, str.len);
+    }
+}
 
-        case OPCODE_NOPE:
-        write_text(w, S("NOPE\n"));
-        return 1;
+static void walk_node(Codegen *cg, Node *node, bool inside_html);
+static void walk_expr_node(Codegen *cg, Node *node, bool one);
 
-        case OPCODE_JUMP:
-        if (len < 5) return -1;
-        memcpy(&w0, src + 1, sizeof(uint32_t));
-        write_text(w, S("JUMP "));
-        write_text_s64(w, w0);
-        write_text(w, S("\n"));
-        return 5;
+// Returns the declaration of "name" if it's one of the
+// statements of "node", which may be a list when the
+// statements were included from a different file.
+static Node *find_decl(Node *node, String name)
+{
+    switch (node->type) {
 
-        case OPCODE_JIFP:
-        if (len < 5) return -1;
-        memcpy(&w0, src + 1, sizeof(uint32_t));
-        write_text(w, S("JIFP "));
-        write_text_s64(w, w0);
-        write_text(w, S("\n"));
-        return 5;
+        case NODE_PROCEDURE_DECL:
+        if (streq(node->proc_name, name))
+            return node;
+        break;
 
-        case OPCODE_OUTPUT:
-        write_text(w, S("OUTPUT\n"));
-        return 1;
+        case NODE_VAR_DECL:
+        if (streq(node->var_name, name))
+            return node;
+        break;
 
-        case OPCODE_SYSVAR:
-        if (len < 9) return -1;
-        memcpy(&w0, src + 1, sizeof(uint32_t));
-        memcpy(&w1, src + 5, sizeof(uint32_t));
-        write_text(w, S("SYSVAR \""));
-        write_text(w, (String) { data.ptr + w0, w1 });
-        write_text(w, S("\"\n"));
-        return 9;
+        case NODE_GLOBAL:
+        for (Node *child = node->left; child; child = child->next) {
+            Node *decl = find_decl(child, name);
+            if (decl) return decl;
+        }
+        break;
 
-        case OPCODE_SYSCALL:
-        if (len < 10) return -1;
-        memcpy(&b0, src + 1, sizeof(uint8_t));
-        memcpy(&w0, src + 2, sizeof(uint32_t));
-        memcpy(&w1, src + 6, sizeof(uint32_t));
-        write_text(w, S("SYSCALL "));
-        write_text_s64(w, b0);
-        write_text(w, S(" \""));
-        write_text(w, (String) { data.ptr + w0, w1 });
-        write_text(w, S("\"\n"));
-        return 10;
+        case NODE_INCLUDE:
+        return find_decl(node->include_root, name);
 
-        case OPCODE_CALL:
-        if (len < 6) return -1;
-        memcpy(&b0, src + 1, sizeof(uint8_t));
-        memcpy(&w0, src + 2, sizeof(uint32_t));
-        write_text(w, S("CALL "));
-        write_text_s64(w, b0);
-        write_text(w, S(" "));
-        write_text_s64(w, w0);
-        write_text(w, S("\n"));
-        return 6;
+        default:
+        break;
+    }
 
-        case OPCODE_RET:
-        write_text(w, S("RET\n"));
-        return 1;
+    return NULL;
+}
 
-        case OPCODE_GROUP:
-        write_text(w, S("GROUP\n"));
-        return 1;
+static Node *scope_find_decl(Scope *scope, String name)
+{
+    Node *body = scope->body;
+    if (body == NULL)
+        return NULL;
 
-        case OPCODE_ESCAPE:
-        write_text(w, S("ESCAPE\n"));
-        return 1;
+    if (scope->type != SCOPE_COMPOUND)
+        return find_decl(body, name);
 
-        case OPCODE_PACK:
-        write_text(w, S("PACK\n"));
-        return 1;
+    ASSERT(body->type == NODE_COMPOUND);
+    for (Node *child = body->left; child; child = child->next) {
+        Node *decl = find_decl(child, name);
+        if (decl) return decl;
+    }
+    return NULL;
+}
 
-        case OPCODE_GPOP:
-        write_text(w, S("GPOP\n"));
-        return 1;
+// Returns the declaration of the procedure that a call
+// to "name" from the current scope resolves to when the
+// scope is popped (see cg_pop_scope), or NULL if the name
+// refers to a variable or isn't declared.
+static Node *cg_find_procedure_decl(Codegen *cg, String name)
+{
+    for (int i = cg->num_scopes-1; i >= 0; i--) {
 
-        case OPCODE_FOR:
-        if (len < 8) return -1;
-        memcpy(&b0, src + 1, sizeof(b0));
-        memcpy(&b1, src + 2, sizeof(b1));
-        memcpy(&b2, src + 3, sizeof(b2));
-        memcpy(&w0, src + 4, sizeof(w0));
-        write_text(w, S("FOR "));
-        write_text_s64(w, b0);
-        write_text(w, S(" "));
-        write_text_s64(w, b1);
-        write_text(w, S(" "));
-        write_text_s64(w, b2);
-        write_text(w, S(" "));
-        write_text_s64(w, w0);
-        write_text(w, S("\n"));
-        return 8;
+        Scope *scope = &cg->scopes[i];
 
-        case OPCODE_EXIT:
-        write_text(w, S("EXIT\n"));
-        return 1;
+        int end = (i+1 < cg->num_scopes) ? cg->scopes[i+1].idx_syms : cg->num_syms;
+        for (int j = scope->idx_syms; j < end; j++)
+            if (cg->syms[j].type == SYMBOL_VARIABLE && streq(cg->syms[j].name, name))
+                return NULL;
 
-        case OPCODE_VARS:
-        if (len < 2) return -1;
-        memcpy(&b0, src + 1, sizeof(b0));
-        write_text(w, S("VARS "));
-        write_text_s64(w, b0);
-        write_text(w, S("\n"));
-        return 2;
+        Node *decl = scope_find_decl(scope, name);
+        if (decl)
+            return decl->type == NODE_PROCEDURE_DECL ? decl : NULL;
+    }
+    return NULL;
+}
 
-        case OPCODE_POP:
-        write_text(w, S("POP\n"));
-        return 1;
+static bool inline_count_list(Node *head, int *n, int max);
 
-        case OPCODE_SETV:
-        if (len < 2) return -1;
-        memcpy(&b0, src + 1, sizeof(uint8_t));
-        write_text(w, S("SETV "));
-        write_text_s64(w, b0);
-        write_text(w, S("\n"));
-        return 2;
+// Adds the number of nodes of a procedure body to "n".
+// Returns false if there are more than "max" or if the
+// body can't be inlined. Calls to other procedures and
+// nested declarations are never inlined since their names
+// would be resolved from the call site, which also rules
+// out recursion.
+static bool inline_count(Node *node, int *n, int max)
+{
+    if (node == NULL)
+        return true;
 
-        case OPCODE_PUSHV:
-        if (len < 2) return -1;
-        memcpy(&b0, src + 1, sizeof(uint8_t));
-        write_text(w, S("PUSHV "));
-        write_text_s64(w, b0);
-        write_text(w, S("\n"));
-        return 2;
+    if (++*n > max)
+        return false;
 
-        case OPCODE_PUSHI:
-        if (len < 9) return -1;
-        memcpy(&i, src + 1, sizeof(int64_t));
-        write_text(w, S("PUSHI "));
-        write_text_s64(w, i);
-        write_text(w, S("\n"));
-        return 9;
+    switch (node->type) {
 
-        case OPCODE_PUSHF:
-        if (len < 9) return -1;
-        memcpy(&d, src + 1, sizeof(double));
-        write_text(w, S("PUSHF "));
-        write_text_f64(w, d);
-        write_text(w, S("\n"));
-        return 9;
+        case NODE_PROCEDURE_DECL:
+        case NODE_INCLUDE:
+        return false;
 
-        case OPCODE_PUSHS:
-        if (len < 9) return -1;
-        memcpy(&w0, src + 1, sizeof(uint32_t));
-        memcpy(&w1, src + 5, sizeof(uint32_t));
-        write_text(w, S("PUSHS \""));
-        write_text(w, (String) { data.ptr + w0, w1 });
-        write_text(w, S("\"\n"));
-        return 9;
+        case NODE_PROCEDURE_CALL:
+        if (node->left->type != NODE_VALUE_SYSVAR)
+            return false;
+        return inline_count_list(node->right, n, max);
 
-        case OPCODE_PUSHA:
-        if (len < 5) return -1;
-        memcpy(&w0, src + 1, sizeof(w0));
-        write_text(w, S("PUSHA "));
-        write_text_s64(w, w0);
-        write_text(w, S("\n"));
-        return 5;
+        case NODE_GLOBAL:
+        case NODE_COMPOUND:
+        return inline_count_list(node->left, n, max);
+
+        case NODE_VAR_DECL:
+        return inline_count(node->var_value, n, max);
+
+        case NODE_IFELSE:
+        return inline_count(node->if_cond, n, max)
+            && inline_count(node->if_branch1, n, max)
+            && inline_count(node->if_branch2, n, max);
+
+        case NODE_FOR:
+        return inline_count(node->for_set, n, max)
+            && inline_count(node->left, n, max);
+
+        case NODE_WHILE:
+        return inline_count(node->while_cond, n, max)
+            && inline_count(node->left, n, max);
+
+        case NODE_SELECT:
+        case NODE_OPER_ASS:
+        case NODE_OPER_SHOVEL:
+        case NODE_OPER_EQL:
+        case NODE_OPER_NQL:
+        case NODE_OPER_LSS:
+        case NODE_OPER_GRT:
+        case NODE_OPER_ADD:
+        case NODE_OPER_SUB:
+        case NODE_OPER_MUL:
+        case NODE_OPER_DIV:
+        case NODE_OPER_MOD:
+        return inline_count(node->left, n, max)
+            && inline_count(node->right, n, max);
+
+        case NODE_NESTED:
+        case NODE_OPER_ESCAPE:
+        case NODE_OPER_LEN:
+        case NODE_OPER_POS:
+        case NODE_OPER_NEG:
+        return inline_count(node->left, n, max);
+
+        case NODE_VALUE_HTML:
+        return inline_count_list(node->html_attr, n, max)
+            && inline_count_list(node->html_child, n, max);
+
+        case NODE_VALUE_ARRAY:
+        return inline_count_list(node->child, n, max);
+
+        case NODE_VALUE_MAP:
+        for (Node *child = node->child; child; child = child->next)
+            if (!inline_count(child, n, max) || !inline_count(child->key, n, max))
+                return false;
+        return true;
+
+        default:
+        return true;
+    }
+}
+
+static bool inline_count_list(Node *head, int *n, int max)
+{
+    for (Node *node = head; node; node = node->next)
+        if (!inline_count(node, n, max))
+            return false;
+    return true;
+}
+
+// Returns the declaration of the procedure called by
+// "call" if the call can be replaced by its body
+static Node *cg_inline_target(Codegen *cg, Node *call)
+{
+    if (cg->inline_budget <= 0)
+        return NULL;
+
+    ASSERT(call->left->type == NODE_VALUE_VAR);
+    Node *decl = cg_find_procedure_decl(cg, call->left->sval);
+    if (decl == NULL)
+        return NULL;
+
+    int num_args = count_nodes(decl->proc_args);
+    if (num_args > MAX_INLINE_ARGS || num_args != count_nodes(call->right))
+        return NULL;
+
+    int n = 0;
+    if (!inline_count(decl->proc_body, &n, cg->inline_budget))
+        return NULL;
+
+    // The body declares fewer variables than it has nodes,
+    // so this guarantees they fit in the caller's frame
+    if (count_function_vars(cg) + num_args + n > UINT8_MAX)
+        return NULL;
+
+    return decl;
+}
+
+// Returns true if "call" is the last statement that
+// "stmt" evaluates, in which case nothing is left to do
+// after it returns
+static bool tail_position(Node *stmt, Node *call)
+{
+    if (stmt == NULL)
+        return false;
+
+    switch (stmt->type) {
+
+        case NODE_PROCEDURE_CALL:
+        return stmt == call;
+
+        case NODE_COMPOUND:
+        {
+            Node *last = stmt->left;
+            if (last == NULL)
+                return false;
+            while (last->next)
+                last = last->next;
+            return tail_position(last, call);
+        }
+
+        case NODE_IFELSE:
+        return tail_position(stmt->if_branch1, call)
+            || tail_position(stmt->if_branch2, call);
+
+        default:
+        break;
+    }
+
+    return false;
+}
+
+// Returns true if the call is a recursive call to the
+// current procedure in tail position, which can reuse
+// the procedure's frame
+static bool cg_tail_call(Codegen *cg, Node *call)
+{
+    Node *proc = cg->proc;
+    if (proc == NULL || !tail_position(proc->proc_body, call))
+        return false;
+
+    if (count_nodes(call->right) != count_nodes(proc->proc_args))
+        return false;
+
+    ASSERT(call->left->type == NODE_VALUE_VAR);
+    return cg_find_procedure_decl(cg, call->left->sval) == proc;
+}
+
+// Writes the body of a procedure in place of a call. The
+// arguments are on the stack and are moved to variables
+// of the caller's frame, which is what CALL would do with
+// a new frame.
+static void cg_write_inline(Codegen *cg, Node *decl)
+{
+    cg_push_scope(cg, SCOPE_INLINE, NULL);
+
+    int num_args = 0;
+    int args[MAX_INLINE_ARGS];
+    for (Node *arg = decl->proc_args; arg; arg = arg->next)
+        args[num_args++] = cg_declare_variable(cg, arg->sval, false);
+
+    for (int i = num_args-1; i >= 0; i--) {
+        cg_write_opcode(cg, OPCODE_SETV);
+        cg_write_u8(cg, args[i]);
+        cg_write_opcode(cg, OPCODE_POP);
+    }
+
+    walk_node(cg, decl->proc_body, false);
+    cg_pop_scope(cg);
+}
+
+// Writes the text of a constant or static HTML element that
+// is output or inserted into an element. Text that is output
+// directly is never escaped, so it's merged with HTML. Returns
+// false if the node isn't static.
+static bool cg_write_text(Codegen *cg, Node *node, bool output)
+{
+    char buf[1<<9];
+    Writer w = { buf, SIZEOF(buf), 0 };
+
+    switch (node->type) {
+
+        case NODE_VALUE_STR:
+        cg_write_pushs(cg, node->sval, node->trusted || output, false);
+        return true;
+
+        case NODE_VALUE_HTML:
+        if (!fold_is_text(node))
+            return false;
+        walk_expr_node(cg, node, false);
+        return true;
+
+        case NODE_VALUE_NONE:
+        return true;
+
+        // Only the text of escaped literals that are output
+        // is known, since as values they keep the raw text
+        case NODE_OPER_ESCAPE:
+        if (!output || node->left->type != NODE_VALUE_STR)
+            return false;
+        write_text_escaped(&w, node->left->sval);
+        break;
+
+        case NODE_VALUE_INT  : write_text_s64(&w, node->ival); break;
+        case NODE_VALUE_FLOAT: write_text_f64(&w, node->fval); break;
+        case NODE_VALUE_TRUE : write_text(&w, S("true"));      break;
+        case NODE_VALUE_FALSE: write_text(&w, S("false"));     break;
+
+        default:
+        return false;
+    }
+
+    // Numbers are written using snprintf, which needs
+    // room for the null terminator. Text that doesn't fit
+    // is left to the runtime.
+    if (w.len >= w.cap)
+        return false;
+
+    cg_write_pushs(cg, (String) { buf, w.len }, true, false);
+    return true;
+}
+
+// Returns true if the element is static and none of the
+// strings inserted into it need escaping, in which case all
+// of its text is pushed as a single HTML string.
+static bool cg_trusted_html(Node *node)
+{
+    ASSERT(node->type == NODE_VALUE_HTML);
+
+    Node *lists[] = { node->html_attr, node->html_child };
+    for (int i = 0; i < 2; i++)
+        for (Node *child = lists[i]; child; child = child->next) {
+            if (child->type == NODE_VALUE_HTML) {
+                if (!cg_trusted_html(child))
+                    return false;
+            } else {
+                if (!fold_is_const(child))
+                    return false;
+                if (child->type == NODE_VALUE_STR && !child->trusted)
+                    return false;
+            }
+        }
+    return true;
+}
+
+static void walk_expr_node(Codegen *cg, Node *node, bool one)
+{
+    switch (node->type) {
+
+        case NODE_NESTED:
+        walk_expr_node(cg, node->left, one);
+        break;
+
+        case NODE_OPER_LEN:
+        walk_expr_node(cg, node->left, true);
+        cg_write_opcode(cg, OPCODE_LEN);
+        break;
+
+        case NODE_OPER_ESCAPE:
+        cg_write_opcode(cg, OPCODE_GROUP);
+        walk_expr_node(cg, node->left, false);
+        cg_write_opcode(cg, OPCODE_ESCAPE);
+        break;
+
+        case NODE_OPER_POS:
+        walk_expr_node(cg, node->left, one);
+        break;
+
+        case NODE_OPER_NEG:
+        walk_expr_node(cg, node->left, true);
+        cg_write_opcode(cg, OPCODE_NEG);
+        break;
+
+        case NODE_OPER_ASS:
+        {
+            Node *dst = node->left;
+            Node *src = node->right;
+
+            if (dst->type == NODE_VALUE_VAR) {
+
+                String name = dst->sval;
+                Symbol *sym = cg_find_symbol(cg, name, false);
+                if (sym == NULL) {
+                    cg_report(cg, "Write to undeclared variable");
+                    return;
+                }
+                if (sym->type == SYMBOL_PROCEDURE) {
+                    cg_report(cg, "Symbol is not a variable");
+                    return;
+                }
+                if (sym->cnst) {
+                    cg_report(cg, "Variable is constant");
+                    return;
+                }
+
+                cg_push_scope(cg, SCOPE_ASSIGNMENT, NULL);
+                walk_expr_node(cg, src, true);
+                cg_pop_scope(cg);
+
+                cg_write_opcode(cg, OPCODE_SETV);
+                cg_write_u8(cg, sym->off);
+
+                if (!one)
+                    cg_write_opcode(cg, OPCODE_POP);
+
+            } else if (dst->type == NODE_SELECT) {
+
+                cg_push_scope(cg, SCOPE_ASSIGNMENT, NULL);
+                walk_expr_node(cg, src, true);
+                cg_pop_scope(cg);
+
+                walk_expr_node(cg, dst->left,  true);
+                walk_expr_node(cg, dst->right, true);
+                cg_write_opcode(cg, OPCODE_INSERT2);
+
+                if (!one)
+                    cg_write_opcode(cg, OPCODE_POP);
+
+            } else {
+
+                cg_report(cg, "Assignment left side can't be assigned to");
+                return;
+            }
+        }
+        break;
+
+        case NODE_OPER_SHOVEL:
+        {
+            walk_expr_node(cg, node->left, true);
+
+            cg_push_scope(cg, SCOPE_ASSIGNMENT, NULL);
+            walk_expr_node(cg, node->right, true);
+            cg_pop_scope(cg);
+
+            cg_write_opcode(cg, OPCODE_APPEND);
+            if (!one)
+                cg_write_opcode(cg, OPCODE_POP);
+        }
+        break;
+
+        case NODE_OPER_EQL:
+        walk_expr_node(cg, node->left, true);
+        walk_expr_node(cg, node->right, true);
+        cg_write_opcode(cg, OPCODE_EQL);
+        break;
+
+        case NODE_OPER_NQL:
+        walk_expr_node(cg, node->left, true);
+        walk_expr_node(cg, node->right, true);
+        cg_write_opcode(cg, OPCODE_NQL);
+        break;
+
+        case NODE_OPER_LSS:
+        walk_expr_node(cg, node->left, true);
+        walk_expr_node(cg, node->right, true);
+        cg_write_opcode(cg, OPCODE_LSS);
+        break;
+
+        case NODE_OPER_GRT:
+        walk_expr_node(cg, node->left, true);
+        walk_expr_node(cg, node->right, true);
+        cg_write_opcode(cg, OPCODE_GRT);
+        break;
+
+        case NODE_OPER_ADD:
+        walk_expr_node(cg, node->left, true);
+        walk_expr_node(cg, node->right, true);
+        cg_write_opcode(cg, OPCODE_ADD);
+        break;
+
+        case NODE_OPER_SUB:
+        walk_expr_node(cg, node->left, true);
+        walk_expr_node(cg, node->right, true);
+        cg_write_opcode(cg, OPCODE_SUB);
+        break;
+
+        case NODE_OPER_MUL:
+        walk_expr_node(cg, node->left, true);
+        walk_expr_node(cg, node->right, true);
+        cg_write_opcode(cg, OPCODE_MUL);
+        break;
+
+        case NODE_OPER_DIV:
+        walk_expr_node(cg, node->left, true);
+        walk_expr_node(cg, node->right, true);
+        cg_write_opcode(cg, OPCODE_DIV);
+        break;
+
+        case NODE_OPER_MOD:
+        walk_expr_node(cg, node->left, true);
+        walk_expr_node(cg, node->right, true);
+        cg_write_opcode(cg, OPCODE_MOD);
+        break;
+
+        case NODE_VALUE_INT:
+        cg_write_opcode(cg, OPCODE_PUSHI);
+        cg_write_s64(cg, node->ival);
+        break;
+
+        case NODE_VALUE_FLOAT:
+        cg_write_opcode(cg, OPCODE_PUSHF);
+        cg_write_f64(cg, node->fval);
+        break;
+
+        case NODE_VALUE_STR:
+        cg_write_pushs(cg, node->sval, node->trusted, one);
+        break;
+
+        case NODE_VALUE_NONE:
+        cg_write_opcode(cg, OPCODE_PUSHN);
+        break;
+
+        case NODE_VALUE_TRUE:
+        cg_write_opcode(cg, OPCODE_PUSHT);
+        break;
+
+        case NODE_VALUE_FALSE:
+        cg_write_opcode(cg, OPCODE_PUSHFL);
+        break;
+
+        case NODE_VALUE_VAR:
+        {
+            String name = node->sval;
+            Symbol *sym = cg_find_symbol(cg, name, false);
+            if (sym == NULL) {
+                cg_report(cg, "Access to undeclared variable '%.*s'", name.len, name.ptr);
+                return;
+            }
+            if (sym->type == SYMBOL_PROCEDURE) {
+                cg_report(cg, "Symbol is not a variable");
+                return;
+            }
+
+            cg_write_opcode(cg, OPCODE_PUSHV);
+            cg_write_u8(cg, sym->off);
+        }
+        break;
+
+        case NODE_VALUE_SYSVAR:
+        {
+            Native *n = cg_find_native(cg, node->sval);
+            if (n) {
+                cg_write_opcode(cg, OPCODE_NVAR);
+                cg_write_native(cg, n);
+            } else {
+                cg_write_opcode(cg, OPCODE_SYSVAR);
+                cg_write_external(cg, node->sval, false, 0);
+            }
+        }
+        break;
+
+        case NODE_VALUE_HTML:
+        {
+            // Packing a single string leaves it as it is, so
+            // the group is only needed if the element produces
+            // more than one value. Otherwise its text must not
+            // be merged with the text around it.
+            bool group = one && !cg_trusted_html(node);
+            if (group)
+                cg_write_opcode(cg, OPCODE_GROUP);
+            else if (one)
+                cg_flush_pushs(cg);
+
+            cg_write_pushs(cg, S("<"), true, false);
+            cg_write_pushs(cg, node->html_tag, true, false);
+
+            Node *child = node->html_attr;
+            while (child) {
+                walk_node(cg, child, true);
+                child = child->next;
+            }
+
+            if (!node->html_body) {
+                cg_write_pushs(cg, S("/>"), true, false);
+            } else {
+                cg_write_pushs(cg, S(">"), true, false);
+                Node *child = node->html_child;
+                while (child) {
+                    walk_node(cg, child, true);
+                    child = child->next;
+                }
+                cg_write_pushs(cg, S("</"), true, false);
+                cg_write_pushs(cg, node->html_tag, true, false);
+                cg_write_pushs(cg, S(">"), true, false);
+            }
+
+            if (group)
+                cg_write_opcode(cg, OPCODE_PACK);
+            else if (one)
+                cg_flush_pushs(cg);
+        }
+        break;
+
+        case NODE_VALUE_ARRAY:
+        {
+            if (cg_const_aggregate(node)) {
+                cg_write_opcode(cg, OPCODE_PUSHK);
+                cg_write_const_aggregate(cg, node);
+                break;
+            }
+
+            cg_write_opcode(cg, OPCODE_PUSHA);
+            cg_write_u32(cg, count_nodes(node->child));
+
+            Node *child = node->child;
+            while (child) {
+                walk_expr_node(cg, child, true);
+                cg_write_opcode(cg, OPCODE_APPEND);
+                child = child->next;
+            }
+        }
+        break;
+
+        case NODE_VALUE_MAP:
+        {
+            if (cg_const_aggregate(node)) {
+                cg_write_opcode(cg, OPCODE_PUSHK);
+                cg_write_const_aggregate(cg, node);
+                break;
+            }
+
+            cg_write_opcode(cg, OPCODE_PUSHM);
+            cg_write_u32(cg, count_nodes(node->child));
+
+            Node *child = node->child;
+            while (child) {
+                walk_expr_node(cg, child, true);
+                walk_expr_node(cg, child->key, true);
+                cg_write_opcode(cg, OPCODE_INSERT1);
+                child = child->next;
+            }
+        }
+        break;
+
+        case NODE_SELECT:
+        {
+            Node *set = node->left;
+            Node *key = node->right;
+            walk_expr_node(cg, set, true);
+            walk_expr_node(cg, key, true);
+            cg_write_opcode(cg, OPCODE_SELECT);
+        }
+        break;
+
+        case NODE_PROCEDURE_CALL:
+        {
+            if (one)
+                cg_write_opcode(cg, OPCODE_GROUP);
+
+            Node *proc = node->left;
+            Node *decl = NULL;
+            if (proc->type == NODE_VALUE_VAR)
+                decl = cg_inline_target(cg, node);
+
+            int count = 0;
+            Node *arg = node->right;
+            while (arg) {
+                walk_expr_node(cg, arg, true);
+                count++;
+                arg = arg->next;
+            }
+
+            if (decl) {
+
+                cg_write_inline(cg, decl);
+
+            } else if (proc->type == NODE_VALUE_VAR && !one && cg_tail_call(cg, node)) {
+
+                cg_write_opcode(cg, OPCODE_TAIL);
+                cg_write_u8(cg, count);
+                cg_write_u32(cg, cg->proc_off);
+
+            } else if (proc->type == NODE_VALUE_VAR) {
+
+                cg_write_opcode(cg, OPCODE_CALL);
+                cg_write_u8(cg, count);
+                int p = cg_write_u32(cg, 0);
+                cg_append_unpatched_call(cg, proc->sval, p);
+
+            } else {
+
+                ASSERT(proc->type == NODE_VALUE_SYSVAR);
+                Native *n = cg_find_native(cg, proc->sval);
+                if (n) {
+                    cg_write_opcode(cg, OPCODE_NCALL);
+                    cg_write_u8(cg, count);
+                    cg_write_native(cg, n);
+                } else {
+                    cg_write_opcode(cg, OPCODE_SYSCALL);
+                    cg_write_u8(cg, count);
+                    cg_write_external(cg, proc->sval, true, count);
+                }
+            }
+
+            if (one)
+                cg_write_opcode(cg, OPCODE_PACK);
+        }
+        break;
+
+        default:
+        UNREACHABLE;
+    }
+}
+
+static void walk_node(Codegen *cg, Node *node, bool inside_html)
+{
+    switch (node->type) {
+
+        case NODE_GLOBAL:
+        for (Node *child = node->left;
+            child; child = child->next) {
+            walk_node(cg, child, false);
+        }
+        break;
+
+        case NODE_COMPOUND:
+        cg_push_scope(cg, SCOPE_COMPOUND, node);
+        for (Node *child = node->left;
+            child; child = child->next)
+            walk_node(cg, child, inside_html);
+        cg_pop_scope(cg);
+        break;
+
+        case NODE_PROCEDURE_DECL:
+        {
+            cg_push_scope(cg, SCOPE_PROC, node->proc_body);
+
+            cg_write_opcode(cg, OPCODE_JUMP);
+            int off0 = cg_write_u32(cg, 0);
+
+            #define MAX_ARGS 128
+
+            int num_args = 0;
+            Node *args[MAX_ARGS];
+
+            Node *arg = node->proc_args;
+            while (arg) {
+                if (num_args == MAX_ARGS) {
+                    cg_report(cg, "Procedure argument limit reached");
+                    return;
+                }
+                args[num_args++] = arg;
+                arg = arg->next;
+            }
+
+            for (int i = num_args-1; i >= 0; i--)
+                cg_declare_variable(cg, args[i]->sval, false);
+
+            int off1 = cg_write_opcode(cg, OPCODE_VARS);
+            int off2 = cg_write_u8(cg, 0);
+
+            Node *outer_proc = cg->proc;
+            int   outer_off  = cg->proc_off;
+            cg->proc = node;
+            cg->proc_off = off1;
+
+            walk_node(cg, node->proc_body, false);
+            cg_write_opcode(cg, OPCODE_RET);
+
+            cg->proc = outer_proc;
+            cg->proc_off = outer_off;
+
+            cg_patch_u8 (cg, off2, cg->scopes[cg->num_scopes-1].max_vars);
+            cg_patch_u32(cg, off0, cg_current_offset(cg));
+
+            cg_pop_scope(cg);
+
+            cg_declare_procedure(cg, node->proc_name, off1);
+        }
+        break;
+
+        case NODE_VAR_DECL:
+        {
+            int off = cg_declare_variable(cg, node->var_name, false);
+            if (node->var_value) {
+                cg_push_scope(cg, SCOPE_ASSIGNMENT, NULL);
+                walk_expr_node(cg, node->var_value, true);
+                cg_pop_scope(cg);
+            } else
+                cg_write_opcode(cg, OPCODE_PUSHN);
+            cg_write_opcode(cg, OPCODE_SETV);
+            cg_write_u8(cg, off);
+            cg_write_opcode(cg, OPCODE_POP);
+        }
+        break;
+
+        case NODE_IFELSE:
+        {
+            // If there is no else branch:
+            //
+            //   <cond>
+            //   JIFP end
+            //   <left>
+            // end:
+            //   ...
+            //
+            // If there is:
+            //
+            //   <cond>
+            //   JIFP else
+            //   <left>
+            //   JUMP end
+            // else:
+            //   <right>
+            // end:
+            //   ...
+
+            if (node->if_branch2) {
+
+                walk_expr_node(cg, node->if_cond, true);
+
+                cg_write_opcode(cg, OPCODE_JIFP);
+                int p1 = cg_write_u32(cg, 0);
+
+                cg_push_scope(cg, SCOPE_IF, node->if_branch1);
+                walk_node(cg, node->if_branch1, inside_html);
+                cg_pop_scope(cg);
+
+                cg_write_opcode(cg, OPCODE_JUMP);
+                int p2 = cg_write_u32(cg, 0);
+
+                cg_patch_u32(cg, p1, cg_current_offset(cg));
+
+                cg_push_scope(cg, SCOPE_ELSE, node->if_branch2);
+                walk_node(cg, node->if_branch2, inside_html);
+                cg_pop_scope(cg);
+
+                cg_patch_u32(cg, p2, cg_current_offset(cg));
+
+            } else {
+
+                walk_expr_node(cg, node->if_cond, true);
+
+                cg_write_opcode(cg, OPCODE_JIFP);
+                int p1 = cg_write_u32(cg, 0);
+
+                cg_push_scope(cg, SCOPE_IF, node->if_branch1);
+                walk_node(cg, node->if_branch1, inside_html);
+                cg_pop_scope(cg);
+
+                cg_patch_u32(cg, p1, cg_current_offset(cg));
+            }
+        }
+        break;
+
+        case NODE_FOR:
+        {
+            cg_push_scope(cg, SCOPE_FOR, node->left);
+
+            int var_1 = cg_declare_variable(cg, node->for_var1, false);
+            int var_2 = cg_declare_variable(cg, node->for_var2, true);
+            int var_3 = cg_declare_variable(cg, (String) { NULL, 0 }, true);
+            int var_4 = -1;
+            if (!inside_html)
+                var_4 = cg_declare_variable(cg, (String) { NULL, 0 }, true);
+            int num_live = count_function_vars(cg);
+
+            walk_expr_node(cg, node->for_set, true);
+            cg_write_opcode(cg, OPCODE_SETV);
+            cg_write_u8(cg, var_3);
+            cg_write_opcode(cg, OPCODE_POP);
+
+            cg_write_opcode(cg, OPCODE_PUSHI);
+            cg_write_s64(cg, -1);
+            cg_write_opcode(cg, OPCODE_SETV);
+            cg_write_u8(cg, var_2);
+            cg_write_opcode(cg, OPCODE_POP);
+
+            int start = cg_write_opcode(cg, OPCODE_FOR);
+            cg_write_u8(cg, var_3);
+            cg_write_u8(cg, var_1);
+            cg_write_u8(cg, var_2);
+            int p = cg_write_u32(cg, 0);
+
+            if (var_4 != -1) {
+                cg_write_opcode(cg, OPCODE_MARK);
+                cg_write_u8(cg, var_4);
+            }
+
+            walk_node(cg, node->left, inside_html);
+
+            if (var_4 != -1) {
+                cg_write_opcode(cg, OPCODE_RESET);
+                cg_write_u8(cg, var_4);
+                cg_write_u8(cg, num_live);
+            }
+
+            cg_write_opcode(cg, OPCODE_JUMP);
+            cg_write_u32(cg, start);
+
+            cg_patch_u32(cg, p, cg_current_offset(cg));
+
+            cg_pop_scope(cg);
+        }
+        break;
+
+        case NODE_WHILE:
+        {
+            // start:
+            //   <cond>
+            //   JIFP end
+            //   MARK m
+            //   <body>
+            //   RESET m n
+            //   JUMP start
+            // end:
+            //   ...
+            //
+            // The MARK and RESET instructions free memory
+            // allocated by an iteration that isn't used by
+            // the following ones. They are omitted inside
+            // html elements since everything produced by
+            // the body stays on the stack until the element
+            // is complete.
+
+            int start = cg_current_offset(cg);
+
+            walk_expr_node(cg, node->while_cond, true);
+
+            cg_write_opcode(cg, OPCODE_JIFP);
+            int p = cg_write_u32(cg, 0);
+
+            cg_push_scope(cg, SCOPE_WHILE, node->left);
+
+            int mark = -1;
+            if (!inside_html) {
+                mark = cg_declare_variable(cg, (String) { NULL, 0 }, true);
+                cg_write_opcode(cg, OPCODE_MARK);
+                cg_write_u8(cg, mark);
+            }
+            int num_live = count_function_vars(cg);
+
+            walk_node(cg, node->left, inside_html);
+
+            if (mark != -1) {
+                cg_write_opcode(cg, OPCODE_RESET);
+                cg_write_u8(cg, mark);
+                cg_write_u8(cg, num_live);
+            }
+
+            cg_pop_scope(cg);
+
+            cg_write_opcode(cg, OPCODE_JUMP);
+            cg_write_u32(cg, start);
+
+            cg_patch_u32(cg, p, cg_current_offset(cg));
+        }
+        break;
+
+        case NODE_INCLUDE:
+        walk_node(cg, node->include_root, false);
+        break;
+
+        default:
+        {
+            // Static text that is output is left pending so
+            // that it's merged with the text of the following
+            // statements. The OUTPUT instruction is written
+            // when the text is pushed.
+            bool output = cg_global_scope(cg) && !inside_assignment(cg) && !inside_html;
+            if ((output || inside_html) && cg_write_text(cg, node, output)) {
+                if (output && cg->data_off != -1)
+                    cg->data_output = true;
+                break;
+            }
+
+            walk_expr_node(cg, node, false);
+            if (output)
+                cg_write_opcode(cg, OPCODE_OUTPUT);
+        }
+        break;
+    }
+}
+
+#define WL_MAGIC 0xFEEDBEEF
+
+// Programs start with a header of four u32 words: the
+// magic number and the lengths of the code, data and
+// symbol table sections, which follow in this order.
+#define HEADER_SIZE (SIZEOF(uint32_t) * 4)
+
+static bool program_sections(WL_Program program, String *code, String *data, String *syms)
+{
+    if (program.len < HEADER_SIZE)
+        return false;
+
+    uint32_t magic;
+    uint32_t code_len;
+    uint32_t data_len;
+    uint32_t syms_len;
+
+    memcpy(&magic   , program.ptr +  0, sizeof(uint32_t));
+    memcpy(&code_len, program.ptr +  4, sizeof(uint32_t));
+    memcpy(&data_len, program.ptr +  8, sizeof(uint32_t));
+    memcpy(&syms_len, program.ptr + 12, sizeof(uint32_t));
+
+    if (magic != WL_MAGIC)
+        return false;
+
+    uint32_t avail = program.len - HEADER_SIZE;
+    if (code_len > avail || data_len > avail - code_len || syms_len != avail - code_len - data_len)
+        return false;
+
+    if (syms_len % SYMBOL_ENTRY_SIZE)
+        return false;
+
+    *code = (String) { program.ptr + HEADER_SIZE,                       code_len };
+    *data = (String) { program.ptr + HEADER_SIZE + code_len,            data_len };
+    *syms = (String) { program.ptr + HEADER_SIZE + code_len + data_len, syms_len };
+    return true;
+}
+
+static int codegen(Node *node, Native *natives, int num_natives, int inline_budget, char *dst, int cap, char *errmsg, int errcap)
+{
+    for (int i = 0; i < num_natives; i++)
+        natives[i].off = -1;
+
+    char *hdr;
+    if (cap < HEADER_SIZE)
+        hdr = NULL;
+    else {
+        hdr = dst;
+        dst += HEADER_SIZE;
+        cap -= HEADER_SIZE;
+    }
+
+    Codegen cg = {
+        .code = { dst,         cap/2, 0 },
+        .data = { dst + cap/2, cap/2, 0 },
+        .num_scopes = 0,
+        .err = false,
+        .errmsg = errmsg,
+        .errcap = errcap,
+        .data_off = -1,
+        .prev = { -1, -1 },
+        .natives = natives,
+        .num_natives = num_natives,
+        .inline_budget = inline_budget,
+        .proc = NULL,
+    };
+
+    cg.free_list_calls = cg.calls;
+    for (int i = 0; i < MAX_UNPATCHED_CALLS-1; i++)
+        cg.calls[i].next = &cg.calls[i+1];
+    cg.calls[MAX_UNPATCHED_CALLS-1].next = NULL;
+
+    cg_push_scope(&cg, SCOPE_GLOBAL, node);
+    cg_write_opcode(&cg, OPCODE_VARS);
+    int off = cg_write_u8(&cg, 0);
+    walk_node(&cg, node, false);
+    cg_write_opcode(&cg, OPCODE_EXIT);
+    cg_patch_u8(&cg, off, cg.scopes[0].max_vars);
+    cg_pop_scope(&cg);
+
+    // The symbol table is written at the end of the data
+    // section and then accounted for separately
+    int data_len = cg.data.len;
+    for (int i = 0; i < cg.num_externs; i++) {
+        External *e = &cg.externs[i];
+        uint8_t type = e->call;
+        write_raw_u8 (&cg.data, type);
+        write_raw_u8 (&cg.data, e->args);
+        write_raw_u32(&cg.data, e->off);
+        write_raw_u32(&cg.data, e->name.len);
+    }
+
+    if (cg.err)
+        return -1;
+
+    // The code and data sections are written to the two
+    // halves of the buffer before being joined, so both
+    // must fit independently. If they don't, return the
+    // capacity that would be needed.
+    if (cg.code.len > cg.code.cap || cg.data.len > cg.data.cap)
+        return 2 * MAX(cg.code.len, cg.data.len) + HEADER_SIZE;
+
+    if (hdr) {
+
+        uint32_t magic = WL_MAGIC;
+        uint32_t code_len = cg.code.len;
+        uint32_t syms_len = cg.data.len - data_len;
+        memcpy(hdr +  0, &magic   , sizeof(uint32_t));
+        memcpy(hdr +  4, &code_len, sizeof(uint32_t));
+        memcpy(hdr +  8, &data_len, sizeof(uint32_t));
+        memcpy(hdr + 12, &syms_len, sizeof(uint32_t));
+
+        if (cg.code.len + cg.data.len <= cap)
+            memmove(dst + cg.code.len, dst + cap/2, cg.data.len);
+    }
+
+    return cg.code.len + cg.data.len + HEADER_SIZE;
+}
+
+static int write_instr(Writer *w, char *src, int len, String data)
+{
+    if (len == 0)
+        return -1;
+
+    switch (src[0]) {
+
+        uint8_t b0;
+        uint8_t b1;
+        uint8_t b2;
+        uint32_t w0;
+        uint32_t w1;
+        int64_t i;
+        double  d;
+
+        case OPCODE_NOPE:
+        write_text(w, S("NOPE\n"));
+        return 1;
+
+        case OPCODE_JUMP:
+        if (len < 5) return -1;
+        memcpy(&w0, src + 1, sizeof(uint32_t));
+        write_text(w, S("JUMP "));
+        write_text_s64(w, w0);
+        write_text(w, S("\n"));
+        return 5;
+
+        case OPCODE_JIFP:
+        if (len < 5) return -1;
+        memcpy(&w0, src + 1, sizeof(uint32_t));
+        write_text(w, S("JIFP "));
+        write_text_s64(w, w0);
+        write_text(w, S("\n"));
+        return 5;
+
+        case OPCODE_OUTPUT:
+        write_text(w, S("OUTPUT\n"));
+        return 1;
+
+        case OPCODE_SYSVAR:
+        if (len < 9) return -1;
+        memcpy(&w0, src + 1, sizeof(uint32_t));
+        memcpy(&w1, src + 5, sizeof(uint32_t));
+        write_text(w, S("SYSVAR \""));
+        write_text(w, (String) { data.ptr + w0, w1 });
+        write_text(w, S("\"\n"));
+        return 9;
+
+        case OPCODE_SYSCALL:
+        if (len < 10) return -1;
+        memcpy(&b0, src + 1, sizeof(uint8_t));
+        memcpy(&w0, src + 2, sizeof(uint32_t));
+        memcpy(&w1, src + 6, sizeof(uint32_t));
+        write_text(w, S("SYSCALL "));
+        write_text_s64(w, b0);
+        write_text(w, S(" \""));
+        write_text(w, (String) { data.ptr + w0, w1 });
+        write_text(w, S("\"\n"));
+        return 10;
+
+        case OPCODE_NVAR:
+        if (len < 9) return -1;
+        memcpy(&w0, src + 1, sizeof(uint32_t));
+        memcpy(&w1, src + 5, sizeof(uint32_t));
+        write_text(w, S("NVAR \""));
+        write_text(w, (String) { data.ptr + w0, w1 });
+        write_text(w, S("\"\n"));
+        return 9;
+
+        case OPCODE_NCALL:
+        if (len < 10) return -1;
+        memcpy(&b0, src + 1, sizeof(uint8_t));
+        memcpy(&w0, src + 2, sizeof(uint32_t));
+        memcpy(&w1, src + 6, sizeof(uint32_t));
+        write_text(w, S("NCALL "));
+        write_text_s64(w, b0);
+        write_text(w, S(" \""));
+        write_text(w, (String) { data.ptr + w0, w1 });
+        write_text(w, S("\"\n"));
+        return 10;
+
+        case OPCODE_CALL:
+        case OPCODE_TAIL:
+        if (len < 6) return -1;
+        memcpy(&b0, src + 1, sizeof(uint8_t));
+        memcpy(&w0, src + 2, sizeof(uint32_t));
+        write_text(w, src[0] == OPCODE_CALL ? S("CALL ") : S("TAIL "));
+        write_text_s64(w, b0);
+        write_text(w, S(" "));
+        write_text_s64(w, w0);
+        write_text(w, S("\n"));
+        return 6;
+
+        case OPCODE_RET:
+        write_text(w, S("RET\n"));
+        return 1;
+
+        case OPCODE_GROUP:
+        write_text(w, S("GROUP\n"));
+        return 1;
+
+        case OPCODE_ESCAPE:
+        write_text(w, S("ESCAPE\n"));
+        return 1;
+
+        case OPCODE_PACK:
+        write_text(w, S("PACK\n"));
+        return 1;
+
+        case OPCODE_GPOP:
+        write_text(w, S("GPOP\n"));
+        return 1;
+
+        case OPCODE_FOR:
+        if (len < 8) return -1;
+        memcpy(&b0, src + 1, sizeof(b0));
+        memcpy(&b1, src + 2, sizeof(b1));
+        memcpy(&b2, src + 3, sizeof(b2));
+        memcpy(&w0, src + 4, sizeof(w0));
+        write_text(w, S("FOR "));
+        write_text_s64(w, b0);
+        write_text(w, S(" "));
+        write_text_s64(w, b1);
+        write_text(w, S(" "));
+        write_text_s64(w, b2);
+        write_text(w, S(" "));
+        write_text_s64(w, w0);
+        write_text(w, S("\n"));
+        return 8;
+
+        case OPCODE_EXIT:
+        write_text(w, S("EXIT\n"));
+        return 1;
+
+        case OPCODE_VARS:
+        if (len < 2) return -1;
+        memcpy(&b0, src + 1, sizeof(b0));
+        write_text(w, S("VARS "));
+        write_text_s64(w, b0);
+        write_text(w, S("\n"));
+        return 2;
+
+        case OPCODE_POP:
+        write_text(w, S("POP\n"));
+        return 1;
+
+        case OPCODE_SETV:
+        if (len < 2) return -1;
+        memcpy(&b0, src + 1, sizeof(uint8_t));
+        write_text(w, S("SETV "));
+        write_text_s64(w, b0);
+        write_text(w, S("\n"));
+        return 2;
+
+        case OPCODE_PUSHV:
+        if (len < 2) return -1;
+        memcpy(&b0, src + 1, sizeof(uint8_t));
+        write_text(w, S("PUSHV "));
+        write_text_s64(w, b0);
+        write_text(w, S("\n"));
+        return 2;
+
+        case OPCODE_PUSHI:
+        if (len < 9) return -1;
+        memcpy(&i, src + 1, sizeof(int64_t));
+        write_text(w, S("PUSHI "));
+        write_text_s64(w, i);
+        write_text(w, S("\n"));
+        return 9;
+
+        case OPCODE_PUSHF:
+        if (len < 9) return -1;
+        memcpy(&d, src + 1, sizeof(double));
+        write_text(w, S("PUSHF "));
+        write_text_f64(w, d);
+        write_text(w, S("\n"));
+        return 9;
+
+        case OPCODE_PUSHS:
+        case OPCODE_PUSHH:
+        if (len < 9) return -1;
+        memcpy(&w0, src + 1, sizeof(uint32_t));
+        memcpy(&w1, src + 5, sizeof(uint32_t));
+        write_text(w, src[0] == OPCODE_PUSHH ? S("PUSHH \"") : S("PUSHS \""));
+        write_text(w, (String) { data.ptr + w0, w1 });
+        write_text(w, S("\"\n"));
+        return 9;
+
+        case OPCODE_PUSHA:
+        if (len < 5) return -1;
+        memcpy(&w0, src + 1, sizeof(w0));
+        write_text(w, S("PUSHA "));
+        write_text_s64(w, w0);
+        write_text(w, S("\n"));
+        return 5;
+
+        case OPCODE_PUSHK:
+        {
+            if (len < 9) return -1;
+            memcpy(&w0, src + 1, sizeof(uint32_t));
+            memcpy(&w1, src + 5, sizeof(uint32_t));
+            if (w0 > (uint32_t) data.len || w1 > (uint32_t) data.len - w0 || w1 < 5)
+                return -1;
+            uint32_t count;
+            memcpy(&count, data.ptr + w0 + 1, sizeof(uint32_t));
+            write_text(w, data.ptr[w0] ? S("PUSHK map ") : S("PUSHK array "));
+            write_text_s64(w, data.ptr[w0] ? count / 2 : count);
+            write_text(w, S("\n"));
+        }
+        return 9;
+
+        case OPCODE_PUSHM:
+        if (len < 5) return -1;
+        memcpy(&w0, src + 1, sizeof(w0));
+        write_text(w, S("PUSHM "));
+        write_text_s64(w, w0);
+        write_text(w, S("\n"));
+        return 5;
+
+        case OPCODE_PUSHN:
+        write_text(w, S("PUSHN\n"));
+        return 1;
+
+        case OPCODE_PUSHT:
+        write_text(w, S("PUSHT\n"));
+        return 1;
+
+        case OPCODE_PUSHFL:
+        write_text(w, S("PUSHFL\n"));
+        return 1;
+
+        case OPCODE_LEN:
+        write_text(w, S("LEN\n"));
+        return 1;
+
+        case OPCODE_NEG:
+        write_text(w, S("NEG\n"));
+        return 1;
+
+        case OPCODE_EQL:
+        write_text(w, S("EQL\n"));
+        return 1;
+
+        case OPCODE_NQL:
+        write_text(w, S("NQL\n"));
+        return 1;
+
+        case OPCODE_LSS:
+        write_text(w, S("LSS\n"));
+        return 1;
+
+        case OPCODE_GRT:
+        write_text(w, S("GRT\n"));
+        return 1;
+
+        case OPCODE_ADD:
+        write_text(w, S("ADD\n"));
+        return 1;
+
+        case OPCODE_SUB:
+        write_text(w, S("SUB\n"));
+        return 1;
+
+        case OPCODE_MUL:
+        write_text(w, S("MUL\n"));
+        return 1;
+
+        case OPCODE_DIV:
+        write_text(w, S("DIV\n"));
+        return 1;
+
+        case OPCODE_MOD:
+        write_text(w, S("MOD\n"));
+        return 1;
+
+        case OPCODE_APPEND:
+        write_text(w, S("APPEND\n"));
+        return 1;
+
+        case OPCODE_INSERT1:
+        write_text(w, S("INSERT1\n"));
+        return 1;
+
+        case OPCODE_INSERT2:
+        write_text(w, S("INSERT2\n"));
+        return 1;
+
+        case OPCODE_SELECT:
+        write_text(w, S("SELECT\n"));
+        return 1;
+
+        case OPCODE_MARK:
+        if (len < 2) return -1;
+        memcpy(&b0, src + 1, sizeof(uint8_t));
+        write_text(w, S("MARK "));
+        write_text_s64(w, b0);
+        write_text(w, S("\n"));
+        return 2;
+
+        case OPCODE_RESET:
+        if (len < 3) return -1;
+        memcpy(&b0, src + 1, sizeof(uint8_t));
+        memcpy(&b1, src + 2, sizeof(uint8_t));
+        write_text(w, S("RESET "));
+        write_text_s64(w, b0);
+        write_text(w, S(" "));
+        write_text_s64(w, b1);
+        write_text(w, S("\n"));
+        return 3;
+
+        case OPCODE_SETVP:
+        if (len < 2) return -1;
+        memcpy(&b0, src + 1, sizeof(uint8_t));
+        write_text(w, S("SETVP "));
+        write_text_s64(w, b0);
+        write_text(w, S("\n"));
+        return 2;
+
+        case OPCODE_SETVI:
+        if (len < 10) return -1;
+        memcpy(&b0, src + 1, sizeof(uint8_t));
+        memcpy(&i,  src + 2, sizeof(int64_t));
+        write_text(w, S("SETVI "));
+        write_text_s64(w, b0);
+        write_text(w, S(" "));
+        write_text_s64(w, i);
+        write_text(w, S("\n"));
+        return 10;
+
+        case OPCODE_ADDVV:
+        if (len < 3) return -1;
+        memcpy(&b0, src + 1, sizeof(uint8_t));
+        memcpy(&b1, src + 2, sizeof(uint8_t));
+        write_text(w, S("ADDVV "));
+        write_text_s64(w, b0);
+        write_text(w, S(" "));
+        write_text_s64(w, b1);
+        write_text(w, S("\n"));
+        return 3;
+
+        case OPCODE_SELS:
+        if (len < 9) return -1;
+        memcpy(&w0, src + 1, sizeof(uint32_t));
+        memcpy(&w1, src + 5, sizeof(uint32_t));
+        write_text(w, S("SELS \""));
+        write_text(w, (String) { data.ptr + w0, w1 });
+        write_text(w, S("\"\n"));
+        return 9;
+
+        default:
+        write_text(w, S("byte "));
+        write_text_s64(w, src[0]);
+        return 1;
+    }
+
+    return -1;
+}
+
+static int write_program(WL_Program program, char *dst, int cap)
+{
+    String code;
+    String data;
+    String syms;
+    if (!program_sections(program, &code, &data, &syms))
+        return -1;
+
+    Writer w = { dst, cap, 0 };
+
+    int cur = 0;
+    while (cur < code.len) {
+        write_text_s64(&w, cur);
+        write_text(&w, S(": "));
+        int ret = write_instr(&w, code.ptr + cur, code.len - cur, data);
+        if (ret < 0) return -1;
+        cur += ret;
+    }
+
+    return w.len;
+}
+
+int wl_program_symbols(WL_Program program, WL_Symbol *dst, int cap)
+{
+    String code;
+    String data;
+    String syms;
+    if (!program_sections(program, &code, &data, &syms))
+        return -1;
+
+    int num = syms.len / SYMBOL_ENTRY_SIZE;
+    for (int i = 0; i < num && i < cap; i++) {
+
+        char *src = syms.ptr + i * SYMBOL_ENTRY_SIZE;
+
+        uint8_t  type;
+        uint8_t  args;
+        uint32_t off;
+        uint32_t len;
+        memcpy(&type, src + 0, sizeof(uint8_t));
+        memcpy(&args, src + 1, sizeof(uint8_t));
+        memcpy(&off,  src + 2, sizeof(uint32_t));
+        memcpy(&len,  src + 6, sizeof(uint32_t));
+
+        if (off > (uint32_t) data.len || len > (uint32_t) data.len - off)
+            return -1;
+
+        dst[i] = (WL_Symbol) {
+            .type = type ? WL_SYMBOL_CALL : WL_SYMBOL_VAR,
+            .name = { data.ptr + off, len },
+            .args = args,
+        };
+    }
+
+    return num;
+}
+
+void wl_dump_program(WL_Program program)
+{
+    char buf[1<<10];
+    int len = write_program(program, buf, SIZEOF(buf));
+
+    if (len < 0) {
+        printf("Invalid program\n");
+        return;
+    }
+
+    if (len > SIZEOF(buf)) {
+        char *p = malloc(len+1);
+        if (p == NULL) {
+            printf("Out of memory\n");
+            return;
+        }
+        write_program(program, p, len);
+        p[len] = '\0';
+        fwrite(p, 1, len, stdout);
+    } else {
+        fwrite(buf, 1, len, stdout);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////
+// COMPILER
+/////////////////////////////////////////////////////////////////////////
+
+#define FILE_LIMIT 128
+
+typedef struct {
+    String file;
+    Node*  root;
+    Node*  includes;
+} CompiledFile;
+
+struct WL_Compiler {
+
+    WL_Arena*    arena;
+    CompiledFile files[FILE_LIMIT];
+    int          num_files;
+    String       waiting_file;
+
+    Native natives[MAX_NATIVES];
+    int    num_natives;
+
+    int inline_budget;
+
+    bool err;
+    char msg[1<<8];
+};
+
+WL_Compiler *wl_compiler_init(WL_Arena *arena)
+{
+    WL_Compiler *compiler = alloc(arena, SIZEOF(WL_Compiler), _Alignof(WL_Compiler));
+    if (compiler == NULL)
+        return NULL;
+    compiler->arena = arena;
+    compiler->num_files = 0;
+    compiler->waiting_file = (String) { NULL, 0 };
+    compiler->num_natives = 0;
+    compiler->inline_budget = DEFAULT_INLINE_BUDGET;
+    compiler->err = false;
+    return compiler;
+}
+
+void wl_compiler_set_inline_budget(WL_Compiler *compiler, int budget)
+{
+    compiler->inline_budget = budget;
+}
+
+int wl_compiler_bind_native(WL_Compiler *compiler, WL_String name)
+{
+    String s = { name.ptr, name.len };
+    for (int i = 0; i < compiler->num_natives; i++)
+        if (streq(compiler->natives[i].name, s))
+            return 0;
+
+    if (compiler->num_natives == MAX_NATIVES)
+        return -1;
+
+    compiler->natives[compiler->num_natives++] = (Native) { s, -1 };
+    return 0;
+}
+
+WL_AddResult wl_compiler_add(WL_Compiler *compiler, WL_String path, WL_String content)
+{
+    if (compiler->err)
+        return (WL_AddResult) { .type=WL_ADD_ERROR };
+
+    ParseResult pres = parse((String) { content.ptr, content.len }, compiler->arena, compiler->msg, SIZEOF(compiler->msg));
+    if (pres.node == NULL) {
+        compiler->err = true;
+        return (WL_AddResult) { .type=WL_ADD_ERROR };
+    }
+
+    // Make include paths relative to the parent file
+    if (path.len > 0) {
+
+        String parent = { path.ptr, path.len };
+
+        char sep = '/';
+        while (parent.len > 0 && parent.ptr[parent.len-1] != sep)
+            parent.len--;
+
+        if (parent.len > 0) {
+            Node *include = pres.includes;
+            while (include) {
+
+                char *dst = alloc(compiler->arena, parent.len + include->include_path.len + 1, 1);
+                if (dst == NULL) {
+                    // TODO: report error
+                    return (WL_AddResult) { .type=WL_ADD_ERROR };
+                }
+
+                memcpy(dst,
+                    parent.ptr,
+                    parent.len);
+                memcpy(dst + parent.len,
+                    include->include_path.ptr,
+                    include->include_path.len);
+
+                include->include_path = (String) { dst, parent.len + include->include_path.len };
+
+                include = include->include_next;
+            }
+        }
+    }
+
+    CompiledFile compiled_file = {
+        .file = compiler->waiting_file,
+        .root = pres.node,
+        .includes = pres.includes,
+    };
+    compiler->files[compiler->num_files++] = compiled_file;
+    compiler->waiting_file = (String) { NULL, 0 };
+
+    for (int i = 0; i < compiler->num_files; i++) {
+
+        Node *include = compiler->files[i].includes;
+        while (include) {
+
+            ASSERT(include->type == NODE_INCLUDE);
+
+            if (include->include_root == NULL) {
+                for (int j = 0; j < compiler->num_files; j++) {
+                    if (streq(include->include_path, compiler->files[j].file)) {
+                        include->include_root = compiler->files[j].root;
+                        break;
+                    }
+                }
+            }
+
+            if (include->include_root == NULL) {
+
+                if (compiler->num_files == FILE_LIMIT) {
+                    // TODO: report error
+                    return (WL_AddResult) { .type=WL_ADD_ERROR };
+                }
+
+                compiler->waiting_file = include->include_path;
+                return (WL_AddResult) { .type=WL_ADD_AGAIN, .path={ include->include_path.ptr, include->include_path.len } };
+            }
+
+            include = include->include_next;
+        }
+    }
+
+    return (WL_AddResult) { .type=WL_ADD_LINK };
+}
+
+int wl_compiler_link(WL_Compiler *compiler, WL_Program *program)
+{
+    if (compiler->err) return -1;
+
+    if (compiler->num_files == 0 || compiler->waiting_file.len > 0) {
+        int len = snprintf(compiler->msg, SIZEOF(compiler->msg), "Missing files in compilation unit");
+        if (len > SIZEOF(compiler->msg))
+            len = SIZEOF(compiler->msg)-1;
+        compiler->msg[len] = '\0';
+        compiler->err = true;
+        return -1;
+    }
+
+    WL_Arena *arena = compiler->arena;
+    fold_node(compiler->files[0].root, arena);
+
+    char *dst = arena->ptr + arena->cur;
+    int   cap = arena->len - arena->cur;
+
+    int len = codegen(compiler->files[0].root, compiler->natives, compiler->num_natives, compiler->inline_budget, dst, cap, compiler->msg, SIZEOF(compiler->msg));
+
+    // If the program didn't fit in the free space of the
+    // arena's block, try again in a block large enough
+    if (len > cap && arena_grow(arena, len)) {
+        dst = arena->ptr + arena->cur;
+        cap = arena->len - arena->cur;
+        len = codegen(compiler->files[0].root, compiler->natives, compiler->num_natives, compiler->inline_budget, dst, cap, compiler->msg, SIZEOF(compiler->msg));
+    }
+
+    if (len < 0) {
+        compiler->err = true;
+        return -1;
+    }
+    if (len > cap) {
+        int len = snprintf(compiler->msg, SIZEOF(compiler->msg), "Out of memory");
+        if (len > SIZEOF(compiler->msg))
+            len = SIZEOF(compiler->msg)-1;
+        compiler->msg[len] = '\0';
+        compiler->err = true;
+        return -1;
+    }
+
+    *program = (WL_Program) { dst, len };
+
+    arena->cur += len;
+    return 0;
+}
+
+WL_String wl_compiler_error(WL_Compiler *compiler)
+{
+    return compiler->err
+        ? (WL_String) { compiler->msg, strlen(compiler->msg) }
+        : (WL_String) { NULL, 0 };
+}
+
+int wl_dump_ast(WL_Compiler *compiler, char *dst, int cap)
+{
+    Writer w = { dst, cap, 0 };
+    for (int i = 0; i < compiler->num_files; i++) {
+        write_text(&w, S("(file \""));
+        write_text(&w, compiler->files[i].file);
+        write_text(&w, S("\" "));
+        write_node(&w, compiler->files[i].root);
+        write_text(&w, S(")"));
+    }
+    return w.len;
+}
+
+/////////////////////////////////////////////////////////////////////////
+// OBJECT MODEL
+/////////////////////////////////////////////////////////////////////////
+
+typedef enum {
+    TYPE_NONE,
+    TYPE_BOOL,
+    TYPE_INT,
+    TYPE_FLOAT,
+    TYPE_STRING,
+    TYPE_ARRAY,
+    TYPE_MAP,
+    TYPE_ERROR,
+} Type;
+
+// Values are NaN-boxed. Any 64-bit pattern that doesn't
+// have the 13 upper bits set is a double. The remaining
+// patterns (negative quiet NaNs) are boxed values with a
+// 3-bit tag in bits 48 to 50 and a 48-bit payload:
+//
+//   1111111111111 TTT PPPP....PPPP
+//
+// Doubles that are NaN are stored as the canonical positive
+// quiet NaN so they are never confused with boxed values.
+//
+// Integers that fit in 48 bits are stored in the payload,
+// while larger ones and strings, arrays and maps are stored
+// as pointers to heap objects. Since heap objects are 8-byte
+// aligned, the lower 3 bits of pointers are always zero,
+// which leaves room for the flags of strings and arrays.
+//
+// Strings and arrays with FLAG_ESCAPE are HTML escaped
+// when they are written to the output, which lets the
+// escape operator mark values instead of copying them.
+// The elements of a marked array are marked when they
+// are read. Strings with FLAG_TRUSTED come from HTML
+// literals and are never escaped.
+
+#define TAG_ERROR  0
+#define TAG_INT    1
+#define TAG_BOOL   2
+#define TAG_NONE   3
+#define TAG_STRING 4
+#define TAG_ARRAY  5
+#define TAG_MAP    6
+#define TAG_BIGINT 7
+
+#define BOX_MASK     ((Value) 0xFFF8000000000000)
+#define PAYLOAD_MASK ((Value) 0x0000FFFFFFFFFFFF)
+#define PTR_MASK     ((Value) 0x0000FFFFFFFFFFF8)
+#define CANONICAL_NAN ((Value) 0x7FF8000000000000)
+
+#define FLAG_ESCAPE  ((Value) 1)
+#define FLAG_TRUSTED ((Value) 2)
+
+#define BOX(tag, payload) (BOX_MASK | ((Value) (tag) << 48) | (Value) (payload))
+
+#define VALUE_NONE  BOX(TAG_NONE,  0)
+#define VALUE_TRUE  BOX(TAG_BOOL,  1)
+#define VALUE_FALSE BOX(TAG_BOOL,  0)
+#define VALUE_ERROR BOX(TAG_ERROR, 0)
+
+typedef uint64_t Value;
+
+// Maps with more than MAP_INDEX_THRESHOLD entries get a
+// hash index to speed up lookups. It's an open addressing
+// table of positions of keys in the map's storage, with
+// linear probing. Entries are never removed from maps,
+// so no tombstones are necessary. Empty slots have a
+// hash of 0.
+#define MAP_INDEX_THRESHOLD 8
+
+typedef struct {
+    uint32_t hash;
+    uint32_t pos;
+} MapIndexSlot;
+
+typedef struct {
+    int count;
+    int capacity; // Power of 2
+    MapIndexSlot slots[];
+} MapIndex;
+
+// Elements of arrays and key-value pairs of maps are
+// stored contiguously in "vals". When it fills up, the
+// storage is grown geometrically, moving it if it isn't
+// at the end of the arena.
+//
+// The storage of an aggregate is "shared" when it belongs
+// to a constant literal of the prepared program (see PUSHK),
+// in which case it's copied before the aggregate changes.
+typedef struct {
+    Type      type;
+    int       count;
+    int       capacity;
+    Value    *vals;
+    MapIndex *index;
+    bool      shared;
+} AggregateValue;
+
+typedef struct {
+    Type    type;
+    int64_t raw;
+} IntValue;
+
+// The contents of a string are pointed by "ptr", which
+// either refers to the "data" field that follows it or
+// to memory owned by someone else (the program's data
+// section or a host buffer) for borrowed strings.
+typedef struct {
+    Type     type;
+    int      len;
+    uint32_t hash; // Computed on first use, 0 if not yet
+    char    *ptr;
+    char     data[];
+} StringValue;
+
+static int value_convert_to_str(Value v, char *dst, int cap);
+
+static Type value_type(Value v)
+{
+    if ((v & BOX_MASK) != BOX_MASK)
+        return TYPE_FLOAT;
+
+    switch ((v >> 48) & 7) {
+        case TAG_ERROR : return TYPE_ERROR;
+        case TAG_INT   : return TYPE_INT;
+        case TAG_BOOL  : return TYPE_BOOL;
+        case TAG_NONE  : return TYPE_NONE;
+        case TAG_STRING: return TYPE_STRING;
+        case TAG_ARRAY : return TYPE_ARRAY;
+        case TAG_MAP   : return TYPE_MAP;
+        case TAG_BIGINT: return TYPE_INT;
+    }
+    return TYPE_ERROR;
+}
+
+static Value value_from_ptr(int tag, void *p)
+{
+    ASSERT(((uintptr_t) p & ~(uintptr_t) PTR_MASK) == 0);
+    return BOX(tag, (uintptr_t) p);
+}
+
+static bool value_escaped(Value v)
+{
+    Type t = value_type(v);
+    return (t == TYPE_STRING || t == TYPE_ARRAY) && (v & FLAG_ESCAPE);
+}
+
+static Value value_escape(Value v)
+{
+    Type t = value_type(v);
+    if ((t == TYPE_STRING || t == TYPE_ARRAY) && !(v & FLAG_TRUSTED))
+        return v | FLAG_ESCAPE;
+    return v;
+}
+
+// Returns the element "v" read from "set"
+static Value value_element(Value set, Value v)
+{
+    if (value_escaped(set))
+        return value_escape(v);
+    return v;
+}
+
+static int64_t value_to_s64(Value v)
+{
+    ASSERT(value_type(v) == TYPE_INT);
+
+    if (((v >> 48) & 7) == TAG_INT)
+        return (int64_t) (v << 16) >> 16;
+
+    IntValue *p = (IntValue*) (v & PTR_MASK);
+    return p->raw;
+}
+
+static double value_to_f64(Value v)
+{
+    ASSERT(value_type(v) == TYPE_FLOAT);
+
+    double x;
+    memcpy(&x, &v, sizeof(x));
+    return x;
+}
+
+static String value_to_str(Value v)
+{
+    ASSERT(value_type(v) == TYPE_STRING);
+
+    StringValue *p = (StringValue*) (v & PTR_MASK);
+    return (String) { p->ptr, p->len };
+}
+
+static Value value_from_s64(int64_t x, WL_Arena *arena, Error *err)
+{
+    if (x >= -((int64_t) 1 << 47) && x < ((int64_t) 1 << 47))
+        return BOX(TAG_INT, (Value) x & PAYLOAD_MASK);
+
+    IntValue *p = alloc(arena, SIZEOF(IntValue), 8);
+    if (p == NULL) {
+        REPORT(err, "Out of memory");
+        return VALUE_ERROR;
+    }
+
+    p->type = TYPE_INT;
+    p->raw  = x;
+
+    return value_from_ptr(TAG_BIGINT, p);
+}
+
+static Value value_from_f64(double x, WL_Arena *arena, Error *err)
+{
+    (void) arena;
+    (void) err;
+
+    if (x != x)
+        return CANONICAL_NAN;
+
+    Value v;
+    memcpy(&v, &x, sizeof(v));
+    return v;
+}
+
+static Value value_from_str(String x, WL_Arena *arena, Error *err)
+{
+    StringValue *v = alloc(arena, SIZEOF(StringValue) + x.len, 8);
+    if (v == NULL) {
+        REPORT(err, "Out of memory");
+        return VALUE_ERROR;
+    }
+
+    v->type = TYPE_STRING;
+    v->len = x.len;
+    v->hash = 0;
+    v->ptr = v->data;
+    memcpy(v->data, x.ptr, x.len);
+
+    return value_from_ptr(TAG_STRING, v);
+}
+
+// Creates a string value that refers to the memory of
+// the string instead of copying it. The memory must not
+// change for as long as the value is in use.
+static Value value_from_str_borrowed(String x, WL_Arena *arena, Error *err)
+{
+    StringValue *v = alloc(arena, SIZEOF(StringValue), 8);
+    if (v == NULL) {
+        REPORT(err, "Out of memory");
+        return VALUE_ERROR;
+    }
+
+    v->type = TYPE_STRING;
+    v->len = x.len;
+    v->hash = 0;
+    v->ptr = x.ptr;
+
+    return value_from_ptr(TAG_STRING, v);
+}
+
+static Value aggregate_empty(bool map, uint32_t cap, WL_Arena *arena, Error *err)
+{
+    if (cap > (INT_MAX - SIZEOF(AggregateValue)) / SIZEOF(Value)) {
+        REPORT(err, "Out of memory");
+        return VALUE_ERROR;
+    }
+
+    AggregateValue *v = alloc(arena, SIZEOF(AggregateValue) + cap * SIZEOF(Value), MAX(_Alignof(AggregateValue), 8));
+    if (v == NULL) {
+        REPORT(err, "Out of memory");
+        return VALUE_ERROR;
+    }
+
+    v->type = map ? TYPE_MAP : TYPE_ARRAY;
+    v->count = 0;
+    v->capacity = cap;
+    v->vals = (Value*) (v + 1);
+    v->index = NULL;
+    v->shared = false;
+
+    return value_from_ptr(map ? TAG_MAP : TAG_ARRAY, v);
+}
+
+static int64_t aggregate_length(AggregateValue *agg)
+{
+    return agg->count;
+}
+
+static Value *aggregate_select_by_raw_index(AggregateValue *agg, int64_t idx)
+{
+    ASSERT(agg->type == TYPE_ARRAY || agg->type == TYPE_MAP);
+
+    if (idx < 0 || idx >= agg->count)
+        return NULL;
+
+    return &agg->vals[idx];
+}
+
+static bool value_eql(Value a, Value b);
+
+static uint32_t hash_str(String str)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < str.len; i++) {
+        h ^= (uint8_t) str.ptr[i];
+        h *= 16777619u;
+    }
+    return h ? h : 1;
+}
+
+static uint32_t hash_u64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDull;
+    x ^= x >> 33;
+    uint32_t h = (uint32_t) x;
+    return h ? h : 1;
+}
+
+// Hash of a map key. Values that are equal according
+// to value_eql must have the same hash. The hash is
+// never 0.
+static uint32_t value_hash(Value v)
+{
+    switch (value_type(v)) {
+
+        case TYPE_STRING:
+        {
+            StringValue *p = (StringValue*) (v & PTR_MASK);
+            if (p->hash == 0)
+                p->hash = hash_str((String) { p->ptr, p->len });
+            return p->hash;
+        }
+
+        case TYPE_INT:
+        return hash_u64((uint64_t) value_to_s64(v));
+
+        case TYPE_FLOAT:
+        {
+            double f = value_to_f64(v);
+            if (f == 0) f = 0; // Same hash for -0.0 and 0.0
+            uint64_t bits;
+            memcpy(&bits, &f, sizeof(bits));
+            return hash_u64(bits);
+        }
+
+        case TYPE_BOOL:
+        case TYPE_NONE:
+        case TYPE_ERROR:
+        return hash_u64(v);
+
+        case TYPE_ARRAY:
+        case TYPE_MAP:
+        break;
+    }
+
+    return 1;
+}
+
+static Value *map_index_find(AggregateValue *agg, Value key, uint32_t hash)
+{
+    MapIndex *index = agg->index;
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        MapIndexSlot *slot = &index->slots[i];
+        if (slot->hash == 0)
+            return NULL;
+        if (slot->hash == hash && value_eql(agg->vals[slot->pos], key))
+            return &agg->vals[slot->pos + 1];
+    }
+}
+
+static Value *map_index_find_str(AggregateValue *agg, String key)
+{
+    MapIndex *index = agg->index;
+    uint32_t hash = hash_str(key);
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        MapIndexSlot *slot = &index->slots[i];
+        if (slot->hash == 0)
+            return NULL;
+        if (slot->hash == hash) {
+            Value k = agg->vals[slot->pos];
+            if (value_type(k) == TYPE_STRING && streq(value_to_str(k), key))
+                return &agg->vals[slot->pos + 1];
+        }
+    }
+}
+
+static void map_index_insert(MapIndex *index, Value key, uint32_t pos)
+{
+    uint32_t hash = value_hash(key);
+    uint32_t mask = index->capacity - 1;
+    uint32_t i = hash & mask;
+    while (index->slots[i].hash)
+        i = (i + 1) & mask;
+    index->slots[i] = (MapIndexSlot) { hash, pos };
+    index->count++;
+}
+
+// Adds the key at the given position of the map's storage
+// to its index, creating or growing the index when necessary.
+static bool aggregate_index_add(AggregateValue *agg, uint32_t pos, WL_Arena *arena)
+{
+    ASSERT(agg->type == TYPE_MAP);
+
+    MapIndex *index = agg->index;
+
+    if (index && 2 * (index->count + 1) <= index->capacity) {
+        map_index_insert(index, agg->vals[pos], pos);
+        return true;
+    }
+
+    int64_t count = agg->count / 2;
+    if (index == NULL && count <= MAP_INDEX_THRESHOLD)
+        return true;
+
+    int cap = index ? 2 * index->capacity : 4 * MAP_INDEX_THRESHOLD;
+    while (cap < 2 * count)
+        cap *= 2;
+
+    index = alloc(arena, SIZEOF(MapIndex) + cap * SIZEOF(MapIndexSlot), ALIGNOF(MapIndex));
+    if (index == NULL)
+        return false;
+    index->count = 0;
+    index->capacity = cap;
+    memset(index->slots, 0, cap * SIZEOF(MapIndexSlot));
+
+    // The new key was already appended to the map, so
+    // this also adds it to the index
+    for (int i = 0; i < agg->count; i += 2)
+        map_index_insert(index, agg->vals[i], i);
+
+    agg->index = index;
+    return true;
+}
+
+static Value *aggregate_select(AggregateValue *agg, Value key)
+{
+    if (agg->type == TYPE_MAP) {
+
+        if (agg->index)
+            return map_index_find(agg, key, value_hash(key));
+
+        for (int i = 0; i < agg->count; i += 2)
+            if (value_eql(agg->vals[i], key))
+                return &agg->vals[i+1];
+
+        return NULL;
+
+    } else {
+
+        ASSERT(agg->type == TYPE_ARRAY);
+
+        if (value_type(key) != TYPE_INT)
+            return NULL;
+        int64_t idx = value_to_s64(key);
+
+        return aggregate_select_by_raw_index(agg, idx);
+    }
+}
+
+static Value *aggregate_select_by_str(AggregateValue *agg, String key)
+{
+    ASSERT(agg->type == TYPE_MAP);
+
+    if (agg->index)
+        return map_index_find_str(agg, key);
+
+    for (int i = 0; i < agg->count; i += 2)
+        if (value_type(agg->vals[i]) == TYPE_STRING && streq(value_to_str(agg->vals[i]), key))
+            return &agg->vals[i+1];
+
+    return NULL;
+}
+
+// Gives the aggregate its own copy of shared storage
+// before it's changed. Returns false if out of memory.
+static bool aggregate_own(AggregateValue *agg, WL_Arena *arena)
+{
+    if (!agg->shared)
+        return true;
+
+    if (agg->count > INT_MAX / 2 / SIZEOF(Value))
+        return false;
+
+    // Leave room to grow as the aggregate is likely
+    // to be changed again
+    int cap = MAX(2 * agg->count, 8);
+    Value *vals = alloc(arena, cap * SIZEOF(Value), ALIGNOF(Value));
+    if (vals == NULL)
+        return false;
+    memcpy(vals, agg->vals, agg->count * SIZEOF(Value));
+
+    MapIndex *index = agg->index;
+    if (index) {
+        int size = SIZEOF(MapIndex) + index->capacity * SIZEOF(MapIndexSlot);
+        index = alloc(arena, size, ALIGNOF(MapIndex));
+        if (index == NULL)
+            return false;
+        memcpy(index, agg->index, size);
+    }
+
+    agg->vals = vals;
+    agg->capacity = cap;
+    agg->index = index;
+    agg->shared = false;
+    return true;
+}
+
+// Appends one or two values (when v2 isn't VALUE_ERROR)
+// to the aggregate. Returns false if out of memory.
+static bool aggregate_append(AggregateValue *agg, Value v1, Value v2, WL_Arena *arena)
+{
+    int num = (v2 == VALUE_ERROR) ? 1 : 2;
+
+    if (agg->capacity - agg->count < num) {
+
+        if (agg->capacity > INT_MAX / 2 / SIZEOF(Value))
+            return false;
+
+        int cap = MAX(2 * agg->capacity, 8);
+
+        // If the storage is the last allocation of the
+        // arena, it can be extended in place
+        Value *vals;
+        char *end = (char*) (agg->vals + agg->capacity);
+        if (end == arena->ptr + arena->cur)
+            vals = grow_alloc(arena, agg->vals, agg->count * SIZEOF(Value), cap * SIZEOF(Value));
+        else {
+            vals = alloc(arena, cap * SIZEOF(Value), ALIGNOF(Value));
+            if (vals && agg->count > 0)
+                memcpy(vals, agg->vals, agg->count * SIZEOF(Value));
+        }
+        if (vals == NULL)
+            return false;
+        agg->vals = vals;
+        agg->capacity = cap;
+    }
+
+    agg->vals[agg->count++] = v1;
+    if (v2 != VALUE_ERROR)
+        agg->vals[agg->count++] = v2;
+    return true;
+}
+
+static Value value_empty_map(uint32_t cap, WL_Arena *arena, Error *err)
+{
+    if (cap > UINT32_MAX / 2) {
+        REPORT(err, "Out of memory");
+        return VALUE_ERROR;
+    }
+    return aggregate_empty(true, 2 * cap, arena, err);
+}
+
+static Value value_empty_array(uint32_t cap, WL_Arena *arena, Error *err)
+{
+    return aggregate_empty(false, cap, arena, err);
+}
+
+// Returns a new aggregate with the same contents as the
+// constant "set" whose storage is only copied once it's
+// changed.
+static Value value_share(Value set, WL_Arena *arena, Error *err)
+{
+    AggregateValue *src = (void*) (set & PTR_MASK);
+    ASSERT(src->shared);
+
+    AggregateValue *dst = alloc(arena, SIZEOF(AggregateValue), MAX(_Alignof(AggregateValue), 8));
+    if (dst == NULL) {
+        REPORT(err, "Out of memory");
+        return VALUE_ERROR;
+    }
+    *dst = *src;
+
+    return value_from_ptr(src->type == TYPE_MAP ? TAG_MAP : TAG_ARRAY, dst);
+}
+
+static int64_t value_length(Value set)
+{
+    ASSERT(value_type(set) == TYPE_MAP || value_type(set) == TYPE_ARRAY);
+    AggregateValue *agg = (void*) (set & PTR_MASK);
+    int64_t len = aggregate_length(agg);
+    if (agg->type == TYPE_MAP)
+        len /= 2;
+    return len;
+}
+
+static bool value_insert(Value set, Value key, Value val, WL_Arena *arena, Error *err)
+{
+    Type t = value_type(set);
+    if (t != TYPE_MAP && t != TYPE_ARRAY) {
+        REPORT(err, "Invalid insertion on non-map and non-array value");
+        return false;
+    }
+    AggregateValue *agg = (void*) (set & PTR_MASK);
+
+    if (!aggregate_own(agg, arena)) {
+        REPORT(err, "Out of memory");
+        return false;
+    }
+
+    Value *dst = aggregate_select(agg, key);
+    if (dst != NULL) {
+        *dst = val;
+        return true;
+    }
+
+    if (agg->type == TYPE_ARRAY && value_type(key) != TYPE_INT) {
+        REPORT(err, "Invalid index used in array access");
+        return false;
+    }
+
+    if (!aggregate_append(agg, key, val, arena)) {
+        REPORT(err, "Out of memory");
+        return false;
+    }
+
+    if (agg->type == TYPE_MAP && !aggregate_index_add(agg, agg->count-2, arena)) {
+        REPORT(err, "Out of memory");
+        return false;
+    }
+
+    return true;
+}
+
+static Value value_select(Value set, Value key, Error *err)
+{
+    Type t = value_type(set);
+    if (t != TYPE_MAP && t != TYPE_ARRAY) {
+        REPORT(err, "Invalid selection from non-map and non-array value");
+        return VALUE_ERROR;
+    }
+    AggregateValue *agg = (void*) (set & PTR_MASK);
+
+    Value *dst = aggregate_select(agg, key);
+    if (dst) return value_element(set, *dst);
+
+    if (agg->type == TYPE_ARRAY && value_type(key) != TYPE_INT) {
+        REPORT(err, "Invalid index used in array access");
+        return VALUE_ERROR;
+    }
+
+    char key_buf[1<<8];
+    int key_len = value_convert_to_str(key, key_buf, SIZEOF(key_buf));
+    if (key_len > SIZEOF(key_buf)-1)
+        key_len = SIZEOF(key_buf)-1;
+    key_buf[key_len] = '\0';
+
+    char set_buf[1<<8];
+    int set_len = value_convert_to_str(set, set_buf, SIZEOF(set_buf));
+    if (set_len > SIZEOF(set_buf)-1)
+        set_len = SIZEOF(set_buf)-1;
+    set_buf[set_len] = '\0';
+
+    REPORT(err, "Invalid key '%s' used in access to map '%s'", key_buf, set_buf);
+    return VALUE_ERROR;
+}
+
+// Equivalent to value_select with a string key, but
+// doesn't require the key to be allocated as a value
+static Value value_select_by_str(Value set, String key, Error *err)
+{
+    Type t = value_type(set);
+    if (t != TYPE_MAP && t != TYPE_ARRAY) {
+        REPORT(err, "Invalid selection from non-map and non-array value");
+        return VALUE_ERROR;
+    }
+    AggregateValue *agg = (void*) (set & PTR_MASK);
+
+    if (agg->type == TYPE_ARRAY) {
+        REPORT(err, "Invalid index used in array access");
+        return VALUE_ERROR;
+    }
+
+    Value *dst = aggregate_select_by_str(agg, key);
+    if (dst) return *dst;
+
+    char set_buf[1<<8];
+    int set_len = value_convert_to_str(set, set_buf, SIZEOF(set_buf));
+    if (set_len > SIZEOF(set_buf)-1)
+        set_len = SIZEOF(set_buf)-1;
+    set_buf[set_len] = '\0';
+
+    REPORT(err, "Invalid key '%.*s' used in access to map '%s'", MIN(key.len, 255), key.ptr, set_buf);
+    return VALUE_ERROR;
+}
+
+static Value value_select_by_index(Value set, int64_t idx, Error *err)
+{
+    Type t = value_type(set);
+    if (t != TYPE_MAP && t != TYPE_ARRAY) {
+        REPORT(err, "Invalid selection from non-map and non-array value");
+        return VALUE_ERROR;
+    }
+    AggregateValue *agg = (void*) (set & PTR_MASK);
+
+    if (agg->type == TYPE_MAP)
+        idx *= 2;
+
+    Value *src = aggregate_select_by_raw_index(agg, idx);
+    if (src == NULL) {
+        REPORT(err, "Invalid selection from non-map and non-array value");
+        return VALUE_ERROR;
+    }
+
+    return value_element(set, *src);
+}
+
+static bool value_append(Value set, Value val, WL_Arena *arena, Error *err)
+{
+    Type t = value_type(set);
+    if (t != TYPE_ARRAY) {
+        REPORT(err, "Invalid append on non-array value");
+        return false;
+    }
+    AggregateValue *agg = (void*) (set & PTR_MASK);
+
+    if (!aggregate_own(agg, arena)) {
+        REPORT(err, "Out of memory");
+        return false;
+    }
+
+    if (!aggregate_append(agg, val, VALUE_ERROR, arena)) {
+        REPORT(err, "Out of memory");
+        return false;
+    }
+
+    return true;
+}
+
+static bool value_eql(Value a, Value b)
+{
+    Type t1 = value_type(a);
+    Type t2 = value_type(b);
+
+    if (t1 != t2)
+        return false;
+
+    switch (t1) {
+
+        case TYPE_NONE:
+        return true;
+
+        case TYPE_BOOL:
+        return a == b;
+
+        case TYPE_INT:
+        return value_to_s64(a) == value_to_s64(b);
+
+        case TYPE_FLOAT:
+        return value_to_f64(a) == value_to_f64(b);
+
+        case TYPE_MAP:
+        return false; // TODO
+
+        case TYPE_ARRAY:
+        return false; // TODO
+
+        case TYPE_STRING:
+        return streq(value_to_str(a), value_to_str(b));
+
+        case TYPE_ERROR:
+        return true;
+    }
+
+    return false;
+}
+
+static bool value_nql(Value a, Value b)
+{
+    return !value_eql(a, b);
+}
+
+#define TYPE_PAIR(X, Y) (((uint16_t) (X) << 16) | (uint16_t) (Y))
+
+bool value_greater(Value a, Value b, Error *err)
+{
+    Type t1 = value_type(a);
+    Type t2 = value_type(b);
+    switch (TYPE_PAIR(t1, t2)) {
+        case TYPE_PAIR(TYPE_INT  , TYPE_INT  ): return value_to_s64(a) > value_to_s64(b);
+        case TYPE_PAIR(TYPE_INT  , TYPE_FLOAT): return value_to_s64(a) > value_to_f64(b);
+        case TYPE_PAIR(TYPE_FLOAT, TYPE_INT  ): return value_to_f64(a) > value_to_s64(b);
+        case TYPE_PAIR(TYPE_FLOAT, TYPE_FLOAT): return value_to_f64(a) > value_to_f64(b);
+        default:break;
+    }
+    REPORT(err, "Invalid '>' operation on non-numeric type");
+    return false;
+}
+
+bool value_lower(Value a, Value b, Error *err)
+{
+    Type t1 = value_type(a);
+    Type t2 = value_type(b);
+    switch (TYPE_PAIR(t1, t2)) {
+        case TYPE_PAIR(TYPE_INT  , TYPE_INT  ): return value_to_s64(a) < value_to_s64(b);
+        case TYPE_PAIR(TYPE_INT  , TYPE_FLOAT): return value_to_s64(a) < value_to_f64(b);
+        case TYPE_PAIR(TYPE_FLOAT, TYPE_INT  ): return value_to_f64(a) < value_to_s64(b);
+        case TYPE_PAIR(TYPE_FLOAT, TYPE_FLOAT): return value_to_f64(a) < value_to_f64(b);
+        default:break;
+    }
+    REPORT(err, "Invalid '<' operation on non-numeric type");
+    return false;
+}
+
+static Value value_neg(Value v, WL_Arena *arena, Error *err)
+{
+    Type t = value_type(v);
+    if (t == TYPE_INT)
+        return value_from_s64(-value_to_s64(v), arena, err); // TODO: overflow
+
+    if (t == TYPE_FLOAT)
+        return value_from_f64(-value_to_f64(v), arena, err);
+
+    REPORT(err, "Invalid '-' operation on non-numeric type");
+    return VALUE_ERROR;
+}
+
+static Value value_add(Value v1, Value v2, WL_Arena *arena, Error *err)
+{
+    Type t1 = value_type(v1);
+    Type t2 = value_type(v2);
+
+    Value r;
+    switch (TYPE_PAIR(t1, t2)) {
+
+        case TYPE_PAIR(TYPE_INT, TYPE_INT):
+        {
+            int64_t u = value_to_s64(v1);
+            int64_t v = value_to_s64(v2);
+            // TODO: check overflow and underflow
+            r = value_from_s64(u + v, arena, err);
+        }
+        break;
 
-        case OPCODE_PUSHM:
-        if (len < 5) return -1;
-        memcpy(&w0, src + 1, sizeof(w0));
-        write_text(w, S("PUSHM "));
-        write_text_s64(w, w0);
-        write_text(w, S("\n"));
-        return 5;
+        case TYPE_PAIR(TYPE_INT, TYPE_FLOAT):
+        {
+            double u = (double) value_to_s64(v1);
+            double v = value_to_f64(v2);
+            r = value_from_f64(u + v, arena, err);
+        }
+        break;
 
-        case OPCODE_PUSHN:
-        write_text(w, S("PUSHN\n"));
-        return 1;
+        case TYPE_PAIR(TYPE_FLOAT, TYPE_INT):
+        {
+            double u = value_to_f64(v1);
+            double v = (double) value_to_s64(v2);
+            r = value_from_f64(u + v, arena, err);
+        }
+        break;
 
-        case OPCODE_PUSHT:
-        write_text(w, S("PUSHT\n"));
-        return 1;
+        case TYPE_PAIR(TYPE_FLOAT, TYPE_FLOAT):
+        {
+            double u = value_to_f64(v1);
+            double v = value_to_f64(v2);
+            // TODO: check overflow and underflow
+            r = value_from_f64(u + v, arena, err);
+        }
+        break;
 
-        case OPCODE_PUSHFL:
-        write_text(w, S("PUSHFL\n"));
-        return 1;
+        default:
+        REPORT(err, "Invalid operation '+' on non-numeric value");
+        return VALUE_ERROR;
+    }
 
-        case OPCODE_LEN:
-        write_text(w, S("LEN\n"));
-        return 1;
+    return r;
+}
 
-        case OPCODE_NEG:
-        write_text(w, S("NEG\n"));
-        return 1;
+static Value value_sub(Value v1, Value v2, WL_Arena *arena, Error *err)
+{
+    Type t1 = value_type(v1);
+    Type t2 = value_type(v2);
 
-        case OPCODE_EQL:
-        write_text(w, S("EQL\n"));
-        return 1;
+    Value r;
+    switch (TYPE_PAIR(t1, t2)) {
 
-        case OPCODE_NQL:
-        write_text(w, S("NQL\n"));
-        return 1;
+        case TYPE_PAIR(TYPE_INT, TYPE_INT):
+        {
+            int64_t u = value_to_s64(v1);
+            int64_t v = value_to_s64(v2);
+            // TODO: check overflow and underflow
+            r = value_from_s64(u - v, arena, err);
+        }
+        break;
 
-        case OPCODE_LSS:
-        write_text(w, S("LSS\n"));
-        return 1;
+        case TYPE_PAIR(TYPE_INT, TYPE_FLOAT):
+        {
+            double u = (double) value_to_s64(v1);
+            double v = value_to_f64(v2);
+            r = value_from_f64(u - v, arena, err);
+        }
+        break;
 
-        case OPCODE_GRT:
-        write_text(w, S("GRT\n"));
-        return 1;
+        case TYPE_PAIR(TYPE_FLOAT, TYPE_INT):
+        {
+            double u = value_to_f64(v1);
+            double v = (double) value_to_s64(v2);
+            r = value_from_f64(u - v, arena, err);
+        }
+        break;
 
-        case OPCODE_ADD:
-        write_text(w, S("ADD\n"));
-        return 1;
+        case TYPE_PAIR(TYPE_FLOAT, TYPE_FLOAT):
+        {
+            double u = value_to_f64(v1);
+            double v = value_to_f64(v2);
+            // TODO: check overflow and underflow
+            r = value_from_f64(u - v, arena, err);
+        }
+        break;
 
-        case OPCODE_SUB:
-        write_text(w, S("SUB\n"));
-        return 1;
+        default:
+        REPORT(err, "Invalid operation '-' on non-numeric value");
+        return VALUE_ERROR;
+    }
 
-        case OPCODE_MUL:
-        write_text(w, S("MUL\n"));
-        return 1;
+    return r;
+}
 
-        case OPCODE_DIV:
-        write_text(w, S("DIV\n"));
-        return 1;
+static Value value_mul(Value v1, Value v2, WL_Arena *arena, Error *err)
+{
+    Type t1 = value_type(v1);
+    Type t2 = value_type(v2);
 
-        case OPCODE_MOD:
-        write_text(w, S("MOD\n"));
-        return 1;
+    Value r;
+    switch (TYPE_PAIR(t1, t2)) {
 
-        case OPCODE_APPEND:
-        write_text(w, S("APPEND\n"));
-        return 1;
+        case TYPE_PAIR(TYPE_INT, TYPE_INT):
+        {
+            int64_t u = value_to_s64(v1);
+            int64_t v = value_to_s64(v2);
+            // TODO: check overflow and underflow
+            r = value_from_s64(u * v, arena, err);
+        }
+        break;
 
-        case OPCODE_INSERT1:
-        write_text(w, S("INSERT1\n"));
-        return 1;
+        case TYPE_PAIR(TYPE_INT, TYPE_FLOAT):
+        {
+            double u = (double) value_to_s64(v1);
+            double v = value_to_f64(v2);
+            r = value_from_f64(u * v, arena, err);
+        }
+        break;
 
-        case OPCODE_INSERT2:
-        write_text(w, S("INSERT2\n"));
-        return 1;
+        case TYPE_PAIR(TYPE_FLOAT, TYPE_INT):
+        {
+            double u = value_to_f64(v1);
+            double v = (double) value_to_s64(v2);
+            r = value_from_f64(u * v, arena, err);
+        }
+        break;
 
-        case OPCODE_SELECT:
-        write_text(w, S("SELECT\n"));
-        return 1;
+        case TYPE_PAIR(TYPE_FLOAT, TYPE_FLOAT):
+        {
+            double u = value_to_f64(v1);
+            double v = value_to_f64(v2);
+            // TODO: check overflow and underflow
+            r = value_from_f64(u * v, arena, err);
+        }
+        break;
 
         default:
-        write_text(w, S("byte "));
-        write_text_s64(w, src[0]);
-        return 1;
+        REPORT(err, "Invalid operation '*' on non-numeric value");
+        return VALUE_ERROR;
     }
 
-    return -1;
+    return r;
 }
 
-static int write_program(WL_Program program, char *dst, int cap)
+static Value value_div(Value v1, Value v2, WL_Arena *arena, Error *err)
 {
-    if (program.len < 3 * sizeof(uint32_t))
-        return -1;
+    Type t1 = value_type(v1);
+    Type t2 = value_type(v2);
 
-    uint32_t magic;
-    uint32_t code_len;
-    uint32_t data_len;
+    Value r;
+    switch (TYPE_PAIR(t1, t2)) {
 
-    memcpy(&magic   , program.ptr + 0, sizeof(uint32_t));
-    memcpy(&code_len, program.ptr + 4, sizeof(uint32_t));
-    memcpy(&data_len, program.ptr + 8, sizeof(uint32_t));
+        case TYPE_PAIR(TYPE_INT, TYPE_INT):
+        {
+            // TODO: check division by 0
 
-    if (magic != WL_MAGIC)
-        return -1;
+            int64_t u = value_to_s64(v1);
+            int64_t v = value_to_s64(v2);
+            r = value_from_s64(u / v, arena, err);
+        }
+        break;
 
-    if (code_len + data_len + 3 * sizeof(uint32_t) != program.len)
-        return -1;
+        case TYPE_PAIR(TYPE_INT, TYPE_FLOAT):
+        {
+            // TODO: check division by 0
 
-    String code = { program.ptr + 3 * sizeof(uint32_t)           , code_len };
-    String data = { program.ptr + 3 * sizeof(uint32_t) + code_len, data_len };
+            double u = (double) value_to_s64(v1);
+            double v = value_to_f64(v2);
+            r = value_from_f64(u / v, arena, err);
+        }
+        break;
 
-    Writer w = { dst, cap, 0 };
+        case TYPE_PAIR(TYPE_FLOAT, TYPE_INT):
+        {
+            // TODO: check division by 0
 
-    int cur = 0;
-    while (cur < code.len) {
-        write_text_s64(&w, cur);
-        write_text(&w, S(": "));
-        int ret = write_instr(&w, code.ptr + cur, code.len - cur, data);
-        if (ret < 0) return -1;
-        cur += ret;
+            double u = value_to_f64(v1);
+            double v = (double) value_to_s64(v2);
+            r = value_from_f64(u / v, arena, err);
+        }
+        break;
+
+        case TYPE_PAIR(TYPE_FLOAT, TYPE_FLOAT):
+        {
+            double u = value_to_f64(v1);
+            double v = value_to_f64(v2);
+            r = value_from_f64(u / v, arena, err);
+        }
+        break;
+
+        default:
+        REPORT(err, "Invalid operation '/' on non-numeric value");
+        return VALUE_ERROR;
     }
 
-    return w.len;
+    return r;
 }
 
-void wl_dump_program(WL_Program program)
+static Value value_mod(Value v1, Value v2, WL_Arena *arena, Error *err)
 {
-    char buf[1<<10];
-    int len = write_program(program, buf, SIZEOF(buf));
-
-    if (len < 0) {
-        printf("Invalid program\n");
-        return;
-    }
+    Type t1 = value_type(v1);
+    Type t2 = value_type(v2);
 
-    if (len > SIZEOF(buf)) {
-        char *p = malloc(len+1);
-        if (p == NULL) {
-            printf("Out of memory\n");
-            return;
-        }
-        write_program(program, p, len);
-        p[len] = '\0';
-        fwrite(p, 1, len, stdout);
-    } else {
-        fwrite(buf, 1, len, stdout);
+    if (t1 != TYPE_INT || t2 != TYPE_INT) {
+        REPORT(err, "Invalid operation '%%' on non-integer value");
+        return VALUE_ERROR;
     }
+
+    int64_t u = value_to_s64(v1);
+    int64_t v = value_to_s64(v2);
+    Value r = value_from_s64(u % v, arena, err);
+    return r;
 }
 
-/////////////////////////////////////////////////////////////////////////
-// COMPILER
-/////////////////////////////////////////////////////////////////////////
+// HTML escaping replaces the characters < > & " ' with
+// entities. It's usually applied while writing the output
+// (see FLAG_ESCAPE), which only needs to find the next
+// character to replace.
 
-#define FILE_LIMIT 128
+#if defined(ESCAPE_AVX2)
 
-typedef struct {
-    String file;
-    Node*  root;
-    Node*  includes;
-} CompiledFile;
+typedef __m256i EscapeVec;
+#define ESCAPE_VEC_SIZE 32
+#define escape_load(p)     _mm256_loadu_si256((const __m256i*) (p))
+#define escape_splat(c)    _mm256_set1_epi8(c)
+#define escape_eq(x, y)    _mm256_cmpeq_epi8(x, y)
+#define escape_or(x, y)    _mm256_or_si256(x, y)
+#define escape_mask(x)     (uint32_t) _mm256_movemask_epi8(x)
 
-struct WL_Compiler {
+#elif defined(ESCAPE_SSE2)
 
-    WL_Arena*    arena;
-    CompiledFile files[FILE_LIMIT];
-    int          num_files;
-    String       waiting_file;
+typedef __m128i EscapeVec;
+#define ESCAPE_VEC_SIZE 16
+#define escape_load(p)     _mm_loadu_si128((const __m128i*) (p))
+#define escape_splat(c)    _mm_set1_epi8(c)
+#define escape_eq(x, y)    _mm_cmpeq_epi8(x, y)
+#define escape_or(x, y)    _mm_or_si128(x, y)
+#define escape_mask(x)     (uint32_t) _mm_movemask_epi8(x)
 
-    bool err;
-    char msg[1<<8];
-};
+#endif
 
-WL_Compiler *wl_compiler_init(WL_Arena *arena)
+static String escape_entity(char c)
 {
-    WL_Compiler *compiler = alloc(arena, SIZEOF(WL_Compiler), _Alignof(WL_Compiler));
-    if (compiler == NULL)
-        return NULL;
-    compiler->arena = arena;
-    compiler->num_files = 0;
-    compiler->waiting_file = (String) { NULL, 0 };
-    compiler->err = false;
-    return compiler;
+    switch (c) {
+        case '<' : return S("&lt;");
+        case '>' : return S("&gt;");
+        case '&' : return S("&amp;");
+        case '"' : return S("&quot;");
+        case '\'': return S("&#x27;");
+    }
+    return (String) { NULL, 0 };
 }
 
-WL_AddResult wl_compiler_add(WL_Compiler *compiler, WL_String path, WL_String content)
+// Returns the number of bytes escaping adds to "src"
+static int64_t escape_extra(String src)
 {
-    if (compiler->err)
-        return (WL_AddResult) { .type=WL_ADD_ERROR };
+    int64_t extra = 0;
+    int i = 0;
 
-    ParseResult pres = parse((String) { content.ptr, content.len }, compiler->arena, compiler->msg, SIZEOF(compiler->msg));
-    if (pres.node == NULL) {
-        compiler->err = true;
-        return (WL_AddResult) { .type=WL_ADD_ERROR };
+#ifdef ESCAPE_VEC_SIZE
+    EscapeVec lt   = escape_splat('<');
+    EscapeVec gt   = escape_splat('>');
+    EscapeVec amp  = escape_splat('&');
+    EscapeVec quot = escape_splat('"');
+    EscapeVec apos = escape_splat('\'');
+    for (; src.len - i >= ESCAPE_VEC_SIZE; i += ESCAPE_VEC_SIZE) {
+        EscapeVec x = escape_load(src.ptr + i);
+        uint32_t m3 = escape_mask(escape_or(escape_eq(x, lt), escape_eq(x, gt)));
+        uint32_t m4 = escape_mask(escape_eq(x, amp));
+        uint32_t m5 = escape_mask(escape_or(escape_eq(x, quot), escape_eq(x, apos)));
+        extra += 3 * __builtin_popcount(m3)
+               + 4 * __builtin_popcount(m4)
+               + 5 * __builtin_popcount(m5);
     }
+#endif
 
-    // Make include paths relative to the parent file
-    if (path.len > 0) {
-
-        String parent = { path.ptr, path.len };
+    for (; i < src.len; i++) {
+        int n = escape_entity(src.ptr[i]).len;
+        if (n > 0)
+            extra += n - 1;
+    }
 
-        char sep = '/';
-        while (parent.len > 0 && parent.ptr[parent.len-1] != sep)
-            parent.len--;
+    return extra;
+}
+
+// Returns the index of the first character starting from
+// "i" that needs escaping, or the length of the string
+static int escape_next(String src, int i)
+{
+#ifdef ESCAPE_VEC_SIZE
+    EscapeVec lt   = escape_splat('<');
+    EscapeVec gt   = escape_splat('>');
+    EscapeVec amp  = escape_splat('&');
+    EscapeVec quot = escape_splat('"');
+    EscapeVec apos = escape_splat('\'');
+    for (; src.len - i >= ESCAPE_VEC_SIZE; i += ESCAPE_VEC_SIZE) {
+        EscapeVec x = escape_load(src.ptr + i);
+        EscapeVec m = escape_or(escape_or(escape_eq(x, lt), escape_eq(x, gt)),
+                      escape_or(escape_or(escape_eq(x, amp), escape_eq(x, quot)), escape_eq(x, apos)));
+        uint32_t mask = escape_mask(m);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
 
-        if (parent.len > 0) {
-            Node *include = pres.includes;
-            while (include) {
+    while (i < src.len && escape_entity(src.ptr[i]).len == 0)
+        i++;
+    return i;
+}
 
-                char *dst = alloc(compiler->arena, parent.len + include->include_path.len + 1, 1);
-                if (dst == NULL) {
-                    // TODO: report error
-                    return (WL_AddResult) { .type=WL_ADD_ERROR };
-                }
+// Returns an escaped copy of a string. Strings are scanned
+// once to compute the size of the output, then the escaped
+// string is written in a single allocation. Strings with
+// nothing to escape are returned as they are.
+static Value string_escape(Value v, WL_Arena *arena, Error *err)
+{
+    String src = value_to_str(v);
 
-                memcpy(dst,
-                    parent.ptr,
-                    parent.len);
-                memcpy(dst + parent.len,
-                    include->include_path.ptr,
-                    include->include_path.len);
+    int64_t extra = escape_extra(src);
+    if (extra == 0)
+        return v;
 
-                include->include_path = (String) { dst, parent.len + include->include_path.len };
+    if (extra > INT_MAX - SIZEOF(StringValue) - src.len) {
+        REPORT(err, "Out of memory");
+        return VALUE_ERROR;
+    }
 
-                include = include->include_next;
-            }
-        }
+    StringValue *dst = alloc(arena, SIZEOF(StringValue) + src.len + extra, 8);
+    if (dst == NULL) {
+        REPORT(err, "Out of memory");
+        return VALUE_ERROR;
     }
+    dst->type = TYPE_STRING;
+    dst->len  = src.len + extra;
+    dst->hash = 0;
+    dst->ptr  = dst->data;
 
-    CompiledFile compiled_file = {
-        .file = compiler->waiting_file,
-        .root = pres.node,
-        .includes = pres.includes,
-    };
-    compiler->files[compiler->num_files++] = compiled_file;
-    compiler->waiting_file = (String) { NULL, 0 };
+    char *out = dst->data;
+    for (int i = 0;;) {
 
-    for (int i = 0; i < compiler->num_files; i++) {
+        int j = escape_next(src, i);
+        memcpy(out, src.ptr + i, j - i);
+        out += j - i;
 
-        Node *include = compiler->files[i].includes;
-        while (include) {
+        if (j == src.len)
+            break;
 
-            ASSERT(include->type == NODE_INCLUDE);
+        String entity = escape_entity(src.ptr[j]);
+        memcpy(out, entity.ptr, entity.len);
+        out += entity.len;
 
-            if (include->include_root == NULL) {
-                for (int j = 0; j < compiler->num_files; j++) {
-                    if (streq(include->include_path, compiler->files[j].file)) {
-                        include->include_root = compiler->files[j].root;
-                        break;
-                    }
-                }
-            }
+        i = j + 1;
+    }
+    ASSERT(out == dst->data + dst->len);
 
-            if (include->include_root == NULL) {
+    return value_from_ptr(TAG_STRING, dst);
+}
 
-                if (compiler->num_files == FILE_LIMIT) {
-                    // TODO: report error
-                    return (WL_AddResult) { .type=WL_ADD_ERROR };
-                }
+static void write_text_escaped(Writer *w, String str)
+{
+    for (int i = 0;;) {
 
-                compiler->waiting_file = include->include_path;
-                return (WL_AddResult) { .type=WL_ADD_AGAIN, .path={ include->include_path.ptr, include->include_path.len } };
-            }
+        int j = escape_next(str, i);
+        write_text(w, (String) { str.ptr + i, j - i });
 
-            include = include->include_next;
-        }
-    }
+        if (j == str.len)
+            break;
 
-    return (WL_AddResult) { .type=WL_ADD_LINK };
+        write_text(w, escape_entity(str.ptr[j]));
+        i = j + 1;
+    }
 }
 
-int wl_compiler_link(WL_Compiler *compiler, WL_Program *program)
+static void value_convert_to_str_inner(Writer *w, Value v)
 {
-    if (compiler->err) return -1;
+    Type t = value_type(v);
+    switch (t) {
 
-    if (compiler->num_files == 0 || compiler->waiting_file.len > 0) {
-        int len = snprintf(compiler->msg, SIZEOF(compiler->msg), "Missing files in compilation unit");
-        if (len > SIZEOF(compiler->msg))
-            len = SIZEOF(compiler->msg)-1;
-        compiler->msg[len] = '\0';
-        compiler->err = true;
-        return -1;
-    }
+        case TYPE_NONE:
+        break;
 
-    char *dst = compiler->arena->ptr + compiler->arena->cur;
-    int   cap = compiler->arena->len - compiler->arena->cur;
+        case TYPE_BOOL:
+        write_text(w, v == VALUE_TRUE ? S("true") : S("false"));
+        break;
 
-    int len = codegen(compiler->files[0].root, dst, cap, compiler->msg, SIZEOF(compiler->msg));
-    if (len < 0) {
-        compiler->err = true;
-        return -1;
-    }
-    if (len > cap) {
-        int len = snprintf(compiler->msg, SIZEOF(compiler->msg), "Out of memory");
-        if (len > SIZEOF(compiler->msg))
-            len = SIZEOF(compiler->msg)-1;
-        compiler->msg[len] = '\0';
-        compiler->err = true;
-        return -1;
-    }
+        case TYPE_INT:
+        write_text_s64(w, value_to_s64(v));
+        break;
 
-    *program = (WL_Program) { dst, len };
+        case TYPE_FLOAT:
+        write_text_f64(w, value_to_f64(v));
+        break;
 
-    compiler->arena->cur += len;
-    return 0;
-}
+        case TYPE_STRING:
+        if (v & FLAG_ESCAPE)
+            write_text_escaped(w, value_to_str(v));
+        else
+            write_text(w, value_to_str(v));
+        break;
 
-WL_String wl_compiler_error(WL_Compiler *compiler)
-{
-    return compiler->err
-        ? (WL_String) { compiler->msg, strlen(compiler->msg) }
-        : (WL_String) { NULL, 0 };
+        case TYPE_ARRAY:
+        {
+            AggregateValue *agg = (void*) (v & PTR_MASK);
+            for (int i = 0; i < agg->count; i++)
+                value_convert_to_str_inner(w, value_element(v, agg->vals[i]));
+        }
+        break;
+
+        case TYPE_MAP:
+        write_text(w, S("<map>"));
+        break;
+
+        case TYPE_ERROR:
+        break;
+    }
 }
 
-int wl_dump_ast(WL_Compiler *compiler, char *dst, int cap)
+static int value_convert_to_str(Value v, char *dst, int cap)
 {
-    Writer w = { dst, cap, 0 };
-    for (int i = 0; i < compiler->num_files; i++) {
-        write_text(&w, S("(file \""));
-        write_text(&w, compiler->files[i].file);
-        write_text(&w, S("\" "));
-        write_node(&w, compiler->files[i].root);
-        write_text(&w, S(")"));
-    }
+    Writer w = { dst, cap, 0};
+    value_convert_to_str_inner(&w, v);
     return w.len;
 }
 
+#undef TYPE_PAIR
+
 /////////////////////////////////////////////////////////////////////////
-// OBJECT MODEL
+// JSON
 /////////////////////////////////////////////////////////////////////////
 
-typedef enum {
-    TYPE_NONE,
-    TYPE_BOOL,
-    TYPE_INT,
-    TYPE_FLOAT,
-    TYPE_STRING,
-    TYPE_ARRAY,
-    TYPE_MAP,
-    TYPE_ERROR,
-} Type;
-
-#define TAG_ERROR 0
-#define TAG_POSITIVE_INT 1
-#define TAG_NEGATIVE_INT 2
-#define TAG_BOOL 3
-#define TAG_NONE 4
-#define TAG_PTR  5
-
-#define VALUE_NONE  ((0 << 3) | TAG_NONE)
-#define VALUE_TRUE  ((0 << 3) | TAG_BOOL)
-#define VALUE_FALSE ((1 << 3) | TAG_BOOL)
-#define VALUE_ERROR ((0 << 3) | TAG_ERROR)
-
-typedef uint64_t Value;
-
-typedef struct Extension Extension;
-struct Extension {
-    Extension *next;
-    int count;
-    int capacity;
-    Value vals[];
-};
+// Arrays and objects nested deeper than this are rejected
+// to bound the recursion of the parser
+#define JSON_MAX_DEPTH 128
 
 typedef struct {
-    Type  type;
-    int   count;
-    int   capacity;
-    Extension *ext;
-    Value vals[];
-} AggregateValue;
+    char     *src;
+    int       len;
+    int       cur;
+    int       depth;
+    WL_Arena *arena;
+    Error    *err;
+} JSONParser;
 
-typedef struct {
-    Type   type;
-    double raw;
-} FloatValue;
+static Value json_parse_value(JSONParser *p);
 
-typedef struct {
-    Type    type;
-    int64_t raw;
-} IntValue;
+static Value json_error(JSONParser *p)
+{
+    REPORT(p->err, "Invalid JSON at offset %d", p->cur);
+    return VALUE_ERROR;
+}
 
-typedef struct {
-    Type type;
-    int  len;
-    char data[];
-} StringValue;
+static void json_skip_space(JSONParser *p)
+{
+    while (p->cur < p->len && is_space(p->src[p->cur]))
+        p->cur++;
+}
 
-static int value_convert_to_str(Value v, char *dst, int cap);
+static bool json_consume(JSONParser *p, char c)
+{
+    json_skip_space(p);
+    if (p->cur == p->len || p->src[p->cur] != c)
+        return false;
+    p->cur++;
+    return true;
+}
 
-static Type value_type(Value v)
+static int json_hex4(JSONParser *p)
 {
-    switch (v & 7) {
-        case TAG_ERROR: return TYPE_ERROR;
-        case TAG_POSITIVE_INT: return TYPE_INT;
-        case TAG_NEGATIVE_INT: return TYPE_INT;
-        case TAG_BOOL : return TYPE_BOOL;
-        case TAG_NONE : return TYPE_NONE;
-        case TAG_PTR  : return *(Type*) (v & ~(Value) 7); break;
+    if (p->len - p->cur < 4)
+        return -1;
+
+    int x = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p->src[p->cur++];
+        int d;
+        if (c >= '0' && c <= '9') d = c - '0';
+        else if (c >= 'a' && c <= 'f') d = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') d = c - 'A' + 10;
+        else return -1;
+        x = (x << 4) | d;
     }
-    return TAG_ERROR;
+    return x;
 }
 
-static int64_t value_to_s64(Value v)
+static int json_utf8(uint32_t cp, char *dst)
 {
-    ASSERT(value_type(v) == TYPE_INT);
+    if (cp < 0x80) {
+        dst[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        dst[0] = 0xC0 | (cp >> 6);
+        dst[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        dst[0] = 0xE0 | (cp >> 12);
+        dst[1] = 0x80 | ((cp >> 6) & 0x3F);
+        dst[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+    dst[0] = 0xF0 | (cp >> 18);
+    dst[1] = 0x80 | ((cp >> 12) & 0x3F);
+    dst[2] = 0x80 | ((cp >> 6) & 0x3F);
+    dst[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+
+// Strings without escape sequences refer to the source
+// text. The others are decoded into a new string, which
+// is never longer than its escaped form.
+static Value json_parse_string(JSONParser *p)
+{
+    ASSERT(p->src[p->cur] == '"');
+    p->cur++;
+
+    int start = p->cur;
+    bool escaped = false;
+    while (p->cur < p->len && p->src[p->cur] != '"') {
+        if ((unsigned char) p->src[p->cur] < 0x20)
+            return json_error(p);
+        if (p->src[p->cur] == '\\') {
+            escaped = true;
+            p->cur++;
+        }
+        p->cur++;
+    }
+    if (p->cur >= p->len)
+        return json_error(p);
+    int end = p->cur++;
 
-    if ((v & 7) == TAG_POSITIVE_INT)
-        return (int64_t) (v >> 3);
+    if (!escaped)
+        return value_from_str_borrowed((String) { p->src + start, end - start }, p->arena, p->err);
 
-    if ((v & 7) == TAG_NEGATIVE_INT)
-        return (int64_t) ((v >> 3) | ((Value) 7 << 61));
+    Value v = value_from_str((String) { p->src + start, end - start }, p->arena, p->err);
+    if (v == VALUE_ERROR)
+        return VALUE_ERROR;
+    StringValue *str = (StringValue*) (v & PTR_MASK);
 
-    IntValue *p = (IntValue*) (v & ~(Value) 7);
-    return p->raw;
-}
+    int len = 0;
+    p->cur = start;
+    while (p->cur < end) {
 
-static double value_to_f64(Value v)
-{
-    ASSERT(value_type(v) == TYPE_FLOAT);
+        char c = p->src[p->cur++];
+        if (c != '\\') {
+            str->data[len++] = c;
+            continue;
+        }
 
-    FloatValue *p = (FloatValue*) (v & ~(Value) 7);
-    return p->raw;
-}
+        c = p->src[p->cur++];
+        switch (c) {
+            case '"' : str->data[len++] = '"';  break;
+            case '\\': str->data[len++] = '\\'; break;
+            case '/' : str->data[len++] = '/';  break;
+            case 'b' : str->data[len++] = '\b'; break;
+            case 'f' : str->data[len++] = '\f'; break;
+            case 'n' : str->data[len++] = '\n'; break;
+            case 'r' : str->data[len++] = '\r'; break;
+            case 't' : str->data[len++] = '\t'; break;
+
+            case 'u':
+            {
+                int cp = json_hex4(p);
+                if (cp < 0)
+                    return json_error(p);
+
+                if (cp >= 0xD800 && cp <= 0xDBFF) {
+                    // Surrogate pair
+                    if (end - p->cur < 6 || p->src[p->cur] != '\\' || p->src[p->cur+1] != 'u')
+                        return json_error(p);
+                    p->cur += 2;
+                    int lo = json_hex4(p);
+                    if (lo < 0xDC00 || lo > 0xDFFF)
+                        return json_error(p);
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                }
+                len += json_utf8(cp, str->data + len);
+            }
+            break;
 
-static String value_to_str(Value v)
-{
-    ASSERT(value_type(v) == TYPE_STRING);
+            default:
+            return json_error(p);
+        }
+    }
+    p->cur = end + 1;
 
-    StringValue *p = (StringValue*) (v & ~(Value) 7);
-    return (String) { p->data, p->len };
+    str->len = len;
+    return v;
 }
 
-static Value value_from_s64(int64_t x, WL_Arena *arena, Error *err)
+// Significant digits of a number beyond this are dropped
+// when converting it to a float, which is far more than a
+// double can represent
+#define JSON_MAX_DIGITS 40
+
+// Converts a valid JSON number to a float. The digits are
+// copied to a bounded buffer with the exponent adjusted for
+// the ones that are dropped, so that numbers of any length
+// can be converted.
+static double json_to_f64(char *src, int len)
 {
-    Value v = (Value) x;
-    Value upper3bits = v >> 61;
+    char buf[JSON_MAX_DIGITS + 32];
+    int  num = 0;
+    int  i = 0;
 
-    if (upper3bits == 0)
-        return (v << 3) | TAG_POSITIVE_INT;
+    if (src[i] == '-')
+        buf[num++] = src[i++];
 
-    if (upper3bits == 7)
-        return (v << 3) | TAG_NEGATIVE_INT;
+    int64_t exp = 0;
+    int  kept = 0;
+    bool frac = false;
+    for (; i < len && src[i] != 'e' && src[i] != 'E'; i++) {
 
-    IntValue *p = alloc(arena, SIZEOF(IntValue), _Alignof(IntValue));
-    if (p == NULL) {
-        REPORT(err, "Out of memory");
-        return VALUE_ERROR;
-    }
+        if (src[i] == '.') {
+            frac = true;
+            continue;
+        }
 
-    p->type = TYPE_INT;
-    p->raw  = x;
+        if (frac)
+            exp--;
 
-    ASSERT(((Value) p & 7) == 0);
-    return ((Value) p) | TAG_PTR;
-}
+        // Leading zeros don't change the value
+        if (kept == 0 && src[i] == '0')
+            continue;
 
-static Value value_from_f64(double x, WL_Arena *arena, Error *err)
-{
-    FloatValue *v = alloc(arena, SIZEOF(FloatValue), _Alignof(FloatValue));
-    if (v == NULL) {
-        REPORT(err, "Out of memory");
-        return VALUE_ERROR;
+        if (kept < JSON_MAX_DIGITS) {
+            buf[num++] = src[i];
+            kept++;
+        } else
+            exp++;
     }
+    if (kept == 0)
+        buf[num++] = '0';
 
-    v->type = TYPE_FLOAT;
-    v->raw  = x;
-
-    ASSERT(((uintptr_t) v & 7) == 0);
-    return ((Value) v) | TAG_PTR;
-}
-
-static Value value_from_str(String x, WL_Arena *arena, Error *err)
-{
-    StringValue *v = alloc(arena, SIZEOF(StringValue) + x.len, 8);
-    if (v == NULL) {
-        REPORT(err, "Out of memory");
-        return VALUE_ERROR;
+    if (i < len) {
+        i++;
+        bool neg = false;
+        if (src[i] == '+' || src[i] == '-')
+            neg = (src[i++] == '-');
+
+        // Exponents this large overflow or underflow anyway
+        int64_t e = 0;
+        for (; i < len; i++)
+            if (e < 1000000)
+                e = e * 10 + (src[i] - '0');
+        exp += neg ? -e : e;
     }
 
-    v->type = TYPE_STRING;
-    v->len = x.len;
-    memcpy(v->data, x.ptr, x.len);
-
-    ASSERT(((uintptr_t) v & 7) == 0);
-    return ((Value) v) | TAG_PTR;
+    snprintf(buf + num, SIZEOF(buf) - num, "e%" LLD, exp);
+    return strtod(buf, NULL);
 }
 
-static Value aggregate_empty(bool map, uint32_t cap, WL_Arena *arena, Error *err)
+static Value json_parse_number(JSONParser *p)
 {
-    AggregateValue *v = alloc(arena, SIZEOF(AggregateValue) + 2 * cap * SIZEOF(Value), MAX(_Alignof(AggregateValue), 8));
-    if (v == NULL) {
-        REPORT(err, "Out of memory");
-        return VALUE_ERROR;
-    }
+    int start = p->cur;
 
-    v->type = map ? TYPE_MAP : TYPE_ARRAY;
-    v->count = 0;
-    v->capacity = cap;
-    v->ext = NULL;
+    if (p->cur < p->len && p->src[p->cur] == '-')
+        p->cur++;
 
-    ASSERT(((uintptr_t) v & 7) == 0);
-    return ((Value) v) | TAG_PTR;
-}
+    if (p->cur == p->len || !is_digit(p->src[p->cur]))
+        return json_error(p);
 
-static int64_t aggregate_length(AggregateValue *agg)
-{
-    int64_t n = agg->count;
+    if (p->src[p->cur] == '0')
+        p->cur++;
+    else
+        while (p->cur < p->len && is_digit(p->src[p->cur]))
+            p->cur++;
+
+    bool is_float = false;
+
+    if (p->cur < p->len && p->src[p->cur] == '.') {
+        p->cur++;
+        if (p->cur == p->len || !is_digit(p->src[p->cur]))
+            return json_error(p);
+        while (p->cur < p->len && is_digit(p->src[p->cur]))
+            p->cur++;
+        is_float = true;
+    }
 
-    Extension *ext = agg->ext;
-    while (ext) {
-        n += ext->count;
-        ext = ext->next;
+    if (p->cur < p->len && (p->src[p->cur] == 'e' || p->src[p->cur] == 'E')) {
+        p->cur++;
+        if (p->cur < p->len && (p->src[p->cur] == '+' || p->src[p->cur] == '-'))
+            p->cur++;
+        if (p->cur == p->len || !is_digit(p->src[p->cur]))
+            return json_error(p);
+        while (p->cur < p->len && is_digit(p->src[p->cur]))
+            p->cur++;
+        is_float = true;
     }
 
-    return n;
-}
+    if (!is_float) {
 
-static Value *aggregate_select_by_raw_index(AggregateValue *agg, int64_t idx)
-{
-    ASSERT(agg->type == TYPE_ARRAY || agg->type == TYPE_MAP);
+        bool neg = (p->src[start] == '-');
 
-    if (idx < 0 || idx >= aggregate_length(agg))
-        return NULL;
+        uint64_t x = 0;
+        bool overflow = false;
+        for (int i = start + neg; i < p->cur; i++) {
+            int d = p->src[i] - '0';
+            if (x > (UINT64_C(1) << 63) / 10 || (x == (UINT64_C(1) << 63) / 10 && d > 8)) {
+                overflow = true;
+                break;
+            }
+            x = x * 10 + d;
+        }
 
-    if (idx < agg->count)
-        return &agg->vals[idx];
+        if (!overflow && (neg || x <= INT64_MAX))
+            return value_from_s64(neg ? (int64_t) (0 - x) : (int64_t) x, p->arena, p->err);
 
-    idx -= agg->count;
-    Extension *ext = agg->ext;
-    while (ext) {
-        if (idx < ext->count)
-            return &ext->vals[idx];
-        idx -= ext->count;
-        ext = ext->next;
+        // Integers that don't fit are converted to floats
     }
 
-    UNREACHABLE;
-    return NULL;
+    return value_from_f64(json_to_f64(p->src + start, p->cur - start), p->arena, p->err);
 }
 
-static bool value_eql(Value a, Value b);
-
-static Value *aggregate_select(AggregateValue *agg, Value key)
+static Value json_parse_array(JSONParser *p)
 {
-    if (agg->type == TYPE_MAP) {
+    ASSERT(p->src[p->cur] == '[');
+    p->cur++;
 
-        for (int i = 0; i < agg->count; i += 2)
-            if (value_eql(agg->vals[i], key))
-                return &agg->vals[i+1];
+    Value array = value_empty_array(0, p->arena, p->err);
+    if (array == VALUE_ERROR)
+        return VALUE_ERROR;
 
-        Extension *ext = agg->ext;
-        while (ext) {
-            for (int i = 0; i < ext->count; i += 2)
-                if (value_eql(ext->vals[i], key)) {
-                    return &ext->vals[i+1];
-                }
-            ext = ext->next;
-        }
+    if (json_consume(p, ']'))
+        return array;
 
-        return NULL;
+    do {
+        Value v = json_parse_value(p);
+        if (v == VALUE_ERROR)
+            return VALUE_ERROR;
 
-    } else {
+        if (!value_append(array, v, p->arena, p->err))
+            return VALUE_ERROR;
 
-        ASSERT(agg->type == TYPE_ARRAY);
+    } while (json_consume(p, ','));
 
-        if (value_type(key) != TYPE_INT)
-            return NULL;
-        int64_t idx = value_to_s64(key);
+    if (!json_consume(p, ']'))
+        return json_error(p);
 
-        return aggregate_select_by_raw_index(agg, idx);
-    }
+    return array;
 }
 
-static bool aggregate_append(AggregateValue *agg, Value v1, Value v2, WL_Arena *arena)
+static Value json_parse_object(JSONParser *p)
 {
-    if (agg->count < agg->capacity) {
-        agg->vals[agg->count++] = v1;
-        if (v2 != VALUE_ERROR)
-            agg->vals[agg->count++] = v2;
-        return true;
-    }
+    ASSERT(p->src[p->cur] == '{');
+    p->cur++;
 
-    Extension *tail = agg->ext;
-    if (tail)
-        while (tail->next)
-            tail = tail->next;
+    Value map = value_empty_map(0, p->arena, p->err);
+    if (map == VALUE_ERROR)
+        return VALUE_ERROR;
 
-    Extension *ext;
-    if (tail == NULL || tail->count == tail->capacity) {
+    if (json_consume(p, '}'))
+        return map;
 
-        int cap = 8;
-        ext = alloc(arena, SIZEOF(Extension) + cap * sizeof(Value), ALIGNOF(Extension));
-        if (ext == NULL)
-            return false;
+    do {
+        json_skip_space(p);
+        if (p->cur == p->len || p->src[p->cur] != '"')
+            return json_error(p);
 
-        ext->count = 0;
-        ext->capacity = cap;
-        ext->next = NULL;
+        Value key = json_parse_string(p);
+        if (key == VALUE_ERROR)
+            return VALUE_ERROR;
 
-        if (tail)
-            tail->next = ext;
-        else
-            agg->ext = ext;
+        if (!json_consume(p, ':'))
+            return json_error(p);
 
-    } else
-        ext = tail;
+        Value val = json_parse_value(p);
+        if (val == VALUE_ERROR)
+            return VALUE_ERROR;
 
-    ext->vals[ext->count++] = v1;
-    if (v2 != VALUE_ERROR)
-        ext->vals[ext->count++] = v2;
-    return true;
-}
+        if (!value_insert(map, key, val, p->arena, p->err))
+            return VALUE_ERROR;
 
-static Value value_empty_map(uint32_t cap, WL_Arena *arena, Error *err)
-{
-    return aggregate_empty(true, 2 * cap, arena, err);
-}
+    } while (json_consume(p, ','));
 
-static Value value_empty_array(uint32_t cap, WL_Arena *arena, Error *err)
-{
-    return aggregate_empty(false, cap, arena, err);
+    if (!json_consume(p, '}'))
+        return json_error(p);
+
+    return map;
 }
 
-static int64_t value_length(Value set)
+static bool json_keyword(JSONParser *p, String kword)
 {
-    ASSERT(value_type(set) == TYPE_MAP || value_type(set) == TYPE_ARRAY);
-    AggregateValue *agg = (void*) (set & ~(Value) 7);
-    int64_t len = aggregate_length(agg);
-    if (agg->type == TYPE_MAP)
-        len /= 2;
-    return len;
+    if (p->len - p->cur < kword.len || memcmp(p->src + p->cur, kword.ptr, kword.len))
+        return false;
+    p->cur += kword.len;
+    return true;
 }
 
-static bool value_insert(Value set, Value key, Value val, WL_Arena *arena, Error *err)
+static Value json_parse_value(JSONParser *p)
 {
-    Type t = value_type(set);
-    if (t != TYPE_MAP && t != TYPE_ARRAY) {
-        REPORT(err, "Invalid insertion on non-map and non-array value");
-        return false;
-    }
-    AggregateValue *agg = (void*) (set & ~(Value) 7);
+    json_skip_space(p);
+    if (p->cur == p->len)
+        return json_error(p);
 
-    Value *dst = aggregate_select(agg, key);
-    if (dst != NULL) {
-        *dst = val;
-        return true;
-    }
+    Value v;
+    switch (p->src[p->cur]) {
 
-    if (agg->type == TYPE_ARRAY && value_type(key) != TYPE_INT) {
-        REPORT(err, "Invalid index used in array access");
-        return false;
-    }
+        case '"':
+        return json_parse_string(p);
 
-    if (!aggregate_append(agg, key, val, arena)) {
-        REPORT(err, "Out of memory");
-        return false;
+        case '[':
+        case '{':
+        if (p->depth == JSON_MAX_DEPTH)
+            return json_error(p);
+        p->depth++;
+        if (p->src[p->cur] == '[')
+            v = json_parse_array(p);
+        else
+            v = json_parse_object(p);
+        p->depth--;
+        return v;
+
+        case 't':
+        if (!json_keyword(p, S("true")))
+            return json_error(p);
+        return VALUE_TRUE;
+
+        case 'f':
+        if (!json_keyword(p, S("false")))
+            return json_error(p);
+        return VALUE_FALSE;
+
+        case 'n':
+        if (!json_keyword(p, S("null")))
+            return json_error(p);
+        return VALUE_NONE;
     }
 
-    return true;
+    return json_parse_number(p);
 }
 
-static Value value_select(Value set, Value key, Error *err)
+// Parses a JSON document into runtime values allocated
+// from the arena. Strings that don't contain escape
+// sequences refer to the source text.
+static Value json_parse(String src, WL_Arena *arena, Error *err)
 {
-    Type t = value_type(set);
-    if (t != TYPE_MAP && t != TYPE_ARRAY) {
-        REPORT(err, "Invalid selection from non-map and non-array value");
+    JSONParser p = { src.ptr, src.len, 0, 0, arena, err };
+
+    Value v = json_parse_value(&p);
+    if (v == VALUE_ERROR)
         return VALUE_ERROR;
-    }
-    AggregateValue *agg = (void*) (set & ~(Value) 7);
 
-    Value *dst = aggregate_select(agg, key);
-    if (dst) return *dst;
+    json_skip_space(&p);
+    if (p.cur < p.len)
+        return json_error(&p);
 
-    if (agg->type == TYPE_ARRAY && value_type(key) != TYPE_INT) {
-        REPORT(err, "Invalid index used in array access");
-        return VALUE_ERROR;
-    }
+    return v;
+}
 
-    char key_buf[1<<8];
-    int key_len = value_convert_to_str(key, key_buf, SIZEOF(key_buf));
-    if (key_len > SIZEOF(key_buf)-1)
-        key_len = SIZEOF(key_buf)-1;
-    key_buf[key_len] = '\0';
+/////////////////////////////////////////////////////////////////////////
+// RUNTIME
+/////////////////////////////////////////////////////////////////////////
 
-    char set_buf[1<<8];
-    int set_len = value_convert_to_str(set, set_buf, SIZEOF(set_buf));
-    if (set_len > SIZEOF(set_buf)-1)
-        set_len = SIZEOF(set_buf)-1;
-    set_buf[set_len] = '\0';
+// Default limits of the value stack (variables and
+// temporaries) and of the call stack. Both start out
+// small and grow on demand up to the limit.
+#define MAX_STACK 1024
+#define MAX_FRAMES 1024
+#define MAX_GROUPS 8
+#define MAX_KEPT 32
 
-    REPORT(err, "Invalid key '%s' used in access to map '%s'", key_buf, set_buf);
-    return VALUE_ERROR;
-}
+#define INITIAL_STACK  64
+#define INITIAL_FRAMES 8
 
-static Value value_select_by_index(Value set, int64_t idx, Error *err)
+typedef struct {
+    int retaddr;
+    int varbase;
+    int room; // Values the frame can push without checking the stack
+} Frame;
+
+typedef enum {
+    RUNTIME_BEGIN,
+    RUNTIME_LOOP,
+    RUNTIME_DONE,
+    RUNTIME_ERROR,
+    RUNTIME_OUTPUT,
+    RUNTIME_SYSVAR,
+    RUNTIME_SYSCALL,
+} RuntimeState;
+
+// Before a program is executed, its code section is
+// decoded into an array of fixed-width instructions.
+// Operands are stored in their native type so that the
+// interpreter doesn't need to unpack them, jump targets
+// are converted to instruction indices, and string
+// operands are resolved to pointers into the data section.
+// String constants pushed by PUSHS are turned into string
+// values borrowing the data section, so that pushing them
+// doesn't allocate or copy anything. The "w" field of VARS
+// holds the stack room of the procedure it starts (see
+// measure_stack).
+typedef struct {
+    uint8_t  op;
+    uint8_t  b[3];
+    uint32_t w;
+    union {
+        int64_t i;
+        double  f;
+        String  s;
+        Value   v;
+        struct {
+            WL_NativeFunc func;
+            void*         data;
+        } n;
+    };
+} Instr;
+
+struct WL_PreparedProgram {
+    String    bytecode;
+    String    data;
+    Instr    *code;
+    uint32_t *offs; // Offset of each instruction in the original code section
+    int       num_instrs;
+};
+
+static int decode_instr(char *src, int len, String data, Instr *ins)
 {
-    Type t = value_type(set);
-    if (t != TYPE_MAP && t != TYPE_ARRAY) {
-        REPORT(err, "Invalid selection from non-map and non-array value");
-        return VALUE_ERROR;
-    }
-    AggregateValue *agg = (void*) (set & ~(Value) 7);
+    uint32_t w0;
+    uint32_t w1;
+
+    if (len == 0)
+        return -1;
+    *ins = (Instr) { .op=src[0] };
+
+    switch (src[0]) {
+
+        case OPCODE_NOPE:
+        case OPCODE_OUTPUT:
+        case OPCODE_RET:
+        case OPCODE_GROUP:
+        case OPCODE_ESCAPE:
+        case OPCODE_PACK:
+        case OPCODE_GPOP:
+        case OPCODE_EXIT:
+        case OPCODE_POP:
+        case OPCODE_PUSHN:
+        case OPCODE_PUSHT:
+        case OPCODE_PUSHFL:
+        case OPCODE_LEN:
+        case OPCODE_NEG:
+        case OPCODE_EQL:
+        case OPCODE_NQL:
+        case OPCODE_LSS:
+        case OPCODE_GRT:
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_MOD:
+        case OPCODE_APPEND:
+        case OPCODE_INSERT1:
+        case OPCODE_INSERT2:
+        case OPCODE_SELECT:
+        return 1;
+
+        case OPCODE_VARS:
+        case OPCODE_SETV:
+        case OPCODE_SETVP:
+        case OPCODE_PUSHV:
+        case OPCODE_MARK:
+        if (len < 2) return -1;
+        memcpy(&ins->b[0], src + 1, sizeof(uint8_t));
+        return 2;
+
+        case OPCODE_JUMP:
+        case OPCODE_JIFP:
+        case OPCODE_PUSHA:
+        case OPCODE_PUSHM:
+        if (len < 5) return -1;
+        memcpy(&ins->w, src + 1, sizeof(uint32_t));
+        return 5;
+
+        case OPCODE_CALL:
+        case OPCODE_TAIL:
+        if (len < 6) return -1;
+        memcpy(&ins->b[0], src + 1, sizeof(uint8_t));
+        memcpy(&ins->w,    src + 2, sizeof(uint32_t));
+        return 6;
+
+        case OPCODE_FOR:
+        if (len < 8) return -1;
+        memcpy(&ins->b[0], src + 1, sizeof(uint8_t));
+        memcpy(&ins->b[1], src + 2, sizeof(uint8_t));
+        memcpy(&ins->b[2], src + 3, sizeof(uint8_t));
+        memcpy(&ins->w,    src + 4, sizeof(uint32_t));
+        return 8;
+
+        case OPCODE_PUSHI:
+        if (len < 9) return -1;
+        memcpy(&ins->i, src + 1, sizeof(int64_t));
+        return 9;
+
+        case OPCODE_PUSHF:
+        if (len < 9) return -1;
+        memcpy(&ins->f, src + 1, sizeof(double));
+        return 9;
+
+        case OPCODE_ADDVV:
+        case OPCODE_RESET:
+        if (len < 3) return -1;
+        memcpy(&ins->b[0], src + 1, sizeof(uint8_t));
+        memcpy(&ins->b[1], src + 2, sizeof(uint8_t));
+        return 3;
 
-    if (agg->type == TYPE_MAP)
-        idx *= 2;
+        case OPCODE_SETVI:
+        if (len < 10) return -1;
+        memcpy(&ins->b[0], src + 1, sizeof(uint8_t));
+        memcpy(&ins->i,    src + 2, sizeof(int64_t));
+        return 10;
 
-    Value *src = aggregate_select_by_raw_index(agg, idx);
-    if (src == NULL) {
-        REPORT(err, "Invalid selection from non-map and non-array value");
-        return VALUE_ERROR;
+        case OPCODE_SYSVAR:
+        case OPCODE_PUSHS:
+        case OPCODE_PUSHH:
+        case OPCODE_PUSHK:
+        case OPCODE_SELS:
+        if (len < 9) return -1;
+        memcpy(&w0, src + 1, sizeof(uint32_t));
+        memcpy(&w1, src + 5, sizeof(uint32_t));
+        if (w0 > (uint32_t) data.len || w1 > (uint32_t) data.len - w0)
+            return -1;
+        ins->s = (String) { data.ptr + w0, w1 };
+        return 9;
+
+        case OPCODE_SYSCALL:
+        if (len < 10) return -1;
+        memcpy(&ins->b[0], src + 1, sizeof(uint8_t));
+        memcpy(&w0, src + 2, sizeof(uint32_t));
+        memcpy(&w1, src + 6, sizeof(uint32_t));
+        if (w0 > (uint32_t) data.len || w1 > (uint32_t) data.len - w0)
+            return -1;
+        ins->s = (String) { data.ptr + w0, w1 };
+        return 10;
+
+        case OPCODE_NVAR:
+        case OPCODE_NCALL:
+        {
+            int n = (src[0] == OPCODE_NCALL) ? 1 : 0;
+            if (len < 9 + n) return -1;
+            memcpy(&ins->b[0], src + 1, n);
+            memcpy(&w0, src + 1 + n, sizeof(uint32_t));
+            memcpy(&w1, src + 5 + n, sizeof(uint32_t));
+            if (w0 > (uint32_t) data.len || w1 > (uint32_t) data.len - w0)
+                return -1;
+            ins->s = (String) { data.ptr + w0, w1 };
+            return 9 + n;
+        }
     }
 
-    return *src;
+    return -1;
 }
 
-static bool value_append(Value set, Value val, WL_Arena *arena, Error *err)
+// Builds the aggregate pushed by a PUSHK instruction from
+// its entry in the data section. Its storage is shared by
+// all runtimes and is never changed, so the hashes of the
+// strings are computed here.
+static Value prepare_const_aggregate(String src, WL_Arena *arena)
 {
-    Type t = value_type(set);
-    if (t != TYPE_ARRAY) {
-        REPORT(err, "Invalid append on non-array value");
-        return false;
-    }
-    AggregateValue *agg = (void*) (set & ~(Value) 7);
+    Error err = { NULL, 0, false };
 
-    if (!aggregate_append(agg, val, VALUE_ERROR, arena)) {
-        REPORT(err, "Out of memory");
-        return false;
-    }
+    if (src.len < 5)
+        return VALUE_ERROR;
 
-    return true;
-}
+    uint8_t  kind;
+    uint32_t count;
+    memcpy(&kind,  src.ptr + 0, sizeof(uint8_t));
+    memcpy(&count, src.ptr + 1, sizeof(uint32_t));
+    int cur = 5;
 
-static bool value_eql(Value a, Value b)
-{
-    Type t1 = value_type(a);
-    Type t2 = value_type(b);
+    // Each value takes at least one byte
+    if (kind > 1 || (kind == 1 && count % 2) || count > (uint32_t) (src.len - cur))
+        return VALUE_ERROR;
 
-    if (t1 != t2)
-        return false;
+    Value set;
+    if (kind == 1)
+        set = value_empty_map(count / 2, arena, &err);
+    else
+        set = value_empty_array(count, arena, &err);
+    if (set == VALUE_ERROR)
+        return VALUE_ERROR;
 
-    switch (t1) {
+    Value key = VALUE_NONE;
+    for (uint32_t i = 0; i < count; i++) {
 
-        case TYPE_NONE:
-        return true;
+        if (cur == src.len)
+            return VALUE_ERROR;
+        uint8_t tag = src.ptr[cur++];
 
-        case TYPE_BOOL:
-        return a == b;
+        Value v;
+        switch (tag) {
 
-        case TYPE_INT:
-        return value_to_s64(a) == value_to_s64(b);
+            case CONST_NONE : v = VALUE_NONE;  break;
+            case CONST_TRUE : v = VALUE_TRUE;  break;
+            case CONST_FALSE: v = VALUE_FALSE; break;
 
-        case TYPE_FLOAT:
-        return value_to_f64(a) == value_to_f64(b);
+            case CONST_INT:
+            {
+                int64_t x;
+                if (src.len - cur < SIZEOF(x))
+                    return VALUE_ERROR;
+                memcpy(&x, src.ptr + cur, sizeof(x));
+                cur += SIZEOF(x);
+                v = value_from_s64(x, arena, &err);
+            }
+            break;
 
-        case TYPE_MAP:
-        return false; // TODO
+            case CONST_FLOAT:
+            {
+                double x;
+                if (src.len - cur < SIZEOF(x))
+                    return VALUE_ERROR;
+                memcpy(&x, src.ptr + cur, sizeof(x));
+                cur += SIZEOF(x);
+                v = value_from_f64(x, arena, &err);
+            }
+            break;
 
-        case TYPE_ARRAY:
-        return false; // TODO
+            case CONST_STR:
+            case CONST_HTML:
+            {
+                uint32_t len;
+                if (src.len - cur < SIZEOF(len))
+                    return VALUE_ERROR;
+                memcpy(&len, src.ptr + cur, sizeof(len));
+                cur += SIZEOF(len);
+                if (len > (uint32_t) (src.len - cur))
+                    return VALUE_ERROR;
+                v = value_from_str_borrowed((String) { src.ptr + cur, len }, arena, &err);
+                cur += len;
+                if (v == VALUE_ERROR)
+                    return VALUE_ERROR;
+                value_hash(v);
+                if (tag == CONST_HTML)
+                    v |= FLAG_TRUSTED;
+            }
+            break;
 
-        case TYPE_STRING:
-        return streq(value_to_str(a), value_to_str(b));
+            default:
+            return VALUE_ERROR;
+        }
+        if (v == VALUE_ERROR)
+            return VALUE_ERROR;
 
-        case TYPE_ERROR:
-        return true;
+        // Duplicate map keys are handled by value_insert
+        // like when the literal is built at runtime
+        if (kind == 0) {
+            if (!value_append(set, v, arena, &err))
+                return VALUE_ERROR;
+        } else if (i % 2 == 0)
+            key = v;
+        else if (!value_insert(set, key, v, arena, &err))
+            return VALUE_ERROR;
     }
 
-    return false;
-}
+    if (cur != src.len)
+        return VALUE_ERROR;
 
-static bool value_nql(Value a, Value b)
-{
-    return !value_eql(a, b);
+    AggregateValue *agg = (void*) (set & PTR_MASK);
+    agg->shared = true;
+    return set;
 }
 
-#define TYPE_PAIR(X, Y) (((uint16_t) (X) << 16) | (uint16_t) (Y))
-
-bool value_greater(Value a, Value b, Error *err)
+// Returns the index of the instruction starting at the
+// given byte offset or -1 if no instruction starts there
+static int prepared_index(WL_PreparedProgram *p, uint32_t off)
 {
-    Type t1 = value_type(a);
-    Type t2 = value_type(b);
-    switch (TYPE_PAIR(t1, t2)) {
-        case TYPE_PAIR(TYPE_INT  , TYPE_INT  ): return value_to_s64(a) > value_to_s64(b);
-        case TYPE_PAIR(TYPE_INT  , TYPE_FLOAT): return value_to_s64(a) > value_to_f64(b);
-        case TYPE_PAIR(TYPE_FLOAT, TYPE_INT  ): return value_to_f64(a) > value_to_s64(b);
-        case TYPE_PAIR(TYPE_FLOAT, TYPE_FLOAT): return value_to_f64(a) > value_to_f64(b);
-        default:break;
+    int lo = 0;
+    int hi = p->num_instrs;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (p->offs[mid] == off)
+            return mid;
+        if (p->offs[mid] < off)
+            lo = mid+1;
+        else
+            hi = mid-1;
     }
-    REPORT(err, "Invalid '>' operation on non-numeric type");
-    return false;
+    return -1;
 }
 
-bool value_lower(Value a, Value b, Error *err)
-{
-    Type t1 = value_type(a);
-    Type t2 = value_type(b);
-    switch (TYPE_PAIR(t1, t2)) {
-        case TYPE_PAIR(TYPE_INT  , TYPE_INT  ): return value_to_s64(a) < value_to_s64(b);
-        case TYPE_PAIR(TYPE_INT  , TYPE_FLOAT): return value_to_s64(a) < value_to_f64(b);
-        case TYPE_PAIR(TYPE_FLOAT, TYPE_INT  ): return value_to_f64(a) < value_to_s64(b);
-        case TYPE_PAIR(TYPE_FLOAT, TYPE_FLOAT): return value_to_f64(a) < value_to_f64(b);
-        default:break;
-    }
-    REPORT(err, "Invalid '<' operation on non-numeric type");
-    return false;
-}
+// Code reached from the start of the program runs in the
+// global frame while code reached from CALL or TAIL runs
+// in the frame of a procedure
+#define REACH_GLOBAL 1
+#define REACH_PROC   2
+
+// What is known about the runtime state before an
+// instruction, whichever path led to it. "h[i]" is the
+// minimum number of values above the start of the i-th
+// open group (or of the frame for i = 0) and "vars" the
+// minimum number of variables of the frame. The bits of
+// "marks" are set for variables that hold an arena mark
+// written by MARK on every path, which are the only ones
+// RESET may use.
+typedef struct {
+    int      depth; // Open groups, or -1 if not reached yet
+    int      vars;
+    int      reach;
+    int      h[MAX_GROUPS+1];
+    uint32_t marks[8];
+} VerifyState;
 
-static Value value_neg(Value v, WL_Arena *arena, Error *err)
-{
-    Type t = value_type(v);
-    if (t == TYPE_INT)
-        return value_from_s64(-value_to_s64(v), arena, err); // TODO: overflow
+#define HAS_MARK(s, x) (((s)->marks[(x) >> 5] >> ((x) & 31)) & 1)
+#define SET_MARK(s, x) ((s)->marks[(x) >> 5] |=  (1u << ((x) & 31)))
+#define DEL_MARK(s, x) ((s)->marks[(x) >> 5] &= ~(1u << ((x) & 31)))
 
-    if (t == TYPE_FLOAT)
-        return value_from_f64(-value_to_f64(v), arena, err);
+typedef struct {
+    VerifyState *states;
+    bool        *queued;
+    int         *queue;
+    int          count;
+} Verifier;
+
+// Merges the state of one more path reaching instruction
+// "idx" and queues the instruction if anything changed.
+// Returns false if the paths disagree on the number of
+// open groups.
+static bool verify_merge(Verifier *v, int idx, VerifyState *s)
+{
+    VerifyState *dst = &v->states[idx];
+    bool changed = false;
+
+    if (dst->depth < 0) {
+        *dst = *s;
+        changed = true;
+    } else {
+        if (dst->depth != s->depth)
+            return false;
+        for (int i = 0; i <= s->depth; i++)
+            if (s->h[i] < dst->h[i]) {
+                dst->h[i] = s->h[i];
+                changed = true;
+            }
+        if (s->vars < dst->vars) {
+            dst->vars = s->vars;
+            changed = true;
+        }
+        if ((s->reach | dst->reach) != dst->reach) {
+            dst->reach |= s->reach;
+            changed = true;
+        }
+        for (int i = 0; i < COUNT(s->marks); i++)
+            if ((s->marks[i] & dst->marks[i]) != dst->marks[i]) {
+                dst->marks[i] &= s->marks[i];
+                changed = true;
+            }
+    }
 
-    REPORT(err, "Invalid '-' operation on non-numeric type");
-    return VALUE_ERROR;
+    if (changed && !v->queued[idx]) {
+        v->queued[idx] = true;
+        v->queue[v->count++] = idx;
+    }
+    return true;
 }
 
-static Value value_add(Value v1, Value v2, WL_Arena *arena, Error *err)
+// Applies the effect of an instruction to the state of
+// the path going through it. Returns false if the
+// instruction could read or write outside of the stack,
+// the open groups or the variables of the frame.
+static bool verify_instr(Instr *ins, VerifyState *s)
 {
-    Type t1 = value_type(v1);
-    Type t2 = value_type(v2);
+    int pop  = 0;
+    int push = 0;
 
-    Value r;
-    switch (TYPE_PAIR(t1, t2)) {
+    // Variables accessed and number of live variables
+    // for RESET
+    int vars[3];
+    int num_vars = 0;
 
-        case TYPE_PAIR(TYPE_INT, TYPE_INT):
-        {
-            int64_t u = value_to_s64(v1);
-            int64_t v = value_to_s64(v2);
-            // TODO: check overflow and underflow
-            r = value_from_s64(u + v, arena, err);
-        }
-        break;
+    switch (ins->op) {
 
-        case TYPE_PAIR(TYPE_INT, TYPE_FLOAT):
-        {
-            double u = (double) value_to_s64(v1);
-            double v = value_to_f64(v2);
-            r = value_from_f64(u + v, arena, err);
-        }
+        case OPCODE_NOPE:
+        case OPCODE_JUMP:
+        case OPCODE_EXIT:
         break;
 
-        case TYPE_PAIR(TYPE_FLOAT, TYPE_INT):
-        {
-            double u = value_to_f64(v1);
-            double v = (double) value_to_s64(v2);
-            r = value_from_f64(u + v, arena, err);
-        }
+        case OPCODE_VARS:
+        s->vars = ins->b[0];
+        memset(s->marks, 0, sizeof(s->marks));
         break;
 
-        case TYPE_PAIR(TYPE_FLOAT, TYPE_FLOAT):
-        {
-            double u = value_to_f64(v1);
-            double v = value_to_f64(v2);
-            // TODO: check overflow and underflow
-            r = value_from_f64(u + v, arena, err);
-        }
+        case OPCODE_OUTPUT:
+        // Output takes all values on the stack, so it can
+        // only be used by the global frame outside of groups
+        if (s->reach != REACH_GLOBAL || s->depth > 0)
+            return false;
+        s->h[0] = 0;
         break;
 
-        default:
-        REPORT(err, "Invalid operation '+' on non-numeric value");
-        return VALUE_ERROR;
-    }
-
-    return r;
-}
-
-static Value value_sub(Value v1, Value v2, WL_Arena *arena, Error *err)
-{
-    Type t1 = value_type(v1);
-    Type t2 = value_type(v2);
-
-    Value r;
-    switch (TYPE_PAIR(t1, t2)) {
-
-        case TYPE_PAIR(TYPE_INT, TYPE_INT):
-        {
-            int64_t u = value_to_s64(v1);
-            int64_t v = value_to_s64(v2);
-            // TODO: check overflow and underflow
-            r = value_from_s64(u - v, arena, err);
-        }
+        case OPCODE_SYSVAR:
+        case OPCODE_NVAR:
+        push = 1;
         break;
 
-        case TYPE_PAIR(TYPE_INT, TYPE_FLOAT):
-        {
-            double u = (double) value_to_s64(v1);
-            double v = value_to_f64(v2);
-            r = value_from_f64(u - v, arena, err);
-        }
+        // The number of values produced by calls isn't
+        // known, but it can't be negative
+        case OPCODE_SYSCALL:
+        case OPCODE_NCALL:
+        case OPCODE_CALL:
+        pop = ins->b[0];
         break;
 
-        case TYPE_PAIR(TYPE_FLOAT, TYPE_INT):
-        {
-            double u = value_to_f64(v1);
-            double v = (double) value_to_s64(v2);
-            r = value_from_f64(u - v, arena, err);
-        }
+        case OPCODE_TAIL:
+        if (s->reach != REACH_PROC || s->depth > 0 || ins->b[0] > s->vars)
+            return false;
+        pop = ins->b[0];
+        for (int i = 0; i < ins->b[0]; i++)
+            DEL_MARK(s, i);
         break;
 
-        case TYPE_PAIR(TYPE_FLOAT, TYPE_FLOAT):
-        {
-            double u = value_to_f64(v1);
-            double v = value_to_f64(v2);
-            // TODO: check overflow and underflow
-            r = value_from_f64(u - v, arena, err);
-        }
+        case OPCODE_RET:
+        if (s->reach != REACH_PROC || s->depth > 0)
+            return false;
         break;
 
-        default:
-        REPORT(err, "Invalid operation '-' on non-numeric value");
-        return VALUE_ERROR;
-    }
-
-    return r;
-}
-
-static Value value_mul(Value v1, Value v2, WL_Arena *arena, Error *err)
-{
-    Type t1 = value_type(v1);
-    Type t2 = value_type(v2);
-
-    Value r;
-    switch (TYPE_PAIR(t1, t2)) {
-
-        case TYPE_PAIR(TYPE_INT, TYPE_INT):
-        {
-            int64_t u = value_to_s64(v1);
-            int64_t v = value_to_s64(v2);
-            // TODO: check overflow and underflow
-            r = value_from_s64(u * v, arena, err);
-        }
+        case OPCODE_GROUP:
+        if (s->depth == MAX_GROUPS)
+            return false;
+        s->h[++s->depth] = 0;
         break;
-
-        case TYPE_PAIR(TYPE_INT, TYPE_FLOAT):
-        {
-            double u = (double) value_to_s64(v1);
-            double v = value_to_f64(v2);
-            r = value_from_f64(u * v, arena, err);
-        }
+
+        case OPCODE_ESCAPE:
+        case OPCODE_PACK:
+        case OPCODE_GPOP:
+        if (s->depth == 0)
+            return false;
+        s->depth--;
+        if (ins->op == OPCODE_ESCAPE)
+            s->h[s->depth] += s->h[s->depth+1];
+        if (ins->op == OPCODE_PACK)
+            s->h[s->depth]++;
         break;
 
-        case TYPE_PAIR(TYPE_FLOAT, TYPE_INT):
-        {
-            double u = value_to_f64(v1);
-            double v = (double) value_to_s64(v2);
-            r = value_from_f64(u * v, arena, err);
-        }
+        case OPCODE_FOR:
+        vars[num_vars++] = ins->b[0];
+        vars[num_vars++] = ins->b[1];
+        vars[num_vars++] = ins->b[2];
+        DEL_MARK(s, ins->b[1]);
+        DEL_MARK(s, ins->b[2]);
         break;
 
-        case TYPE_PAIR(TYPE_FLOAT, TYPE_FLOAT):
-        {
-            double u = value_to_f64(v1);
-            double v = value_to_f64(v2);
-            // TODO: check overflow and underflow
-            r = value_from_f64(u * v, arena, err);
-        }
+        case OPCODE_POP:
+        case OPCODE_JIFP:
+        pop = 1;
         break;
 
-        default:
-        REPORT(err, "Invalid operation '*' on non-numeric value");
-        return VALUE_ERROR;
-    }
+        case OPCODE_SETV:
+        pop = 1;
+        push = 1;
+        vars[num_vars++] = ins->b[0];
+        DEL_MARK(s, ins->b[0]);
+        break;
 
-    return r;
-}
+        case OPCODE_SETVP:
+        pop = 1;
+        vars[num_vars++] = ins->b[0];
+        DEL_MARK(s, ins->b[0]);
+        break;
 
-static Value value_div(Value v1, Value v2, WL_Arena *arena, Error *err)
-{
-    Type t1 = value_type(v1);
-    Type t2 = value_type(v2);
+        case OPCODE_SETVI:
+        vars[num_vars++] = ins->b[0];
+        DEL_MARK(s, ins->b[0]);
+        break;
 
-    Value r;
-    switch (TYPE_PAIR(t1, t2)) {
+        case OPCODE_MARK:
+        vars[num_vars++] = ins->b[0];
+        SET_MARK(s, ins->b[0]);
+        break;
 
-        case TYPE_PAIR(TYPE_INT, TYPE_INT):
-        {
-            // TODO: check division by 0
+        case OPCODE_RESET:
+        // The arena can only be rewound to a position
+        // taken by MARK
+        vars[num_vars++] = ins->b[0];
+        if (ins->b[1] > s->vars || !HAS_MARK(s, ins->b[0]))
+            return false;
+        break;
 
-            int64_t u = value_to_s64(v1);
-            int64_t v = value_to_s64(v2);
-            r = value_from_s64(u / v, arena, err);
-        }
+        case OPCODE_PUSHV:
+        push = 1;
+        vars[num_vars++] = ins->b[0];
         break;
 
-        case TYPE_PAIR(TYPE_INT, TYPE_FLOAT):
-        {
-            // TODO: check division by 0
+        case OPCODE_ADDVV:
+        push = 1;
+        vars[num_vars++] = ins->b[0];
+        vars[num_vars++] = ins->b[1];
+        break;
 
-            double u = (double) value_to_s64(v1);
-            double v = value_to_f64(v2);
-            r = value_from_f64(u / v, arena, err);
-        }
+        case OPCODE_PUSHI:
+        case OPCODE_PUSHF:
+        case OPCODE_PUSHS:
+        case OPCODE_PUSHH:
+        case OPCODE_PUSHK:
+        case OPCODE_PUSHA:
+        case OPCODE_PUSHM:
+        case OPCODE_PUSHN:
+        case OPCODE_PUSHT:
+        case OPCODE_PUSHFL:
+        push = 1;
         break;
 
-        case TYPE_PAIR(TYPE_FLOAT, TYPE_INT):
-        {
-            // TODO: check division by 0
+        case OPCODE_LEN:
+        case OPCODE_NEG:
+        case OPCODE_SELS:
+        pop = 1;
+        push = 1;
+        break;
 
-            double u = value_to_f64(v1);
-            double v = (double) value_to_s64(v2);
-            r = value_from_f64(u / v, arena, err);
-        }
+        case OPCODE_EQL:
+        case OPCODE_NQL:
+        case OPCODE_LSS:
+        case OPCODE_GRT:
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_MOD:
+        case OPCODE_SELECT:
+        case OPCODE_APPEND:
+        pop = 2;
+        push = 1;
         break;
 
-        case TYPE_PAIR(TYPE_FLOAT, TYPE_FLOAT):
-        {
-            double u = value_to_f64(v1);
-            double v = value_to_f64(v2);
-            r = value_from_f64(u / v, arena, err);
-        }
+        case OPCODE_INSERT1:
+        case OPCODE_INSERT2:
+        pop = 3;
+        push = 1;
         break;
 
         default:
-        REPORT(err, "Invalid operation '/' on non-numeric value");
-        return VALUE_ERROR;
+        return false;
     }
 
-    return r;
+    for (int i = 0; i < num_vars; i++)
+        if (vars[i] >= s->vars)
+            return false;
+
+    if (s->h[s->depth] < pop)
+        return false;
+    s->h[s->depth] += push - pop;
+    return true;
 }
 
-static Value value_mod(Value v1, Value v2, WL_Arena *arena, Error *err)
+// Checks that a prepared program can't access memory
+// outside of the value stack, the groups and the frame
+// variables regardless of the values it operates on. Since
+// this holds for any path through the code, the runtime
+// doesn't need to check it for each instruction. The lower
+// bounds of each state only decrease as paths are merged,
+// so the analysis terminates.
+static bool verify_program(WL_PreparedProgram *p, WL_Arena *arena)
 {
-    Type t1 = value_type(v1);
-    Type t2 = value_type(v2);
+    int n = p->num_instrs + 1;
 
-    if (t1 != TYPE_INT || t2 != TYPE_INT) {
-        REPORT(err, "Invalid operation '%%' on non-integer value");
-        return VALUE_ERROR;
+    int mark = wl_arena_mark(arena);
+
+    Verifier v;
+    v.states = alloc(arena, n * SIZEOF(VerifyState), ALIGNOF(VerifyState));
+    v.queued = alloc(arena, n * SIZEOF(bool),        ALIGNOF(bool));
+    v.queue  = alloc(arena, n * SIZEOF(int),         ALIGNOF(int));
+    v.count  = 0;
+    if (v.states == NULL || v.queued == NULL || v.queue == NULL) {
+        wl_arena_reset_to(arena, mark);
+        return false;
+    }
+    for (int i = 0; i < n; i++) {
+        v.states[i].depth = -1;
+        v.queued[i] = false;
     }
 
-    int64_t u = value_to_s64(v1);
-    int64_t v = value_to_s64(v2);
-    Value r = value_from_s64(u % v, arena, err);
-    return r;
-}
+    bool ok = true;
 
-static void value_convert_to_str_inner(Writer *w, Value v)
-{
-    Type t = value_type(v);
-    switch (t) {
+    VerifyState entry = { .depth=0, .vars=0, .reach=REACH_GLOBAL };
+    verify_merge(&v, 0, &entry);
 
-        case TYPE_NONE:
-        break;
+    // Procedures start with a VARS instruction
+    entry.reach = REACH_PROC;
+    for (int i = 0; i < n && ok; i++) {
+        Instr *ins = &p->code[i];
+        if (ins->op == OPCODE_CALL || ins->op == OPCODE_TAIL) {
+            if (p->code[ins->w].op != OPCODE_VARS)
+                ok = false;
+            else
+                verify_merge(&v, ins->w, &entry);
+        }
+    }
 
-        case TYPE_BOOL:
-        write_text(w, v == VALUE_TRUE ? S("true") : S("false"));
-        break;
+    while (ok && v.count > 0) {
 
-        case TYPE_INT:
-        write_text_s64(w, value_to_s64(v));
-        break;
+        int idx = v.queue[--v.count];
+        v.queued[idx] = false;
 
-        case TYPE_FLOAT:
-        write_text_f64(w, value_to_f64(v));
-        break;
+        Instr *ins = &p->code[idx];
+        VerifyState s = v.states[idx];
+        if (!verify_instr(ins, &s)) {
+            ok = false;
+            break;
+        }
 
-        case TYPE_STRING:
-        write_text(w, value_to_str(v));
-        break;
+        switch (ins->op) {
 
-        case TYPE_ARRAY:
-        {
-            AggregateValue *agg = (void*) (v & ~(Value) 7);
-            for (int i = 0; i < agg->count; i++)
-                value_convert_to_str_inner(w, agg->vals[i]);
-            Extension *ext = agg->ext;
-            while (ext) {
-                for (int i = 0; i < ext->count; i++)
-                    value_convert_to_str_inner(w, ext->vals[i]);
-                ext = ext->next;
-            }
-        }
-        break;
+            case OPCODE_EXIT:
+            case OPCODE_RET:
+            case OPCODE_TAIL:
+            break;
 
-        case TYPE_MAP:
-        write_text(w, S("<map>"));
-        break;
+            case OPCODE_JUMP:
+            ok = verify_merge(&v, ins->w, &s);
+            break;
 
-        case TYPE_ERROR:
-        break;
+            case OPCODE_JIFP:
+            case OPCODE_FOR:
+            ok = verify_merge(&v, ins->w, &s) && verify_merge(&v, idx+1, &s);
+            break;
+
+            default:
+            // The last instruction is always EXIT
+            ok = verify_merge(&v, idx+1, &s);
+            break;
+        }
     }
-}
 
-static int value_convert_to_str(Value v, char *dst, int cap)
-{
-    Writer w = { dst, cap, 0};
-    value_convert_to_str_inner(&w, v);
-    return w.len;
+    wl_arena_reset_to(arena, mark);
+    return ok;
 }
 
-static Value value_escape_packed(Value v, WL_Arena *arena, Error *err);
+// Upper bound to the stack room of a procedure. Room is
+// only unbounded when the code loops without going back
+// through a stack check, which valid programs never do.
+#define MAX_STACK_ROOM (1<<16)
 
-static int array_escape(Value v, Value *out, int max, WL_Arena *arena, Error *err)
+// Net number of values an instruction adds to the stack,
+// for instructions that don't check the stack themselves
+static int stack_effect(Instr *ins)
 {
-    Value v2 = value_empty_array(value_length(v), arena, err);
-    if (v2 == VALUE_ERROR) return -1;
+    switch (ins->op) {
 
-    AggregateValue *src = (void*) (v  & ~(Value) 7);
+        case OPCODE_PUSHV:
+        case OPCODE_PUSHI:
+        case OPCODE_PUSHF:
+        case OPCODE_PUSHS:
+        case OPCODE_PUSHH:
+        case OPCODE_PUSHK:
+        case OPCODE_PUSHA:
+        case OPCODE_PUSHM:
+        case OPCODE_PUSHN:
+        case OPCODE_PUSHT:
+        case OPCODE_PUSHFL:
+        case OPCODE_ADDVV:
+        case OPCODE_PACK: // Pushes one value if the group was empty
+        return 1;
 
-    for (int i = 0; i < src->count; i++) {
+        case OPCODE_POP:
+        case OPCODE_JIFP:
+        case OPCODE_SETVP:
+        case OPCODE_EQL:
+        case OPCODE_NQL:
+        case OPCODE_LSS:
+        case OPCODE_GRT:
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_MOD:
+        case OPCODE_SELECT:
+        case OPCODE_APPEND:
+        return -1;
 
-        Value child = src->vals[i];
+        case OPCODE_INSERT1:
+        case OPCODE_INSERT2:
+        return -2;
+    }
+    return 0;
+}
 
-        Value escaped_child = value_escape_packed(child, arena, err);
-        if (escaped_child == VALUE_ERROR)
-            return -1;
+// Computes the stack room of each procedure (and of the
+// global code), which is the maximum number of values it
+// can push between two points where the runtime makes
+// sure the stack has that much room: entering the
+// procedure, returning from a call and jumping back at
+// the end of a loop iteration. Pushes in between don't
+// need to check the stack. The room is stored in the VARS
+// instruction of the procedure.
+//
+// The program must have been verified already.
+static bool measure_stack(WL_PreparedProgram *p, WL_Arena *arena)
+{
+    int n = p->num_instrs + 1;
 
-        if (!value_append(v2, escaped_child, arena, err))
-            return -1;
+    if (p->code[0].op != OPCODE_VARS)
+        return false;
+
+    int mark = wl_arena_mark(arena);
+
+    // Maximum number of values pushed since the last
+    // check before each instruction, or -1 if the
+    // instruction wasn't reached from the current entry
+    int  *height  = alloc(arena, n * SIZEOF(int),  ALIGNOF(int));
+    int  *visited = alloc(arena, n * SIZEOF(int),  ALIGNOF(int));
+    int  *queue   = alloc(arena, n * SIZEOF(int),  ALIGNOF(int));
+    bool *queued  = alloc(arena, n * SIZEOF(bool), ALIGNOF(bool));
+    bool *entry   = alloc(arena, n * SIZEOF(bool), ALIGNOF(bool));
+    if (height == NULL || visited == NULL || queue == NULL || queued == NULL || entry == NULL) {
+        wl_arena_reset_to(arena, mark);
+        return false;
+    }
+    for (int i = 0; i < n; i++) {
+        height[i] = -1;
+        queued[i] = false;
+        entry[i]  = false;
     }
-    Extension *ext = src->ext;
-    while (ext) {
-        for (int i = 0; i < ext->count; i++) {
 
-            Value child = src->vals[i];
+    // Procedures are the targets of CALL and TAIL and the
+    // verifier made sure they all start with VARS
+    entry[0] = true;
+    for (int i = 0; i < n; i++) {
+        Instr *ins = &p->code[i];
+        if (ins->op == OPCODE_CALL || ins->op == OPCODE_TAIL)
+            entry[ins->w] = true;
+    }
 
-            Value escaped_child = value_escape_packed(child, arena, err);
-            if (escaped_child == VALUE_ERROR)
-                return -1;
+    bool ok = true;
+    for (int start = 0; start < n && ok; start++) {
 
-            if (!value_append(v2, escaped_child, arena, err))
-                return -1;
-        }
-        ext = ext->next;
-    }
+        if (!entry[start])
+            continue;
 
-    if (max == 0)
-        return -1;
-    out[0] = v2;
-    return 1;
-}
+        int room = 0;
+        int num_visited = 0;
+        int count = 0;
 
-static int string_escape(Value v, Value *out, int max, WL_Arena *arena, Error *err)
-{
-    String s = value_to_str(v);
+        height[start] = 0;
+        visited[num_visited++] = start;
+        queue[count++] = start;
+        queued[start] = true;
 
-    int i = 0;
-    int num = 0;
-    for (;;) {
+        while (ok && count > 0) {
 
-        int off = i;
-        while (i < s.len
-            && s.ptr[i] != '<'
-            && s.ptr[i] != '>'
-            && s.ptr[i] != '&'
-            && s.ptr[i] != '"'
-            && s.ptr[i] != '\'')
-            i++;
-        String substr = { s.ptr + off, i - off };
+            int idx = queue[--count];
+            queued[idx] = false;
 
-        Value escaped_v = value_from_str(substr, arena, err); // TODO: don't copy the string
-        if (escaped_v == VALUE_ERROR) return -1;
+            Instr *ins = &p->code[idx];
 
-        if (num == max) {
-            REPORT(err, "Escape buffer limit reached");
-            return -1;
-        }
-        out[num++] = escaped_v;
+            int next = height[idx] + stack_effect(ins);
+            switch (ins->op) {
 
-        if (i == s.len) break;
+                // The stack is checked again once these return
+                case OPCODE_VARS:
+                case OPCODE_CALL:
+                case OPCODE_SYSVAR:
+                case OPCODE_SYSCALL:
+                case OPCODE_NVAR:
+                case OPCODE_NCALL:
+                next = 0;
+                break;
 
-        switch (s.ptr[i++]) {
-            case '<' : escaped_v = value_from_str(S("&lt;"),   arena, err); break; // TODO: don't come these strings
-            case '>' : escaped_v = value_from_str(S("&gt;"),   arena, err); break;
-            case '&' : escaped_v = value_from_str(S("&amp;"),  arena, err); break;
-            case '"' : escaped_v = value_from_str(S("&quot;"), arena, err); break;
-            case '\'': escaped_v = value_from_str(S("&#x27;"), arena, err); break;
-        }
-        if (escaped_v == VALUE_ERROR) return -1;
+                // Output leaves the stack empty
+                case OPCODE_OUTPUT:
+                next = 0;
+                break;
+            }
 
-        if (num == max) {
-            REPORT(err, "Escape buffer limit reached");
-            return -1;
+            if (next > room)
+                room = next;
+            if (room > MAX_STACK_ROOM) {
+                ok = false;
+                break;
+            }
+
+            int succ[2];
+            int num_succ = 0;
+            switch (ins->op) {
+
+                case OPCODE_EXIT:
+                case OPCODE_RET:
+                case OPCODE_TAIL:
+                break;
+
+                case OPCODE_JUMP:
+                // Jumping back checks the stack
+                if ((int) ins->w <= idx)
+                    next = 0;
+                succ[num_succ++] = ins->w;
+                break;
+
+                case OPCODE_JIFP:
+                case OPCODE_FOR:
+                succ[num_succ++] = ins->w;
+                succ[num_succ++] = idx+1;
+                break;
+
+                default:
+                succ[num_succ++] = idx+1;
+                break;
+            }
+
+            for (int i = 0; i < num_succ; i++) {
+                int j = succ[i];
+                if (height[j] >= next)
+                    continue;
+                if (height[j] < 0)
+                    visited[num_visited++] = j;
+                height[j] = next;
+                if (!queued[j]) {
+                    queued[j] = true;
+                    queue[count++] = j;
+                }
+            }
         }
-        out[num++] = escaped_v;
+
+        // Only reset what was reached so that each procedure
+        // costs as much as its own code
+        for (int i = 0; i < num_visited; i++)
+            height[visited[i]] = -1;
+
+        p->code[start].w = room;
     }
 
-    return num;
+    wl_arena_reset_to(arena, mark);
+    return ok;
 }
 
-static int value_escape(Value v, Value *out, int max, WL_Arena *arena, Error *err)
+static WL_PreparedProgram *prepare_program(WL_Arena *arena, WL_Program program, WL_Native *natives, int num_natives)
 {
-    Type t = value_type(v);
-
-    if (t == TYPE_ARRAY)
-        return array_escape(v, out, max, arena, err);
+    String code;
+    String data;
+    String syms;
+    if (!program_sections(program, &code, &data, &syms))
+        return NULL;
 
-    if (t == TYPE_STRING)
-        return string_escape(v, out, max, arena, err);
+    // Count the instructions
+    int num_instrs = 0;
+    for (int off = 0; off < code.len; ) {
+        Instr ins;
+        int ret = decode_instr(code.ptr + off, code.len - off, data, &ins);
+        if (ret < 0)
+            return NULL;
+        off += ret;
+        num_instrs++;
+    }
 
-    if (max < 1)
-        return -1;
-    out[0] = v;
-    return 1;
-}
+    WL_PreparedProgram *p = alloc(arena, SIZEOF(WL_PreparedProgram), ALIGNOF(WL_PreparedProgram));
+    if (p == NULL)
+        return NULL;
 
-static Value value_escape_packed(Value v, WL_Arena *arena, Error *err)
-{
-    Value tmp[32];
-    int num = value_escape(v, tmp, COUNT(tmp), arena, err);
-    if (num < 0) return VALUE_ERROR;
+    // An extra EXIT is appended so that the instruction
+    // array is always terminated and jumps to the end of
+    // the code section have a valid target.
+    p->bytecode = code;
+    p->data = data;
+    p->num_instrs = num_instrs;
+    p->code = alloc(arena, (num_instrs + 1) * SIZEOF(Instr),    ALIGNOF(Instr));
+    p->offs = alloc(arena, (num_instrs + 1) * SIZEOF(uint32_t), ALIGNOF(uint32_t));
+    if (p->code == NULL || p->offs == NULL)
+        return NULL;
 
-    Value escaped_v;
+    for (int i = 0, off = 0; i < num_instrs; i++) {
+        p->offs[i] = off;
+        off += decode_instr(code.ptr + off, code.len - off, data, &p->code[i]);
+    }
+    p->offs[num_instrs] = code.len;
+    p->code[num_instrs] = (Instr) { .op=OPCODE_EXIT };
 
-    if (num > 1) {
+    for (int i = 0; i < num_instrs; i++) {
+        Instr *ins = &p->code[i];
+        switch (ins->op) {
 
-        Value packed = value_empty_array(num, arena, err);
-        if (packed == VALUE_ERROR)
-            return VALUE_ERROR;
+            case OPCODE_PUSHS:
+            case OPCODE_PUSHH:
+            {
+                // The hash is computed here since the prepared
+                // program may be shared by multiple threads and
+                // must not be written to afterwards.
+                Error err = { NULL, 0, false };
+                Value v = value_from_str_borrowed(ins->s, arena, &err);
+                if (v == VALUE_ERROR)
+                    return NULL;
+                value_hash(v);
+                if (ins->op == OPCODE_PUSHH)
+                    v |= FLAG_TRUSTED;
+                ins->v = v;
+            }
+            break;
 
-        for (int j = 0; j < num; j++)
-            if (!value_append(packed, tmp[j], arena, err))
-                return VALUE_ERROR;
-        escaped_v = packed;
+            case OPCODE_PUSHK:
+            ins->v = prepare_const_aggregate(ins->s, arena);
+            if (ins->v == VALUE_ERROR)
+                return NULL;
+            break;
 
-    } else {
+            case OPCODE_NVAR:
+            case OPCODE_NCALL:
+            {
+                // The program only holds the name of the host
+                // function, so it can only be prepared if the
+                // host provides it
+                int j = 0;
+                while (j < num_natives && !streq(ins->s, (String) { natives[j].name.ptr, natives[j].name.len }))
+                    j++;
+                if (j == num_natives || natives[j].func == NULL)
+                    return NULL;
+                ins->n.func = natives[j].func;
+                ins->n.data = natives[j].data;
+            }
+            break;
 
-        ASSERT(num == 1);
-        escaped_v = tmp[0];
+            case OPCODE_JUMP:
+            case OPCODE_JIFP:
+            case OPCODE_CALL:
+            case OPCODE_TAIL:
+            case OPCODE_FOR:
+            {
+                int target = prepared_index(p, ins->w);
+                if (target < 0)
+                    return NULL;
+                ins->w = target;
+            }
+            break;
+        }
     }
 
-    return escaped_v;
-}
-
-#undef TYPE_PAIR
+    if (!verify_program(p, arena))
+        return NULL;
 
-/////////////////////////////////////////////////////////////////////////
-// RUNTIME
-/////////////////////////////////////////////////////////////////////////
+    if (!measure_stack(p, arena))
+        return NULL;
 
-#define MAX_STACK 1024
-#define MAX_FRAMES 1024
-#define MAX_GROUPS 8
+    return p;
+}
 
-typedef struct {
-    int retaddr;
-    int varbase;
-} Frame;
+WL_PreparedProgram *wl_program_prepare(WL_Arena *arena, WL_Program program)
+{
+    return wl_program_prepare_natives(arena, program, NULL, 0);
+}
 
-typedef enum {
-    RUNTIME_BEGIN,
-    RUNTIME_LOOP,
-    RUNTIME_DONE,
-    RUNTIME_ERROR,
-    RUNTIME_OUTPUT,
-    RUNTIME_SYSVAR,
-    RUNTIME_SYSCALL,
-} RuntimeState;
+// If the program can't be prepared, the memory of what was
+// built up to that point is given back to the arena
+WL_PreparedProgram *wl_program_prepare_natives(WL_Arena *arena, WL_Program program, WL_Native *natives, int num_natives)
+{
+    int mark = wl_arena_mark(arena);
+    WL_PreparedProgram *p = prepare_program(arena, program, natives, num_natives);
+    if (p == NULL)
+        wl_arena_reset_to(arena, mark);
+    return p;
+}
 
 struct WL_Runtime {
 
     RuntimeState state;
 
-    String code;
-    String data;
+    WL_PreparedProgram *program;
+    Instr *code;
     int off;
 
-    int vars;
-    int stack;
-    Value values[MAX_STACK];
-
-    int num_frames;
-    Frame frames[MAX_FRAMES];
+    // Variables are stored at the end of "values" and
+    // grow downwards while temporaries start from the
+    // beginning and grow upwards
+    int    vars;
+    int    stack;
+    int    base; // Variable base of the top frame
+    int    cap_values;
+    int    max_values;
+    Value *values;
+
+    int    num_frames;
+    int    cap_frames;
+    int    max_frames;
+    Frame *frames;
 
     int num_groups;
     int groups[MAX_GROUPS];
 
     WL_Arena *arena;
+    int       arena_mark; // Arena position right after the runtime was initialized
+
+    // Loop iterations free their memory on the back-edge
+    // (see rt_reclaim). "region" is the arena position at
+    // the start of the innermost running iteration and
+    // "pinned" the position below which memory can't be
+    // freed because an older aggregate was modified.
+    int region;
+    int pinned;
+
+    // Values kept by the host with wl_keep
+    int   num_kept;
+    Value kept[MAX_KEPT];
 
     char  msg[128];
     Error err;
 
+    // Error of the last call to wl_push_json
+    char  json_msg[128];
+    Error json_err;
+
     int stack_before_user;
     String str_for_user;
     int num_output;
     int cur_output;
-    char buf[128];
+    int cur_output_pos; // Position in the current value when escaping it
+    char buf[512];
+
+    // Output buffer set by wl_runtime_set_output. When
+    // "outbuf_flush" is set, the buffer was flushed before
+    // reporting an event which is still pending.
+    char  *outbuf;
+    int    outbuf_cap;
+    int    outbuf_len;
+    String outbuf_rem;
+    bool   outbuf_flush;
 };
 
 WL_Runtime *wl_runtime_init(WL_Arena *arena, WL_Program program)
 {
-    if (program.len < 3 * sizeof(uint32_t))
+    WL_PreparedProgram *p = wl_program_prepare(arena, program);
+    if (p == NULL)
         return NULL;
 
-    uint32_t magic;
-    uint32_t code_len;
-    uint32_t data_len;
+    return wl_runtime_init_prepared(arena, p);
+}
+
+static bool rt_begin(WL_Runtime *rt)
+{
+    // The stack is initially sized to hold the global
+    // variables plus some room for temporaries
+    int num_globals = 0;
+    if (rt->code[0].op == OPCODE_VARS)
+        num_globals = rt->code[0].b[0];
 
-    memcpy(&magic   , program.ptr + 0, sizeof(uint32_t));
-    memcpy(&code_len, program.ptr + 4, sizeof(uint32_t));
-    memcpy(&data_len, program.ptr + 8, sizeof(uint32_t));
+    rt->cap_values = MIN(num_globals + INITIAL_STACK, rt->max_values);
+    rt->cap_frames = MIN(INITIAL_FRAMES, rt->max_frames);
+    rt->values = alloc(rt->arena, rt->cap_values * SIZEOF(Value), ALIGNOF(Value));
+    rt->frames = alloc(rt->arena, rt->cap_frames * SIZEOF(Frame), ALIGNOF(Frame));
 
-    if (magic != WL_MAGIC)
-        return NULL;
+    rt->state      = RUNTIME_BEGIN;
+    rt->off        = 0;
+    rt->stack      = 0;
+    rt->vars       = rt->cap_values-1;
+    rt->num_frames = 0;
+    rt->num_groups = 0;
+    rt->num_output = 0;
+    rt->cur_output = 0;
+    rt->cur_output_pos = 0;
+    rt->region     = 0;
+    rt->pinned     = 0;
+    rt->num_kept   = 0;
+
+    rt->err = (Error) { rt->msg, SIZEOF(rt->msg), false };
+    rt->msg[0] = '\0';
+
+    rt->json_err = (Error) { rt->json_msg, SIZEOF(rt->json_msg), false };
+    rt->json_msg[0] = '\0';
+
+    rt->outbuf_len   = 0;
+    rt->outbuf_rem   = (String) { NULL, 0 };
+    rt->outbuf_flush = false;
+
+    if (rt->values == NULL || rt->frames == NULL) {
+        REPORT(&rt->err, "Out of memory");
+        rt->state = RUNTIME_ERROR;
+        return false;
+    }
+
+    rt->frames[rt->num_frames++] = (Frame) {
+        .retaddr = 0,
+        .varbase = rt->vars,
+        .room    = 0,
+    };
+    rt->base = rt->vars;
+    return true;
+}
+
+WL_Runtime *wl_runtime_init_prepared(WL_Arena *arena, WL_PreparedProgram *program)
+{
+    return wl_runtime_init_limits(arena, program, 0, 0);
+}
 
-    String code = { program.ptr + sizeof(uint32_t) * 3           , code_len };
-    String data = { program.ptr + sizeof(uint32_t) * 3 + code_len, data_len };
+WL_Runtime *wl_runtime_init_limits(WL_Arena *arena, WL_PreparedProgram *program, int max_stack, int max_frames)
+{
+    if (max_stack < 0 || max_frames < 0)
+        return NULL;
 
     WL_Runtime *rt = alloc(arena, SIZEOF(WL_Runtime), ALIGNOF(WL_Runtime));
     if (rt == NULL)
         return NULL;
 
     *rt = (WL_Runtime) {
-        .state      = RUNTIME_BEGIN,
-        .code       = code,
-        .data       = data,
-        .off        = 0,
-        .stack      = 0,
-        .vars       = MAX_STACK-1,
-        .num_frames = 0,
+        .program    = program,
+        .code       = program->code,
+        .max_values = max_stack  ? max_stack  : MAX_STACK,
+        .max_frames = max_frames ? max_frames : MAX_FRAMES,
         .arena      = arena,
-        .err        = { NULL, 0, false },
-    };
-    rt->err.buf = rt->msg;
-    rt->err.cap = SIZEOF(rt->msg);
-
-    rt->frames[rt->num_frames++] = (Frame) {
-        .retaddr = 0,
-        .varbase = rt->vars,
+        .arena_mark = wl_arena_mark(arena),
     };
+    if (!rt_begin(rt)) {
+        wl_arena_reset_to(arena, rt->arena_mark);
+        return NULL;
+    }
 
     return rt;
 }
 
+void wl_runtime_reset(WL_Runtime *rt)
+{
+    wl_arena_reset_to(rt->arena, rt->arena_mark);
+    rt_begin(rt);
+}
+
 WL_String wl_runtime_error(WL_Runtime *rt)
 {
     return rt->err.yes
@@ -4739,100 +8133,175 @@ WL_String wl_runtime_error(WL_Runtime *rt)
         : (WL_String) { NULL, 0 };
 }
 
-static void rt_read_mem(WL_Runtime *r, void *dst, int len)
+WL_String wl_json_error(WL_Runtime *rt)
 {
-    ASSERT(r->off + len <= r->code.len);
-    memcpy(dst, r->code.ptr + r->off, len);
-    r->off += len;
+    return rt->json_err.yes
+        ? (WL_String) { rt->json_msg, strlen(rt->json_msg) }
+        : (WL_String) { NULL, 0 };
 }
 
-static uint8_t rt_read_u8(WL_Runtime *rt)
+// The program was verified by wl_program_prepare, so
+// variable indices are always lower than the number of
+// variables set up for the frame by VARS.
+static Value *rt_variable(WL_Runtime *rt, uint8_t x)
 {
-    ASSERT(rt->state == RUNTIME_LOOP);
-
-    uint8_t x;
-    rt_read_mem(rt, &x, SIZEOF(x));
-
-    return x;
+    ASSERT(rt->base - x > rt->vars && rt->base < rt->cap_values);
+    return &rt->values[rt->base - x];
 }
 
-static uint32_t rt_read_u32(WL_Runtime *rt)
+// Returns true if the value refers to an object allocated
+// from the runtime's arena at or after position "mark".
+static bool rt_allocated_after(WL_Runtime *rt, Value v, int mark)
 {
-    ASSERT(rt->state == RUNTIME_LOOP);
+    if ((v & BOX_MASK) != BOX_MASK)
+        return false;
+
+    switch ((v >> 48) & 7) {
+        case TAG_STRING:
+        case TAG_ARRAY:
+        case TAG_MAP:
+        case TAG_BIGINT:
+        break;
 
-    uint32_t x;
-    rt_read_mem(rt, &x, SIZEOF(x));
+        default:
+        return false;
+    }
 
-    return x;
+    return arena_allocated_after(rt->arena, (void*) (uintptr_t) (v & PTR_MASK), mark);
 }
 
-static int64_t rt_read_s64(WL_Runtime *rt)
+// Must be called after an aggregate is modified. If the
+// aggregate is older than the current loop iteration, it
+// may now refer to memory allocated by it, so everything
+// allocated up to this point must be kept.
+static void rt_write_barrier(WL_Runtime *rt, Value set)
 {
-    ASSERT(rt->state == RUNTIME_LOOP);
-
-    int64_t x;
-    rt_read_mem(rt, &x, SIZEOF(x));
-
-    return x;
+    if (!rt_allocated_after(rt, set, rt->region))
+        rt->pinned = wl_arena_mark(rt->arena);
 }
 
-static double rt_read_f64(WL_Runtime *rt)
+// Called at the end of a loop iteration. The first
+// "num_live" variables of the frame are the ones declared
+// outside of the loop's body, which are the only ones
+// (other than the stack) that can hold values produced
+// by the iteration. Variables declared by the body are
+// assigned before use in the next iteration. If none
+// of them refer to memory allocated after the mark, the
+// arena is rewound to it.
+static void rt_reclaim(WL_Runtime *rt, uint8_t mark_var, uint8_t num_live)
 {
-    ASSERT(rt->state == RUNTIME_LOOP);
+    int mark = (int) value_to_s64(*rt_variable(rt, mark_var));
+    if (mark < rt->pinned)
+        mark = rt->pinned;
+    if (mark < rt->arena_mark)
+        mark = rt->arena_mark;
+    if (mark >= wl_arena_mark(rt->arena))
+        return;
 
-    double x;
-    rt_read_mem(rt, &x, SIZEOF(x));
+    for (int i = 0; i < num_live; i++)
+        if (rt_allocated_after(rt, *rt_variable(rt, i), mark))
+            return;
 
-    return x;
+    for (int i = 0; i < rt->stack; i++)
+        if (rt_allocated_after(rt, rt->values[i], mark))
+            return;
+
+    wl_arena_reset_to(rt->arena, mark);
+}
+
+static int values_usage(WL_Runtime *rt)
+{
+    int num_vars = (rt->cap_values - rt->vars - 1);
+    return rt->stack + num_vars;
 }
 
-static String rt_read_str(WL_Runtime *rt)
+// Since the stack and call stack are allocated from the
+// arena, they must not be freed by the reclamation of
+// loop iterations after they are grown.
+static void rt_pin_stack(WL_Runtime *rt)
 {
-    ASSERT(rt->state == RUNTIME_LOOP);
-    uint32_t off = rt_read_u32(rt);
-    uint32_t len = rt_read_u32(rt);
-    ASSERT(off + len <= (uint32_t) rt->data.len);
-    return (String) { rt->data.ptr + off, len };
+    rt->pinned = wl_arena_mark(rt->arena);
 }
 
-static Value *rt_variable(WL_Runtime *rt, uint8_t x)
+// Grows the value stack to hold at least "need" values.
+// Variables are moved to the end of the new storage, so
+// all variable bases are shifted.
+static bool rt_grow_values(WL_Runtime *rt, int need)
 {
-    ASSERT(rt->num_frames > 0);
+    int old_cap = rt->cap_values;
+    int new_cap = MAX(need, 2 * old_cap);
+    if (new_cap > rt->max_values)
+        new_cap = rt->max_values;
 
-    Frame *frame = &rt->frames[rt->num_frames-1];
+    Value *values;
+    char *end = (char*) (rt->values + old_cap);
+    if (end == rt->arena->ptr + rt->arena->cur)
+        values = grow_alloc(rt->arena, rt->values, old_cap * SIZEOF(Value), new_cap * SIZEOF(Value));
+    else {
+        values = alloc(rt->arena, new_cap * SIZEOF(Value), ALIGNOF(Value));
+        if (values)
+            memcpy(values, rt->values, old_cap * SIZEOF(Value));
+    }
+    if (values == NULL)
+        return false;
+
+    int shift = new_cap - old_cap;
+    int num_vars = old_cap - rt->vars - 1;
+    memmove(values + rt->vars + 1 + shift, values + rt->vars + 1, num_vars * SIZEOF(Value));
 
-    ASSERT(frame->varbase - x >= 0
-        && frame->varbase - x < MAX_STACK);
+    rt->vars += shift;
+    rt->base += shift;
+    for (int i = 0; i < rt->num_frames; i++)
+        rt->frames[i].varbase += shift;
 
-    return &rt->values[frame->varbase - x];
+    rt->values = values;
+    rt->cap_values = new_cap;
+    rt_pin_stack(rt);
+    return true;
 }
 
-static int values_usage(WL_Runtime *rt)
+static bool rt_check_stack(WL_Runtime *rt, int min)
 {
-    int num_vars = (MAX_STACK - rt->vars - 1);
-    return rt->stack + num_vars;
+    if (rt->cap_values - values_usage(rt) < min) {
+        if (rt->max_values - values_usage(rt) < min) {
+            REPORT(&rt->err, "Out of stack");
+            rt->state = RUNTIME_ERROR;
+            return false;
+        }
+        if (!rt_grow_values(rt, values_usage(rt) + min)) {
+            REPORT(&rt->err, "Out of memory");
+            rt->state = RUNTIME_ERROR;
+            return false;
+        }
+    }
+    return true;
 }
 
-static bool rt_check_stack(WL_Runtime *rt, int min)
+static bool rt_grow_frames(WL_Runtime *rt)
 {
-    if (MAX_STACK - values_usage(rt) < min) {
-        REPORT(&rt->err, "Out of stack");
-        rt->state = RUNTIME_ERROR;
+    int new_cap = MIN(2 * rt->cap_frames, rt->max_frames);
+
+    Frame *frames = alloc(rt->arena, new_cap * SIZEOF(Frame), ALIGNOF(Frame));
+    if (frames == NULL)
         return false;
-    }
+    memcpy(frames, rt->frames, rt->num_frames * SIZEOF(Frame));
+
+    rt->frames = frames;
+    rt->cap_frames = new_cap;
+    rt_pin_stack(rt);
     return true;
 }
 
 static bool rt_push_frame(WL_Runtime *rt, uint8_t args)
 {
-    if (rt->num_frames == MAX_FRAMES) {
+    if (rt->num_frames == rt->max_frames) {
         REPORT(&rt->err, "Call stack limit reached");
         rt->state = RUNTIME_ERROR;
         return false;
     }
 
-    if (MAX_STACK - values_usage(rt) < args) {
-        REPORT(&rt->err, "Stack limit reached");
+    if (rt->num_frames == rt->cap_frames && !rt_grow_frames(rt)) {
+        REPORT(&rt->err, "Out of memory");
         rt->state = RUNTIME_ERROR;
         return false;
     }
@@ -4840,6 +8309,8 @@ static bool rt_push_frame(WL_Runtime *rt, uint8_t args)
     Frame *frame = &rt->frames[rt->num_frames++];
     frame->retaddr = rt->off;
     frame->varbase = rt->vars;
+    frame->room    = 0;
+    rt->base = rt->vars;
 
     for (int i = 0; i < args; i++)
         rt->values[rt->vars--] = rt->values[--rt->stack];
@@ -4854,17 +8325,75 @@ static void rt_pop_frame(WL_Runtime *rt)
     rt->off  = frame->retaddr;
     rt->vars = frame->varbase;
     rt->num_frames--;
+    if (rt->num_frames > 0)
+        rt->base = rt->frames[rt->num_frames-1].varbase;
 }
 
-static void rt_set_frame_vars(WL_Runtime *rt, uint8_t num)
+// Makes sure the stack can hold what the current frame
+// may push before it's checked again (see measure_stack)
+static bool rt_check_room(WL_Runtime *rt)
 {
-    ASSERT(rt->num_frames > 0);
-    Frame *frame = &rt->frames[rt->num_frames-1];
-    int num_vars = frame->varbase - rt->vars;
-    if (num_vars < num)
-        for (int i = 0; i < num - num_vars; i++)
-            rt->values[rt->vars - i] = VALUE_NONE;
-    rt->vars = frame->varbase - num;
+    return rt_check_stack(rt, rt->frames[rt->num_frames-1].room);
+}
+
+// Sets up the "num" variables of the current frame and
+// the room for the temporaries pushed by its code
+static bool rt_set_frame_vars(WL_Runtime *rt, uint8_t num, int room)
+{
+    int num_vars = rt->base - rt->vars;
+    int added = MAX(num - num_vars, 0);
+    if (!rt_check_stack(rt, added + room))
+        return false;
+    for (int i = 0; i < added; i++)
+        rt->values[rt->vars - i] = VALUE_NONE;
+    rt->vars = rt->base - num;
+    rt->frames[rt->num_frames-1].room = room;
+    return true;
+}
+
+// Completes a SYSVAR or SYSCALL after the host (or the
+// native function) pushed its results
+static bool rt_return_from_user(WL_Runtime *rt)
+{
+    ASSERT(rt->stack >= rt->stack_before_user);
+
+    if (rt->state == RUNTIME_SYSVAR) {
+
+        int pushed_by_user = rt->stack - rt->stack_before_user;
+        if (pushed_by_user > 1) {
+            REPORT(&rt->err, "Invalid API usage");
+            rt->state = RUNTIME_ERROR;
+            return false;
+        }
+
+        if (rt->stack == rt->stack_before_user) {
+            // User didn't push anything on the stack
+            if (!rt_check_stack(rt, 1))
+                return false;
+            rt->values[rt->stack++] = VALUE_NONE;
+        }
+    }
+
+    rt_pop_frame(rt);
+    return rt_check_room(rt);
+}
+
+// Calls a function bound with wl_compiler_bind_native
+// in place of a SYSVAR or SYSCALL event
+static bool rt_call_native(WL_Runtime *rt, Instr *ins, uint8_t args, RuntimeState state)
+{
+    if (!rt_push_frame(rt, args))
+        return false;
+    rt->stack_before_user = rt->stack;
+    rt->str_for_user = (String) { NULL, 0 };
+    rt->state = state;
+
+    ins->n.func(rt, ins->n.data);
+
+    if (rt->state == RUNTIME_ERROR || !rt_return_from_user(rt))
+        return false;
+    rt->state = RUNTIME_LOOP;
+    return true;
 }
 
 static void rt_push_group(WL_Runtime *rt)
@@ -4879,22 +8408,23 @@ static void rt_push_group(WL_Runtime *rt)
 
 static void rt_pack_group(WL_Runtime *rt)
 {
-    if (!rt_check_stack(rt, 1))
-        return;
-
     ASSERT(rt->num_groups > 0);
     int start = rt->groups[--rt->num_groups];
     int end = rt->stack;
 
-    if (end - start > 1) {
+    // A group with a single value evaluates to the value
+    // itself and any other group to an array, so there is
+    // always exactly one result
+    if (end - start != 1) {
 
         Value set = value_empty_array(end - start, rt->arena, &rt->err);
         if (set == VALUE_ERROR)
             return;
 
-        for (int i = start; i < end; i++)
-            if (!value_append(set, rt->values[i], rt->arena, &rt->err))
-                return;
+        // The array was created with room for all values
+        AggregateValue *agg = (void*) (set & PTR_MASK);
+        memcpy(agg->vals, rt->values + start, (end - start) * SIZEOF(Value));
+        agg->count = end - start;
 
         rt->stack = start;
         rt->values[rt->stack++] = set;
@@ -4922,467 +8452,729 @@ static void value_print(Value v)
     fflush(stdout);
 }
 
-static void step(WL_Runtime *rt)
-{
-#if 0
-    {
-        printf("vars = [\n");
-        int top = rt->vars;
-        for (int i = 0; i < rt->num_frames; i++) {
-            printf("  frame %d [ ", i);
-            for (int j = 0; j < rt->frames[i].varbase - top; j++) {
-                switch (value_type(rt->values[top + j + 1])) {
-                    case TYPE_NONE  : printf("none");   break;
-                    case TYPE_BOOL  : printf("bool");   break;
-                    case TYPE_INT   : printf("int");    break;
-                    case TYPE_FLOAT : printf("float");  break;
-                    case TYPE_STRING: printf("string"); break;
-                    case TYPE_ARRAY : printf("array");  break;
-                    case TYPE_MAP   : printf("map");    break;
-                    case TYPE_ERROR : printf("error");  break;
-                }
-                printf(" ");
-            }
-            printf("]\n");
-            top = rt->frames[i].varbase;
-        }
-        printf("]\n");
-
-        printf("stack = [\n");
-        for (int i = 0; i < rt->stack; i++) {
-            printf("  ");
-            switch (value_type(rt->values[i])) {
-                case TYPE_NONE  : printf("none");   break;
-                case TYPE_BOOL  : printf("bool");   break;
-                case TYPE_INT   : printf("int");    break;
-                case TYPE_FLOAT : printf("float");  break;
-                case TYPE_STRING: printf("string"); break;
-                case TYPE_ARRAY : printf("array");  break;
-                case TYPE_MAP   : printf("map");    break;
-                case TYPE_ERROR : printf("error");  break;
+// Returns the next piece of text of the current OUTPUT
+// instruction and moves past it. Strings are returned as
+// they are while other values are formatted into rt->buf
+// starting at offset *used. If the text doesn't fit in what
+// is left of the buffer, 0 is returned, unless the buffer is
+// empty, in which case the text is formatted into arena memory.
+// On error, -1 is returned.
+//
+// Strings marked for escaping are returned in pieces that
+// alternate between runs of characters that don't need to
+// be escaped, which point into the string, and entities.
+static int rt_output_next(WL_Runtime *rt, int *used, String *out)
+{
+    Value v = rt->values[rt->stack - rt->num_output + rt->cur_output];
+
+    if (value_type(v) == TYPE_STRING) {
+
+        String str = value_to_str(v);
+        if (v & FLAG_ESCAPE) {
+            int i = rt->cur_output_pos;
+            int j = escape_next(str, i);
+            if (j > i || j == str.len) {
+                *out = (String) { str.ptr + i, j - i };
+                rt->cur_output_pos = j;
+            } else {
+                *out = escape_entity(str.ptr[j]);
+                rt->cur_output_pos = j + 1;
             }
-            printf("\n");
-        }
-        printf("]\n");
-
-        char buf[1<<9];
-        Writer w = { .dst=buf, .cap=sizeof(buf), .len=0 };
-        write_instr(&w,
-            rt->code.ptr + rt->off,
-            rt->code.len - rt->off,
-            rt->data
-        );
-        printf("%d: %.*s", rt->off, w.len, w.dst);
+            if (rt->cur_output_pos < str.len)
+                return 1;
+        } else
+            *out = str;
 
-        printf("\n\n");
+        rt->cur_output_pos = 0;
+        rt->cur_output++;
+        return 1;
     }
-#endif
 
-    switch (rt_read_u8(rt)) {
+    char *dst = rt->buf + *used;
+    int   cap = SIZEOF(rt->buf) - *used;
 
-        Type t;
-        Value v1;
-        Value v2;
-        Value v3;
-        uint32_t o;
-        uint8_t  b1;
-        uint8_t  b2;
-        uint8_t  b3;
-        int64_t  i;
-        double   f;
-        String   s;
+    // Numbers are written using snprintf, which needs
+    // room for the null terminator
+    int len = value_convert_to_str(v, dst, cap);
+    if (len >= cap) {
 
-        case OPCODE_NOPE:
-        break;
-
-        case OPCODE_JUMP:
-        rt->off = rt_read_u32(rt);
-        break;
+        if (*used > 0)
+            return 0;
 
-        case OPCODE_JIFP:
-        ASSERT(rt->stack > 0);
-        o = rt_read_u32(rt);
-        v1 = rt->values[--rt->stack];
-        if (v1 == VALUE_FALSE)
-            rt->off = o;
-        else if (value_type(v1) != TYPE_BOOL) {
-            REPORT(&rt->err, "Invalid non-boolean condition");
+        char *p = alloc(rt->arena, len+1, 1);
+        if (p == NULL) {
+            REPORT(&rt->err, "Out of memory");
             rt->state = RUNTIME_ERROR;
-            break;
-        }
-        break;
-
-        case OPCODE_VARS:
-        b1 = rt_read_u8(rt);
-        rt_set_frame_vars(rt, b1);
-        break;
-
-        case OPCODE_OUTPUT:
-        if (rt->stack > 0) {
-            rt->cur_output = 0;
-            rt->num_output = rt->stack;
-            rt->state = RUNTIME_OUTPUT;
+            return -1;
         }
-        break;
+        len = value_convert_to_str(v, p, len+1);
+        *out = (String) { p, len };
+        rt->cur_output++;
+        return 1;
+    }
 
-        case OPCODE_SYSVAR:
-        s = rt_read_str(rt);
-        rt_push_frame(rt, 0);
-        rt->stack_before_user = rt->stack;
-        rt->str_for_user = s;
-        rt->state = RUNTIME_SYSVAR;
-        break;
+    *used += len;
+    *out = (String) { dst, len };
+    rt->cur_output++;
+    return 1;
+}
 
-        case OPCODE_SYSCALL:
-        b1 = rt_read_u8(rt);
-        s = rt_read_str(rt);
-        rt_push_frame(rt, b1);
-        rt->stack_before_user = rt->stack;
-        rt->str_for_user = s;
-        rt->state = RUNTIME_SYSCALL;
-        break;
+// Copies the values of the current OUTPUT instruction
+// into the output buffer set by wl_runtime_set_output.
+// Non-string values are formatted directly into it when
+// they fit. If a value doesn't fit, as much of it as
+// possible is copied and the rest is saved so that it can
+// be copied once the buffer is flushed, in which case false
+// is returned. Returns true when all values were copied
+// and false on error.
+static bool rt_buffer_output(WL_Runtime *rt)
+{
+    for (;;) {
 
-        case OPCODE_CALL:
-        b1 = rt_read_u8(rt);
-        o = rt_read_u32(rt);
-        rt_push_frame(rt, b1);
-        rt->off = o;
-        break;
+        if (rt->outbuf_rem.len > 0) {
+            int cpy = MIN(rt->outbuf_rem.len, rt->outbuf_cap - rt->outbuf_len);
+            memcpy(rt->outbuf + rt->outbuf_len, rt->outbuf_rem.ptr, cpy);
+            rt->outbuf_len += cpy;
+            rt->outbuf_rem.ptr += cpy;
+            rt->outbuf_rem.len -= cpy;
+            if (rt->outbuf_rem.len > 0)
+                return false;
+        }
 
-        case OPCODE_RET:
-        rt_pop_frame(rt);
-        break;
+        if (rt->cur_output == rt->num_output)
+            break;
 
-        case OPCODE_GROUP:
-        rt_push_group(rt);
-        break;
+        Value v = rt->values[rt->stack - rt->num_output + rt->cur_output];
 
-        case OPCODE_ESCAPE:
-        {
-            ASSERT(rt->num_groups > 0);
-            int start = rt->groups[--rt->num_groups];
-            int end = rt->stack;
-
-            Value escaped[256];
-            int num_escaped = 0;
-
-            for (int i = start; i < end; i++) {
-                Value v = rt->values[i];
-                int num = value_escape(v, escaped + num_escaped, COUNT(escaped) - num_escaped, rt->arena, &rt->err);
-                if (num < 0) break;
-                num_escaped += num;
+        if (value_type(v) != TYPE_STRING) {
+            char *dst = rt->outbuf     + rt->outbuf_len;
+            int   cap = rt->outbuf_cap - rt->outbuf_len;
+            int   len = value_convert_to_str(v, dst, cap);
+            if (len < cap) {
+                rt->outbuf_len += len;
+                rt->cur_output++;
+                continue;
             }
+        }
 
-            if (num_escaped > COUNT(escaped)) {
-                REPORT(&rt->err, "Escape buffer limit reached");
-                rt->state = RUNTIME_ERROR;
-                break;
-            }
+        int used = 0;
+        if (rt_output_next(rt, &used, &rt->outbuf_rem) < 0)
+            return false;
+    }
 
-            rt->stack = start;
-            if (!rt_check_stack(rt, num_escaped)) break;
+    return true;
+}
 
-            for (int i = 0; i < num_escaped; i++)
-                rt->values[rt->stack + i] = escaped[i];
-            rt->stack += num_escaped;
+#if 0
+static void rt_trace(WL_Runtime *rt)
+{
+    printf("vars = [\n");
+    int top = rt->vars;
+    for (int i = 0; i < rt->num_frames; i++) {
+        printf("  frame %d [ ", i);
+        for (int j = 0; j < rt->frames[i].varbase - top; j++) {
+            switch (value_type(rt->values[top + j + 1])) {
+                case TYPE_NONE  : printf("none");   break;
+                case TYPE_BOOL  : printf("bool");   break;
+                case TYPE_INT   : printf("int");    break;
+                case TYPE_FLOAT : printf("float");  break;
+                case TYPE_STRING: printf("string"); break;
+                case TYPE_ARRAY : printf("array");  break;
+                case TYPE_MAP   : printf("map");    break;
+                case TYPE_ERROR : printf("error");  break;
+            }
+            printf(" ");
         }
-        break;
-
-        case OPCODE_PACK:
-        rt_pack_group(rt);
-        break;
-
-        case OPCODE_GPOP:
-        rt_pop_group(rt);
-        break;
+        printf("]\n");
+        top = rt->frames[i].varbase;
+    }
+    printf("]\n");
+
+    printf("stack = [\n");
+    for (int i = 0; i < rt->stack; i++) {
+        printf("  ");
+        switch (value_type(rt->values[i])) {
+            case TYPE_NONE  : printf("none");   break;
+            case TYPE_BOOL  : printf("bool");   break;
+            case TYPE_INT   : printf("int");    break;
+            case TYPE_FLOAT : printf("float");  break;
+            case TYPE_STRING: printf("string"); break;
+            case TYPE_ARRAY : printf("array");  break;
+            case TYPE_MAP   : printf("map");    break;
+            case TYPE_ERROR : printf("error");  break;
+        }
+        printf("\n");
+    }
+    printf("]\n");
 
-        case OPCODE_FOR:
-        b1 = rt_read_u8(rt);
-        b2 = rt_read_u8(rt);
-        b3 = rt_read_u8(rt);
-        o  = rt_read_u32(rt);
+    char buf[1<<9];
+    Writer w = { .dst=buf, .cap=sizeof(buf), .len=0 };
+    uint32_t off = rt->program->offs[rt->off];
+    write_instr(&w,
+        rt->program->bytecode.ptr + off,
+        rt->program->bytecode.len - off,
+        rt->program->data
+    );
+    printf("%d: %.*s", off, w.len, w.dst);
 
-        v1 = *rt_variable(rt, b3);
-        ASSERT(value_type(v1) == TYPE_INT);
-        i = value_to_s64(v1);
+    printf("\n\n");
+}
+#endif
 
-        v2 = *rt_variable(rt, b1);
+// The interpreter loop is written in terms of the following
+// macros so that it can be compiled either as a switch or,
+// where the compiler supports labels as values, as a direct
+// threaded loop where every handler jumps straight to the
+// next one.
+//
+// Handlers end with:
+//
+//   NEXT       if the instruction can't fail or change the
+//              runtime state
+//
+//   NEXT_CHECK if the instruction may have reported an error
+//
+//   return     if the instruction changed the runtime state
+//              (output, external symbols, exit). Errors are
+//              picked up by wl_runtime_eval at that point.
+//
+// Defining WL_NO_COMPUTED_GOTO forces the switch version.
+
+#if defined(__GNUC__) && !defined(WL_NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
 
-        if (value_length(v2)-1 == i) {
-            rt->off = o;
-            break;
-        }
-        i++;
+#ifdef COMPUTED_GOTO
+#define DISPATCH                                    \
+    ins = &rt->code[rt->off++];                     \
+    goto *labels[ins->op];
+#define CASE(X)  op_##X:
+#define DEFAULT
+#define NEXT     DISPATCH
+#else
+#define DISPATCH                                    \
+    ins = &rt->code[rt->off++];                     \
+    switch (ins->op)
+#define CASE(X)  case OPCODE_##X:
+#define DEFAULT  default:
+#define NEXT     continue
+#endif
 
-        v1 = value_select_by_index(v2, i, &rt->err);
-        if (v1 == VALUE_ERROR) break;
+#define NEXT_CHECK                      \
+    if (rt->err.yes) {                  \
+        rt->state = RUNTIME_ERROR;      \
+        return;                         \
+    }                                   \
+    NEXT;
+
+static void run(WL_Runtime *rt)
+{
+#ifdef COMPUTED_GOTO
+    static void *labels[] = {
+        [OPCODE_NOPE]    = &&op_NOPE,
+        [OPCODE_JUMP]    = &&op_JUMP,
+        [OPCODE_JIFP]    = &&op_JIFP,
+        [OPCODE_OUTPUT]  = &&op_OUTPUT,
+        [OPCODE_SYSVAR]  = &&op_SYSVAR,
+        [OPCODE_SYSCALL] = &&op_SYSCALL,
+        [OPCODE_NVAR]    = &&op_NVAR,
+        [OPCODE_NCALL]   = &&op_NCALL,
+        [OPCODE_CALL]    = &&op_CALL,
+        [OPCODE_TAIL]    = &&op_TAIL,
+        [OPCODE_RET]     = &&op_RET,
+        [OPCODE_GROUP]   = &&op_GROUP,
+        [OPCODE_ESCAPE]  = &&op_ESCAPE,
+        [OPCODE_PACK]    = &&op_PACK,
+        [OPCODE_GPOP]    = &&op_GPOP,
+        [OPCODE_FOR]     = &&op_FOR,
+        [OPCODE_EXIT]    = &&op_EXIT,
+        [OPCODE_VARS]    = &&op_VARS,
+        [OPCODE_POP]     = &&op_POP,
+        [OPCODE_SETV]    = &&op_SETV,
+        [OPCODE_PUSHV]   = &&op_PUSHV,
+        [OPCODE_PUSHI]   = &&op_PUSHI,
+        [OPCODE_PUSHF]   = &&op_PUSHF,
+        [OPCODE_PUSHS]   = &&op_PUSHS,
+        [OPCODE_PUSHH]   = &&op_PUSHH,
+        [OPCODE_PUSHK]   = &&op_PUSHK,
+        [OPCODE_PUSHA]   = &&op_PUSHA,
+        [OPCODE_PUSHM]   = &&op_PUSHM,
+        [OPCODE_PUSHN]   = &&op_PUSHN,
+        [OPCODE_PUSHT]   = &&op_PUSHT,
+        [OPCODE_PUSHFL]  = &&op_PUSHFL,
+        [OPCODE_LEN]     = &&op_LEN,
+        [OPCODE_NEG]     = &&op_NEG,
+        [OPCODE_EQL]     = &&op_EQL,
+        [OPCODE_NQL]     = &&op_NQL,
+        [OPCODE_LSS]     = &&op_LSS,
+        [OPCODE_GRT]     = &&op_GRT,
+        [OPCODE_ADD]     = &&op_ADD,
+        [OPCODE_SUB]     = &&op_SUB,
+        [OPCODE_MUL]     = &&op_MUL,
+        [OPCODE_DIV]     = &&op_DIV,
+        [OPCODE_MOD]     = &&op_MOD,
+        [OPCODE_APPEND]  = &&op_APPEND,
+        [OPCODE_INSERT1] = &&op_INSERT1,
+        [OPCODE_INSERT2] = &&op_INSERT2,
+        [OPCODE_SELECT]  = &&op_SELECT,
+        [OPCODE_MARK]    = &&op_MARK,
+        [OPCODE_RESET]   = &&op_RESET,
+        [OPCODE_SETVP]   = &&op_SETVP,
+        [OPCODE_SETVI]   = &&op_SETVI,
+        [OPCODE_ADDVV]   = &&op_ADDVV,
+        [OPCODE_SELS]    = &&op_SELS,
+    };
+#endif
 
-        *rt_variable(rt, b2) = v1;
+    Instr *ins;
+    Type t;
+    Value v1;
+    Value v2;
+    Value v3;
+    int64_t i;
 
-        v1 = value_from_s64(i, rt->arena, &rt->err); // TODO: this could be in-place
-        *rt_variable(rt, b3) = v1;
-        break;
+    for (;;) {
+        DISPATCH {
 
-        case OPCODE_EXIT:
-        rt->state = RUNTIME_DONE;
-        break;
+            CASE(NOPE)
+            NEXT;
 
-        case OPCODE_POP:
-        ASSERT(rt->stack > 0);
-        rt->stack--;
-        break;
+            CASE(JUMP)
+            // Jumping back to the start of a loop
+            if ((int) ins->w < rt->off && !rt_check_room(rt))
+                return;
+            rt->off = ins->w;
+            NEXT;
+
+            CASE(JIFP)
+            ASSERT(rt->stack > 0);
+            v1 = rt->values[--rt->stack];
+            if (v1 == VALUE_FALSE)
+                rt->off = ins->w;
+            else if (value_type(v1) != TYPE_BOOL) {
+                REPORT(&rt->err, "Invalid non-boolean condition");
+                rt->state = RUNTIME_ERROR;
+                return;
+            }
+            NEXT;
 
-        case OPCODE_SETV:
-        ASSERT(rt->stack > 0);
-        b1 = rt_read_u8(rt);
-        *rt_variable(rt, b1) =  rt->values[rt->stack-1];
-        break;
+            CASE(VARS)
+            if (!rt_set_frame_vars(rt, ins->b[0], ins->w))
+                return;
+            NEXT;
+
+            CASE(OUTPUT)
+            if (rt->stack > 0) {
+                rt->cur_output = 0;
+                rt->cur_output_pos = 0;
+                rt->num_output = rt->stack;
+                if (rt->outbuf == NULL || !rt_buffer_output(rt)) {
+                    rt->state = RUNTIME_OUTPUT;
+                    return;
+                }
+                rt->stack -= rt->num_output;
+            }
+            NEXT;
 
-        case OPCODE_PUSHV:
-        if (!rt_check_stack(rt, 1)) break;
-        b1 = rt_read_u8(rt);
-        rt->values[rt->stack++] = *rt_variable(rt, b1);
-        break;
+            CASE(SYSVAR)
+            if (!rt_push_frame(rt, 0))
+                return;
+            rt->stack_before_user = rt->stack;
+            rt->str_for_user = ins->s;
+            rt->state = RUNTIME_SYSVAR;
+            return;
 
-        case OPCODE_PUSHI:
-        if (!rt_check_stack(rt, 1)) break;
-        i = rt_read_s64(rt);
-        v1 = value_from_s64(i, rt->arena, &rt->err);
-        rt->values[rt->stack++] = v1;
-        break;
+            CASE(SYSCALL)
+            if (!rt_push_frame(rt, ins->b[0]))
+                return;
+            rt->stack_before_user = rt->stack;
+            rt->str_for_user = ins->s;
+            rt->state = RUNTIME_SYSCALL;
+            return;
 
-        case OPCODE_PUSHF:
-        if (!rt_check_stack(rt, 1)) break;
-        f = rt_read_f64(rt);
-        v1 = value_from_f64(f, rt->arena, &rt->err);
-        rt->values[rt->stack++] = v1;
-        break;
+            CASE(NVAR)
+            if (!rt_call_native(rt, ins, 0, RUNTIME_SYSVAR))
+                return;
+            NEXT;
 
-        case OPCODE_PUSHS:
-        if (!rt_check_stack(rt, 1)) break;
-        s = rt_read_str(rt);
-        v1 = value_from_str(s, rt->arena, &rt->err);
-        rt->values[rt->stack++] = v1;
-        break;
+            CASE(NCALL)
+            if (!rt_call_native(rt, ins, ins->b[0], RUNTIME_SYSCALL))
+                return;
+            NEXT;
 
-        case OPCODE_PUSHA:
-        if (!rt_check_stack(rt, 1)) break;
-        o = rt_read_u32(rt);
-        v1 = value_empty_array(o, rt->arena, &rt->err);
-        rt->values[rt->stack++] = v1;
-        break;
+            CASE(CALL)
+            if (!rt_push_frame(rt, ins->b[0]))
+                return;
+            rt->off = ins->w;
+            NEXT;
+
+            CASE(TAIL)
+            // Recursive call as the last statement of the
+            // procedure. The arguments replace the ones of
+            // the current frame like rt_push_frame would
+            // place them in a new one.
+            for (int j = 0; j < ins->b[0]; j++)
+                *rt_variable(rt, j) = rt->values[--rt->stack];
+            rt->off = ins->w;
+            NEXT;
+
+            CASE(RET)
+            rt_pop_frame(rt);
+            if (!rt_check_room(rt))
+                return;
+            NEXT;
 
-        case OPCODE_PUSHM:
-        if (!rt_check_stack(rt, 1)) break;
-        o = rt_read_u32(rt);
-        v1 = value_empty_map(o, rt->arena, &rt->err);
-        rt->values[rt->stack++] = v1;
-        break;
+            CASE(GROUP)
+            rt_push_group(rt);
+            NEXT_CHECK;
 
-        case OPCODE_PUSHN:
-        if (!rt_check_stack(rt, 1)) break;
-        rt->values[rt->stack++] = VALUE_NONE;
-        break;
+            CASE(ESCAPE)
+            {
+                ASSERT(rt->num_groups > 0);
+                int start = rt->groups[--rt->num_groups];
 
-        case OPCODE_PUSHT:
-        if (!rt_check_stack(rt, 1)) break;
-        rt->values[rt->stack++] = VALUE_TRUE;
-        break;
+                for (int i = start; i < rt->stack; i++)
+                    rt->values[i] = value_escape(rt->values[i]);
+            }
+            NEXT;
 
-        case OPCODE_PUSHFL:
-        if (!rt_check_stack(rt, 1)) break;
-        rt->values[rt->stack++] = VALUE_FALSE;
-        break;
+            CASE(PACK)
+            rt_pack_group(rt);
+            NEXT_CHECK;
 
-        case OPCODE_LEN:
-        ASSERT(rt->stack > 0);
-        v1 = rt->values[rt->stack-1];
-        t = value_type(v1);
-        if (t != TYPE_ARRAY && t != TYPE_MAP) {
-            REPORT(&rt->err, "Invalid operation 'len' on non-aggregate value");
-            rt->state = RUNTIME_ERROR;
-            break;
-        }
-        v2 = value_from_s64(value_length(v1), rt->arena, &rt->err);
-        rt->values[rt->stack-1] = v2;
-        break;
+            CASE(GPOP)
+            rt_pop_group(rt);
+            NEXT;
 
-        case OPCODE_NEG:
-        ASSERT(rt->stack > 0);
-        v1 = rt->values[rt->stack-1];
-        v2 = value_neg(v1, rt->arena, &rt->err);
-        rt->values[rt->stack-1] = v2;
-        break;
+            CASE(FOR)
+            v1 = *rt_variable(rt, ins->b[2]);
+            ASSERT(value_type(v1) == TYPE_INT);
+            i = value_to_s64(v1);
 
-        case OPCODE_EQL:
-        ASSERT(rt->stack > 1);
-        v1 = rt->values[--rt->stack];
-        v2 = rt->values[--rt->stack];
-        v3 = value_eql(v2, v1) ? VALUE_TRUE : VALUE_FALSE;
-        rt->values[rt->stack++] = v3;
-        break;
+            v2 = *rt_variable(rt, ins->b[0]);
+            t = value_type(v2);
+            if (t != TYPE_ARRAY && t != TYPE_MAP) {
+                REPORT(&rt->err, "Invalid iteration over non-aggregate value");
+                rt->state = RUNTIME_ERROR;
+                return;
+            }
 
-        case OPCODE_NQL:
-        ASSERT(rt->stack > 1);
-        v1 = rt->values[--rt->stack];
-        v2 = rt->values[--rt->stack];
-        v3 = value_nql(v2, v1) ? VALUE_TRUE : VALUE_FALSE;
-        rt->values[rt->stack++] = v3;
-        break;
+            if (value_length(v2)-1 == i) {
+                rt->off = ins->w;
+                NEXT;
+            }
+            i++;
 
-        case OPCODE_LSS:
-        ASSERT(rt->stack > 1);
-        v1 = rt->values[--rt->stack];
-        v2 = rt->values[--rt->stack];
-        v3 = value_lower(v2, v1, &rt->err) ? VALUE_TRUE : VALUE_FALSE;
-        rt->values[rt->stack++] = v3;
-        break;
+            v1 = value_select_by_index(v2, i, &rt->err);
+            if (v1 == VALUE_ERROR) {
+                rt->state = RUNTIME_ERROR;
+                return;
+            }
 
-        case OPCODE_GRT:
-        ASSERT(rt->stack > 1);
-        v1 = rt->values[--rt->stack];
-        v2 = rt->values[--rt->stack];
-        v3 = value_greater(v2, v1, &rt->err) ? VALUE_TRUE : VALUE_FALSE;
-        rt->values[rt->stack++] = v3;
-        break;
+            *rt_variable(rt, ins->b[1]) = v1;
 
-        case OPCODE_ADD:
-        ASSERT(rt->stack > 1);
-        v1 = rt->values[--rt->stack];
-        v2 = rt->values[--rt->stack];
-        v3 = value_add(v2, v1, rt->arena, &rt->err);
-        rt->values[rt->stack++] = v3;
-        break;
+            v1 = value_from_s64(i, rt->arena, &rt->err); // TODO: this could be in-place
+            *rt_variable(rt, ins->b[2]) = v1;
+            NEXT_CHECK;
 
-        case OPCODE_SUB:
-        ASSERT(rt->stack > 1);
-        v1 = rt->values[--rt->stack];
-        v2 = rt->values[--rt->stack];
-        v3 = value_sub(v2, v1, rt->arena, &rt->err);
-        rt->values[rt->stack++] = v3;
-        break;
+            CASE(EXIT)
+            rt->state = RUNTIME_DONE;
+            return;
 
-        case OPCODE_MUL:
-        ASSERT(rt->stack > 1);
-        v1 = rt->values[--rt->stack];
-        v2 = rt->values[--rt->stack];
-        v3 = value_mul(v2, v1, rt->arena, &rt->err);
-        rt->values[rt->stack++] = v3;
-        break;
+            CASE(POP)
+            ASSERT(rt->stack > 0);
+            rt->stack--;
+            NEXT;
+
+            CASE(SETV)
+            ASSERT(rt->stack > 0);
+            *rt_variable(rt, ins->b[0]) = rt->values[rt->stack-1];
+            NEXT;
+
+            CASE(PUSHV)
+            rt->values[rt->stack++] = *rt_variable(rt, ins->b[0]);
+            NEXT;
+
+            CASE(PUSHI)
+            v1 = value_from_s64(ins->i, rt->arena, &rt->err);
+            rt->values[rt->stack++] = v1;
+            NEXT_CHECK;
+
+            CASE(PUSHF)
+            v1 = value_from_f64(ins->f, rt->arena, &rt->err);
+            rt->values[rt->stack++] = v1;
+            NEXT_CHECK;
+
+            CASE(PUSHS)
+            CASE(PUSHH)
+            rt->values[rt->stack++] = ins->v;
+            NEXT;
+
+            CASE(PUSHA)
+            v1 = value_empty_array(ins->w, rt->arena, &rt->err);
+            rt->values[rt->stack++] = v1;
+            NEXT_CHECK;
+
+            CASE(PUSHM)
+            v1 = value_empty_map(ins->w, rt->arena, &rt->err);
+            rt->values[rt->stack++] = v1;
+            NEXT_CHECK;
+
+            CASE(PUSHK)
+            v1 = value_share(ins->v, rt->arena, &rt->err);
+            rt->values[rt->stack++] = v1;
+            NEXT_CHECK;
+
+            CASE(PUSHN)
+            rt->values[rt->stack++] = VALUE_NONE;
+            NEXT;
+
+            CASE(PUSHT)
+            rt->values[rt->stack++] = VALUE_TRUE;
+            NEXT;
+
+            CASE(PUSHFL)
+            rt->values[rt->stack++] = VALUE_FALSE;
+            NEXT;
+
+            CASE(LEN)
+            ASSERT(rt->stack > 0);
+            v1 = rt->values[rt->stack-1];
+            t = value_type(v1);
+            if (t != TYPE_ARRAY && t != TYPE_MAP) {
+                REPORT(&rt->err, "Invalid operation 'len' on non-aggregate value");
+                rt->state = RUNTIME_ERROR;
+                return;
+            }
+            v2 = value_from_s64(value_length(v1), rt->arena, &rt->err);
+            rt->values[rt->stack-1] = v2;
+            NEXT_CHECK;
+
+            CASE(NEG)
+            ASSERT(rt->stack > 0);
+            v1 = rt->values[rt->stack-1];
+            v2 = value_neg(v1, rt->arena, &rt->err);
+            rt->values[rt->stack-1] = v2;
+            NEXT_CHECK;
+
+            CASE(EQL)
+            ASSERT(rt->stack > 1);
+            v1 = rt->values[--rt->stack];
+            v2 = rt->values[--rt->stack];
+            v3 = value_eql(v2, v1) ? VALUE_TRUE : VALUE_FALSE;
+            rt->values[rt->stack++] = v3;
+            NEXT;
+
+            CASE(NQL)
+            ASSERT(rt->stack > 1);
+            v1 = rt->values[--rt->stack];
+            v2 = rt->values[--rt->stack];
+            v3 = value_nql(v2, v1) ? VALUE_TRUE : VALUE_FALSE;
+            rt->values[rt->stack++] = v3;
+            NEXT;
+
+            CASE(LSS)
+            ASSERT(rt->stack > 1);
+            v1 = rt->values[--rt->stack];
+            v2 = rt->values[--rt->stack];
+            v3 = value_lower(v2, v1, &rt->err) ? VALUE_TRUE : VALUE_FALSE;
+            rt->values[rt->stack++] = v3;
+            NEXT_CHECK;
+
+            CASE(GRT)
+            ASSERT(rt->stack > 1);
+            v1 = rt->values[--rt->stack];
+            v2 = rt->values[--rt->stack];
+            v3 = value_greater(v2, v1, &rt->err) ? VALUE_TRUE : VALUE_FALSE;
+            rt->values[rt->stack++] = v3;
+            NEXT_CHECK;
+
+            CASE(ADD)
+            ASSERT(rt->stack > 1);
+            v1 = rt->values[--rt->stack];
+            v2 = rt->values[--rt->stack];
+            v3 = value_add(v2, v1, rt->arena, &rt->err);
+            rt->values[rt->stack++] = v3;
+            NEXT_CHECK;
+
+            CASE(SUB)
+            ASSERT(rt->stack > 1);
+            v1 = rt->values[--rt->stack];
+            v2 = rt->values[--rt->stack];
+            v3 = value_sub(v2, v1, rt->arena, &rt->err);
+            rt->values[rt->stack++] = v3;
+            NEXT_CHECK;
+
+            CASE(MUL)
+            ASSERT(rt->stack > 1);
+            v1 = rt->values[--rt->stack];
+            v2 = rt->values[--rt->stack];
+            v3 = value_mul(v2, v1, rt->arena, &rt->err);
+            rt->values[rt->stack++] = v3;
+            NEXT_CHECK;
+
+            CASE(DIV)
+            ASSERT(rt->stack > 1);
+            v1 = rt->values[--rt->stack];
+            v2 = rt->values[--rt->stack];
+            v3 = value_div(v2, v1, rt->arena, &rt->err);
+            rt->values[rt->stack++] = v3;
+            NEXT_CHECK;
+
+            CASE(MOD)
+            ASSERT(rt->stack > 1);
+            v1 = rt->values[--rt->stack];
+            v2 = rt->values[--rt->stack];
+            v3 = value_mod(v2, v1, rt->arena, &rt->err);
+            rt->values[rt->stack++] = v3;
+            NEXT_CHECK;
+
+            CASE(APPEND)
+            ASSERT(rt->stack > 1);
+            v2 = rt->values[--rt->stack];
+            v1 = rt->values[rt->stack-1];
+            value_append(v1, v2, rt->arena, &rt->err);
+            rt_write_barrier(rt, v1);
+            NEXT_CHECK;
+
+            CASE(INSERT1)
+            ASSERT(rt->stack > 2);
+            v1 = rt->values[--rt->stack];
+            v2 = rt->values[--rt->stack];
+            v3 = rt->values[rt->stack-1];
+            value_insert(v3, v1, v2, rt->arena, &rt->err);
+            rt_write_barrier(rt, v3);
+            NEXT_CHECK;
+
+            CASE(INSERT2)
+            ASSERT(rt->stack > 2);
+            v1 = rt->values[--rt->stack];
+            v2 = rt->values[--rt->stack];
+            v3 = rt->values[rt->stack-1];
+            value_insert(v2, v1, v3, rt->arena, &rt->err);
+            rt_write_barrier(rt, v2);
+            NEXT_CHECK;
+
+            CASE(SELECT)
+            ASSERT(rt->stack > 1);
+            v1 = rt->values[--rt->stack];
+            v2 = rt->values[--rt->stack];
+            v3 = value_select(v2, v1, &rt->err);
+            rt->values[rt->stack++] = v3;
+            NEXT_CHECK;
+
+            CASE(SETVP)
+            ASSERT(rt->stack > 0);
+            *rt_variable(rt, ins->b[0]) = rt->values[--rt->stack];
+            NEXT;
+
+            CASE(SETVI)
+            v1 = value_from_s64(ins->i, rt->arena, &rt->err);
+            *rt_variable(rt, ins->b[0]) = v1;
+            NEXT_CHECK;
+
+            CASE(ADDVV)
+            v1 = *rt_variable(rt, ins->b[0]);
+            v2 = *rt_variable(rt, ins->b[1]);
+            v3 = value_add(v1, v2, rt->arena, &rt->err);
+            rt->values[rt->stack++] = v3;
+            NEXT_CHECK;
+
+            CASE(SELS)
+            ASSERT(rt->stack > 0);
+            v1 = rt->values[rt->stack-1];
+            v2 = value_select_by_str(v1, ins->s, &rt->err);
+            rt->values[rt->stack-1] = v2;
+            NEXT_CHECK;
+
+            CASE(MARK)
+            rt->region = wl_arena_mark(rt->arena);
+            *rt_variable(rt, ins->b[0]) = BOX(TAG_INT, (Value) rt->region);
+            NEXT;
+
+            CASE(RESET)
+            rt_reclaim(rt, ins->b[0], ins->b[1]);
+            NEXT;
+
+            DEFAULT
+            UNREACHABLE;
+        }
+    }
+}
 
-        case OPCODE_DIV:
-        ASSERT(rt->stack > 1);
-        v1 = rt->values[--rt->stack];
-        v2 = rt->values[--rt->stack];
-        v3 = value_div(v2, v1, rt->arena, &rt->err);
-        rt->values[rt->stack++] = v3;
-        break;
+#undef NEXT_CHECK
+#undef NEXT
+#undef DEFAULT
+#undef CASE
+#undef DISPATCH
 
-        case OPCODE_MOD:
-        ASSERT(rt->stack > 1);
-        v1 = rt->values[--rt->stack];
-        v2 = rt->values[--rt->stack];
-        v3 = value_mod(v2, v1, rt->arena, &rt->err);
-        rt->values[rt->stack++] = v3;
-        break;
+// Resumes execution after the previous event was handled
+// by the host and runs the program until the next one
+static void rt_resume(WL_Runtime *rt)
+{
+    switch (rt->state) {
 
-        case OPCODE_APPEND:
-        ASSERT(rt->stack > 1);
-        v2 = rt->values[--rt->stack];
-        v1 = rt->values[rt->stack-1];
-        value_append(v1, v2, rt->arena, &rt->err);
+        case RUNTIME_BEGIN:
         break;
 
-        case OPCODE_INSERT1:
-        ASSERT(rt->stack > 2);
-        v1 = rt->values[--rt->stack];
-        v2 = rt->values[--rt->stack];
-        v3 = rt->values[rt->stack-1];
-        value_insert(v3, v1, v2, rt->arena, &rt->err);
-        break;
+        case RUNTIME_DONE:
+        case RUNTIME_ERROR:
+        return;
 
-        case OPCODE_INSERT2:
-        ASSERT(rt->stack > 2);
-        v1 = rt->values[--rt->stack];
-        v2 = rt->values[--rt->stack];
-        v3 = rt->values[rt->stack-1];
-        value_insert(v2, v1, v3, rt->arena, &rt->err);
+        case RUNTIME_OUTPUT:
+        if (rt->outbuf) {
+            rt->outbuf_len = 0;
+            if (!rt_buffer_output(rt))
+                return;
+        } else {
+            if (rt->cur_output < rt->num_output || rt->outbuf_rem.len > 0)
+                return;
+        }
+        rt->stack -= rt->num_output;
         break;
 
-        case OPCODE_SELECT:
-        ASSERT(rt->stack > 1);
-        v1 = rt->values[--rt->stack];
-        v2 = rt->values[--rt->stack];
-        v3 = value_select(v2, v1, &rt->err);
-        rt->values[rt->stack++] = v3;
+        case RUNTIME_SYSVAR:
+        case RUNTIME_SYSCALL:
+        if (!rt_return_from_user(rt))
+            return;
         break;
 
         default:
         UNREACHABLE;
     }
-}
-
-WL_EvalResult wl_runtime_eval(WL_Runtime *rt)
-{
-    if (rt->state != RUNTIME_OUTPUT || rt->cur_output == rt->num_output) {
-
-        switch (rt->state) {
-
-            case RUNTIME_BEGIN:
-            break;
-
-            case RUNTIME_DONE:
-            return (WL_EvalResult) { .type=WL_EVAL_DONE };
 
-            case RUNTIME_ERROR:
-            return (WL_EvalResult) { .type=WL_EVAL_ERROR };
+    rt->state = RUNTIME_LOOP;
 
-            case RUNTIME_OUTPUT:
-            rt->stack -= rt->num_output;
-            break;
-
-            case RUNTIME_SYSVAR:
-            {
-                ASSERT(rt->stack >= rt->stack_before_user);
-
-                int pushed_by_user = rt->stack - rt->stack_before_user;
-                if (pushed_by_user > 1) {
-                    REPORT(&rt->err, "Invalid API usage");
-                    rt->state = RUNTIME_ERROR;
-                    return (WL_EvalResult) { .type=WL_EVAL_ERROR };
-                }
-
-                if (rt->stack == rt->stack_before_user) {
-                    // User didn't push anything on the stack
-                    if (!rt_check_stack(rt, 1))
-                        return (WL_EvalResult) { .type=WL_EVAL_ERROR };
-                    rt->values[rt->stack++] = VALUE_NONE;
-                }
-
-                rt_pop_frame(rt);
-            }
-            break;
-
-            case RUNTIME_SYSCALL:
-            ASSERT(rt->stack >= rt->stack_before_user);
-            rt_pop_frame(rt);
-            break;
-
-            default:
-            UNREACHABLE;
-        }
-
-        rt->state = RUNTIME_LOOP;
-
-        do {
+    run(rt);
 
-            step(rt);
-
-            if (rt->err.yes)
-                rt->state = RUNTIME_ERROR;
+    if (rt->err.yes)
+        rt->state = RUNTIME_ERROR;
+}
 
-        } while (rt->state == RUNTIME_LOOP);
+WL_EvalResult wl_runtime_eval(WL_Runtime *rt)
+{
+    WL_String str;
+    WL_EvalResult res = wl_runtime_eval_iov(rt, &str, 1);
+    if (res.type == WL_EVAL_OUTPUT)
+        res.str = str;
+    return res;
+}
 
+WL_EvalResult wl_runtime_eval_iov(WL_Runtime *rt, WL_String *iov, int max)
+{
+    if (rt->outbuf_flush) {
+        rt->outbuf_flush = false;
+        rt->outbuf_len = 0;
+    } else
+        rt_resume(rt);
+
+    // When writing into the output buffer, buffered output
+    // is flushed before reporting any other event
+    if (rt->outbuf && rt->outbuf_len > 0 && rt->state != RUNTIME_OUTPUT && rt->state != RUNTIME_ERROR) {
+        rt->outbuf_flush = true;
+        if (max > 0)
+            iov[0] = (WL_String) { rt->outbuf, rt->outbuf_len };
+        return (WL_EvalResult) { .type=WL_EVAL_OUTPUT, .str={ rt->outbuf, rt->outbuf_len }, .count=1 };
     }
 
     switch (rt->state) {
@@ -5398,33 +9190,39 @@ WL_EvalResult wl_runtime_eval(WL_Runtime *rt)
         return (WL_EvalResult) { .type=WL_EVAL_ERROR };
 
         case RUNTIME_OUTPUT:
-        {
-            ASSERT(rt->cur_output < rt->num_output);
-
-            Value v = rt->values[rt->stack - rt->num_output + rt->cur_output];
-            Type type = value_type(v);
-
-            String str;
-            if (type == TYPE_STRING)
-                str = value_to_str(v);
-            else {
-                int len = value_convert_to_str(v, rt->buf, SIZEOF(rt->buf));
-                if (len > SIZEOF(rt->buf)) {
-                    char *p = alloc(rt->arena, len, 1);
-                    if (p == NULL) {
-                        REPORT(&rt->err, "Out of memory");
-                        rt->state = RUNTIME_ERROR;
-                        return (WL_EvalResult) { .type=WL_EVAL_ERROR };
-                    }
-                    len = value_convert_to_str(v, p, len);
-                    str = (String) { p, len };
-                } else {
-                    str = (String) { rt->buf, len };
-                }
+        if (rt->outbuf) {
+            if (max > 0)
+                iov[0] = (WL_String) { rt->outbuf, rt->outbuf_len };
+            return (WL_EvalResult) { .type=WL_EVAL_OUTPUT, .str={ rt->outbuf, rt->outbuf_len }, .count=1 };
+        } else {
+            ASSERT(rt->cur_output < rt->num_output || rt->outbuf_rem.len > 0);
+
+            int used = 0;
+            int count = 0;
+
+            // The output buffer was removed while part of a
+            // value was waiting to be copied into it
+            if (rt->outbuf_rem.len > 0 && max > 0) {
+                String rem = rt->outbuf_rem;
+                if (rem.ptr >= rt->buf && rem.ptr < rt->buf + SIZEOF(rt->buf))
+                    used = (rem.ptr + rem.len) - rt->buf;
+                iov[count++] = (WL_String) { rem.ptr, rem.len };
+                rt->outbuf_rem = (String) { NULL, 0 };
+            }
+
+            while (count < max && rt->cur_output < rt->num_output) {
+
+                String str;
+                int ret = rt_output_next(rt, &used, &str);
+                if (ret < 0)
+                    return (WL_EvalResult) { .type=WL_EVAL_ERROR };
+                if (ret == 0)
+                    break;
+
+                iov[count++] = (WL_String) { str.ptr, str.len };
             }
 
-            rt->cur_output++;
-            return (WL_EvalResult) { .type=WL_EVAL_OUTPUT, .str={ str.ptr, str.len } };
+            return (WL_EvalResult) { .type=WL_EVAL_OUTPUT, .count=count };
         }
 
         case RUNTIME_SYSVAR:
@@ -5437,6 +9235,18 @@ WL_EvalResult wl_runtime_eval(WL_Runtime *rt)
     return (WL_EvalResult) { .type=WL_EVAL_DONE };
 }
 
+void wl_runtime_set_output(WL_Runtime *rt, char *dst, int cap)
+{
+    if (dst == NULL || cap <= 0) {
+        rt->outbuf = NULL;
+        rt->outbuf_cap = 0;
+    } else {
+        rt->outbuf = dst;
+        rt->outbuf_cap = cap;
+    }
+    rt->outbuf_len = 0;
+}
+
 bool wl_streq(WL_String a, char *b, int blen)
 {
     if (b == NULL) b = "";
@@ -5454,15 +9264,30 @@ int wl_arg_count(WL_Runtime *rt)
     return rt->frames[rt->num_frames-1].varbase - rt->vars; // TODO: is this right?
 }
 
+// Returns the text of a string passed to the host. Strings
+// marked for escaping are escaped first, so that the host
+// sees the same text the program would output.
+static bool user_str(WL_Runtime *rt, Value v, WL_String *x)
+{
+    if (v & FLAG_ESCAPE) {
+        v = string_escape(v, rt->arena, &rt->err);
+        if (v == VALUE_ERROR)
+            return false;
+    }
+    String s = value_to_str(v);
+    *x = (WL_String) { s.ptr, s.len };
+    return true;
+}
+
 static Value user_arg(WL_Runtime *rt, int idx, Type type)
 {
     if (rt->state != RUNTIME_SYSVAR &&
         rt->state != RUNTIME_SYSCALL)
-        return -1;
+        return VALUE_ERROR;
 
     int tot = wl_arg_count(rt);
     if (idx < 0 || idx >= tot)
-        return false;
+        return VALUE_ERROR;
 
     Value v = *rt_variable(rt, tot - idx - 1);
     if (value_type(v) != type)
@@ -5511,9 +9336,7 @@ bool wl_arg_str(WL_Runtime *rt, int idx, WL_String *x)
     Value v = user_arg(rt, idx, TYPE_STRING);
     if (v == VALUE_ERROR)
         return false;
-    String s = value_to_str(v);
-    *x = (WL_String) { s.ptr, s.len };
-    return true;
+    return user_str(rt, v, x);
 }
 
 bool wl_arg_array(WL_Runtime *rt, int idx)
@@ -5588,9 +9411,7 @@ bool wl_peek_str(WL_Runtime *rt, int off, WL_String *x)
     Value v = user_peek(rt, off, TYPE_STRING);
     if (v == VALUE_ERROR)
         return false;
-    String s = value_to_str(v);
-    *x = (WL_String) { s.ptr, s.len };
-    return true;
+    return user_str(rt, v, x);
 }
 
 bool wl_pop_any(WL_Runtime *rt)
@@ -5665,9 +9486,7 @@ bool wl_pop_str(WL_Runtime *rt, WL_String *x)
     Value v = user_pop(rt, TYPE_STRING);
     if (v == VALUE_ERROR)
         return false;
-    String s = value_to_str(v);
-    *x = (WL_String) { s.ptr, s.len };
-    return true;
+    return user_str(rt, v, x);
 }
 
 void wl_push_none(WL_Runtime *rt)
@@ -5742,6 +9561,49 @@ void wl_push_f64(WL_Runtime *rt, double x)
     rt->values[rt->stack++] = v;
 }
 
+void wl_push_str_borrowed(WL_Runtime *rt, WL_String x)
+{
+    if (rt->state != RUNTIME_SYSVAR &&
+        rt->state != RUNTIME_SYSCALL)
+        return;
+
+    if (!rt_check_stack(rt, 1))
+        return;
+
+    Value v = value_from_str_borrowed((String) { x.ptr, x.len }, rt->arena, &rt->err);
+    if (v == VALUE_ERROR) {
+        rt->state = RUNTIME_ERROR;
+        return;
+    }
+
+    rt->values[rt->stack++] = v;
+}
+
+bool wl_push_json(WL_Runtime *rt, char *json, int len)
+{
+    // Parse errors don't fail the runtime, so they are
+    // reported separately (see wl_json_error)
+    rt->json_err = (Error) { rt->json_msg, SIZEOF(rt->json_msg), false };
+    rt->json_msg[0] = '\0';
+
+    if (rt->state != RUNTIME_SYSVAR &&
+        rt->state != RUNTIME_SYSCALL)
+        return false;
+
+    if (!rt_check_stack(rt, 1))
+        return false;
+
+    int mark = wl_arena_mark(rt->arena);
+    Value v = json_parse((String) { json, len }, rt->arena, &rt->json_err);
+    if (v == VALUE_ERROR) {
+        wl_arena_reset_to(rt->arena, mark);
+        return false;
+    }
+
+    rt->values[rt->stack++] = v;
+    return true;
+}
+
 void wl_push_str(WL_Runtime *rt, WL_String x)
 {
     if (rt->state != RUNTIME_SYSVAR &&
@@ -5815,6 +9677,41 @@ void wl_push_arg(WL_Runtime *rt, int idx)
     rt->values[rt->stack++] = *rt_variable(rt, tot - idx - 1);
 }
 
+int wl_keep(WL_Runtime *rt)
+{
+    if (rt->state != RUNTIME_SYSVAR &&
+        rt->state != RUNTIME_SYSCALL)
+        return -1;
+
+    if (rt->stack == rt->stack_before_user || rt->num_kept == MAX_KEPT)
+        return -1;
+
+    // The value may have been allocated during a loop
+    // iteration, so it must survive its reclamation
+    rt->pinned = wl_arena_mark(rt->arena);
+
+    rt->kept[rt->num_kept] = rt->values[rt->stack-1];
+    return rt->num_kept++;
+}
+
+void wl_push_kept(WL_Runtime *rt, int idx)
+{
+    if (rt->state != RUNTIME_SYSVAR &&
+        rt->state != RUNTIME_SYSCALL)
+        return;
+
+    if (!rt_check_stack(rt, 1))
+        return;
+
+    if (idx < 0 || idx >= rt->num_kept) {
+        REPORT(&rt->err, "Invalid API usage");
+        rt->state = RUNTIME_ERROR;
+        return;
+    }
+
+    rt->values[rt->stack++] = rt->kept[idx];
+}
+
 void wl_insert(WL_Runtime *rt)
 {
     if (rt->state != RUNTIME_SYSVAR &&
@@ -5835,6 +9732,8 @@ void wl_insert(WL_Runtime *rt)
         rt->state = RUNTIME_ERROR;
         return;
     }
+
+    rt_write_barrier(rt, set);
 }
 
 void wl_append(WL_Runtime *rt)
@@ -5856,6 +9755,8 @@ void wl_append(WL_Runtime *rt)
         rt->state = RUNTIME_ERROR;
         return;
     }
+
+    rt_write_barrier(rt, set);
 }
 
 void wl_runtime_dump(WL_Runtime *rt)
@@ -5,16 +5,36 @@
 
 typedef struct WL_Runtime  WL_Runtime;
 typedef struct WL_Compiler WL_Compiler;
+typedef struct WL_PreparedProgram WL_PreparedProgram;
 
 typedef struct {
     char *ptr;
     int   len;
 } WL_String;
 
+// Called by an arena that ran out of memory to get a new
+// block of "len" bytes. When "ptr" isn't NULL, the block
+// of "len" bytes it points to is given back instead and
+// the return value is ignored. Returning NULL makes the
+// allocation fail.
+typedef void *(*WL_BlockFunc)(void *data, void *ptr, int len);
+
+// An arena is a buffer of "len" bytes starting at "ptr",
+// of which the first "cur" are in use. If "block" is set,
+// the arena continues in new blocks obtained from it when
+// the buffer is full. The remaining fields are managed by
+// the arena and must be zero-initialized.
 typedef struct {
     char *ptr;
     int   len;
     int   cur;
+
+    WL_BlockFunc block;
+    void        *block_data;
+
+    int   base;
+    void *chain;
+    void *spare;
 } WL_Arena;
 
 typedef struct {
@@ -22,6 +42,36 @@ typedef struct {
     int   len;
 } WL_Program;
 
+typedef enum {
+    WL_SYMBOL_VAR,
+    WL_SYMBOL_CALL,
+} WL_SymbolType;
+
+// External variable ($name) or function ($name(...))
+// referenced by a program. Functions called with a
+// different number of arguments are listed once for
+// each count.
+typedef struct {
+    WL_SymbolType type;
+    WL_String     name;
+    int           args;
+} WL_Symbol;
+
+// Host function bound to an external name using
+// wl_compiler_bind_native. It's called in place of the
+// WL_EVAL_SYSVAR or WL_EVAL_SYSCALL event and can use
+// the same wl_arg_* and wl_push_* functions to access
+// the arguments and return values.
+typedef void (*WL_NativeFunc)(WL_Runtime *rt, void *data);
+
+// Entry of the table of host functions passed to
+// wl_program_prepare_natives
+typedef struct {
+    WL_String     name;
+    WL_NativeFunc func;
+    void*         data;
+} WL_Native;
+
 typedef enum {
     WL_ADD_ERROR,
     WL_ADD_AGAIN,
@@ -45,8 +95,19 @@ typedef enum {
 typedef struct {
     WL_EvalResultType type;
     WL_String str;
+    int       count;
 } WL_EvalResult;
 
+// Returns the current position of the arena, which
+// can be passed to wl_arena_reset_to to free everything
+// that was allocated after it.
+int  wl_arena_mark(WL_Arena *arena);
+void wl_arena_reset_to(WL_Arena *arena, int mark);
+
+// Frees everything allocated from the arena and gives back
+// all blocks that were obtained from its block function.
+void wl_arena_free(WL_Arena *arena);
+
 // Creates a compilation unit for a program
 // The provided arena (which can't be NULL) is
 // used for all memory allocations until a
@@ -55,6 +116,22 @@ typedef struct {
 // returned.
 WL_Compiler *wl_compiler_init(WL_Arena *arena);
 
+// Binds the external name "name" (referenced as $name
+// or $name(...) by the program) to a host function, so
+// that the runtime calls it directly instead of reporting
+// an event. The program only refers to the function by
+// name and the function itself must be provided to
+// wl_program_prepare_natives. Returns 0 on success or -1
+// if too many functions were bound.
+int wl_compiler_bind_native(WL_Compiler *compiler, WL_String name);
+
+// Sets the maximum size (in syntax tree nodes) of the body
+// of procedures whose calls are replaced by the body itself
+// when the program is linked. Only procedures that don't
+// call other procedures are inlined. Passing 0 disables
+// inlining. The default is 32.
+void wl_compiler_set_inline_budget(WL_Compiler *compiler, int budget);
+
 // Adds a file to the current compilation unit
 // and returns
 //
@@ -103,14 +180,73 @@ int wl_dump_ast(WL_Compiler *compiler, char *dst, int cap);
 // human-readable string.
 void wl_dump_program(WL_Program program);
 
+// Lists the external symbols that the program may request
+// through WL_EVAL_SYSVAR and WL_EVAL_SYSCALL events, which
+// allows fetching all of their values before running it.
+// Names bound with wl_compiler_bind_native aren't listed.
+// The names refer to the program's memory.
+//
+// Up to "cap" symbols are written to "dst" and the total
+// number of symbols is returned. If the program is invalid,
+// -1 is returned.
+int wl_program_symbols(WL_Program program, WL_Symbol *dst, int cap);
+
+// Decodes a bytecode program into the form executed
+// by the runtime. The result is allocated from the
+// arena, is never modified by evaluation and can be
+// kept around and shared by any number of runtimes
+// (also concurrently). It refers to the program's
+// memory, so the program must outlive it.
+//
+// The bytecode is verified so that no sequence of
+// instructions can access values outside of the stack
+// or the variables of its frame, which lets the runtime
+// skip those checks while evaluating it.
+//
+// If not enough memory was provided or the program is
+// invalid, NULL is returned.
+WL_PreparedProgram *wl_program_prepare(WL_Arena *arena, WL_Program program);
+
+// Same as wl_program_prepare, but also resolves the names
+// bound with wl_compiler_bind_native against the table of
+// host functions "natives". If the program refers to a name
+// that isn't in the table, NULL is returned. Programs using
+// native functions can't be prepared any other way.
+WL_PreparedProgram *wl_program_prepare_natives(WL_Arena *arena, WL_Program program, WL_Native *natives, int num_natives);
+
 // Creates an evaluation context for a bytecode program
 // All memory used while running the program will be
 // allocated from the provided arena.
 //
+// This is equivalent to calling wl_program_prepare
+// followed by wl_runtime_init_prepared.
+//
 // If not enough memory was provided or the program is
 // invalid, NULL is returned.
 WL_Runtime *wl_runtime_init(WL_Arena *arena, WL_Program program);
 
+// Creates an evaluation context for a program that was
+// already prepared using wl_program_prepare. Returns
+// NULL if not enough memory was provided.
+WL_Runtime *wl_runtime_init_prepared(WL_Arena *arena, WL_PreparedProgram *program);
+
+// Same as wl_runtime_init_prepared, but lets the caller
+// choose how many values (variables and temporaries)
+// and nested calls the runtime can hold. Both stacks
+// start out sized for the program's global variables
+// and grow from the arena up to these limits, so idle
+// runtimes stay small. Passing 0 selects the default
+// limit of 1024.
+WL_Runtime *wl_runtime_init_limits(WL_Arena *arena, WL_PreparedProgram *program, int max_stack, int max_frames);
+
+// Rewinds a runtime so that the program can be evaluated
+// again from the start. Everything allocated from the
+// runtime's arena after the runtime was created is freed,
+// so values from the previous evaluation (including its
+// output) must not be used anymore. The output buffer
+// set with wl_runtime_set_output is kept.
+void wl_runtime_reset(WL_Runtime *rt);
+
 // Run the program associated to this runtime until an
 // event happens. The event may be one of:
 //
@@ -119,7 +255,9 @@ WL_Runtime *wl_runtime_init(WL_Arena *arena, WL_Program program);
 //   WL_EVAL_ERROR if execution failed
 //
 //   WL_EVAL_OUTPUT if data is available for output,
-//   in which case the field "str" points to it
+//   in which case the field "str" points to it. The
+//   data is only valid until the next evaluation call
+//   since loops free the memory used by their iterations.
 //
 //   WL_EVAL_SYSVAR if the program requested the value
 //   of an external symbol.
@@ -128,6 +266,28 @@ WL_Runtime *wl_runtime_init(WL_Arena *arena, WL_Program program);
 //
 WL_EvalResult wl_runtime_eval(WL_Runtime *rt);
 
+// Same as wl_runtime_eval, except that output events
+// carry as many of the pending output segments as fit
+// in the "iov" array (up to "max") in a single call.
+// The number of segments is stored in the "count" field
+// of the result. Segments point directly to the string
+// data and are valid until the next evaluation call,
+// which makes them suitable to be passed to writev.
+WL_EvalResult wl_runtime_eval_iov(WL_Runtime *rt, WL_String *iov, int max);
+
+// Makes the runtime write output into the provided
+// buffer instead of returning it value by value. Output
+// events are only reported when the buffer is full or
+// before any other event is reported (including the end
+// of the program), in which case the "str" field (and
+// the first segment of wl_runtime_eval_iov) refers to
+// the buffered bytes.
+//
+// The buffer may be replaced after each output event
+// to write into a chain of chunks. Passing NULL goes
+// back to returning values one by one.
+void wl_runtime_set_output(WL_Runtime *rt, char *dst, int cap);
+
 WL_String     wl_runtime_error(WL_Runtime *rt);
 
 void          wl_runtime_dump(WL_Runtime *rt);
@@ -163,3 +323,33 @@ void wl_push_map   (WL_Runtime *rt, int cap);
 void wl_push_arg   (WL_Runtime *rt, int idx);
 void wl_insert     (WL_Runtime *rt);
 void wl_append     (WL_Runtime *rt);
+
+// Parses a JSON document and pushes it as a single value.
+// Objects become maps, arrays become arrays and null is
+// pushed as none. Strings without escape sequences are not
+// copied, so the text must not change until the runtime
+// is done. Returns false if the document is invalid or
+// the memory ran out, in which case nothing is pushed and
+// wl_json_error describes the problem. These errors don't
+// stop the runtime, so the host can push something else.
+bool wl_push_json(WL_Runtime *rt, char *json, int len);
+
+// Returns the error of the last call to wl_push_json, or
+// an empty string if it succeeded
+WL_String wl_json_error(WL_Runtime *rt);
+
+// Keeps the value on top of the stack (pushed during the
+// current event) so that it can be pushed again later with
+// wl_push_kept without building it again. Returns the index
+// to pass to wl_push_kept, or -1 if there is no value or too
+// many were kept. Kept values are the same value every time
+// they're pushed, so changes made by the program to a kept
+// array or map are seen by later pushes. They are valid
+// until the runtime is reset.
+int  wl_keep       (WL_Runtime *rt);
+void wl_push_kept  (WL_Runtime *rt, int idx);
+
+// Same as wl_push_str, except the string is not copied.
+// The memory it refers to must not change until the
+// runtime is done.
+void wl_push_str_borrowed(WL_Runtime *rt, WL_String x);